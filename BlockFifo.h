@@ -0,0 +1,122 @@
+//
+//  BlockFifo.h
+//  Synthesis
+//
+//  The block FIFO adapter between the host's buffers and the engine's blocks. The engine renders whole blocks (of an adaptive size, see
+//  OpenCL::updateBlockSize), but the host can call us with any buffer size (32, 64, 441, variable...): each host frame is one frame of input
+//  (MIDI events + voice envelopes for the block being built) and one frame of output, read out of the output ring. Templated on where the
+//  MIDI comes from (MIDIReceiver in the plugin), so it can be driven without a host - see tests/BlockFifoTest.cpp.
+//
+
+#ifndef __Synthesis__BlockFifo__
+#define __Synthesis__BlockFifo__
+
+#include "VoiceManager.h"
+#include "RingBuffer.h"
+
+#define OUTPUT_RING_SIZE 16384 // frames (power of two) - holds the latency (one max-size block, or the render-ahead latency) plus one batch
+
+typedef PlanarRingBuffer<double, NUM_CHANNELS, OUTPUT_RING_SIZE, MAX_BLOCK_SIZE> OutputRing;
+
+/// EventQueue needs getNextEventOffset(end) (offset of the next event before end, or end), advance(offset) (dispatches the events at offset),
+/// coalesceControlChanges(end) (may drop events before end that a later one before end supersedes) and Flush(nFrames), all with offsets
+/// relative to the start of the current host buffer - the way MIDIReceiver does it
+template <class EventQueue>
+class BlockFifo {
+public:
+    BlockFifo(VoiceManager& voiceManager, EventQueue& events) :
+    mVoiceManager(voiceManager),
+    mEvents(events),
+    mBlockPosition(0) {};
+
+    // primes the output ring with latency frames of silence - output is played exactly that far behind the input that produced it. only while
+    // nothing's taking input in or playing output out
+    void reset(int latency) {
+        mOutputRing.clear();
+        mOutputRing.writeSilence(latency);
+        mBlockPosition = 0;
+    }
+
+    // takes in frames pos..end of the current host buffer (hostFrames long) - no more than MAX_BLOCK_SIZE - getBlockPosition() of them, so
+    // the batch fits - and renders the blocks that completes into the output ring
+    void takeIn(int pos, int end, int hostFrames) {
+        for (int i = pos; i < end; ) {
+            i = advanceEngine(i, end, hostFrames);
+        }
+        renderBatch(hostFrames);
+    }
+
+    // rendering in the audio callback: all the input for (up to a max-size block of) the buffer is there up front, so it all gets taken in
+    // first, the blocks it completes go to the GPU in one batch, and then the frames get played out. primed by reset() with one max-size block,
+    // latency stays at exactly the max block size no matter how the block size changes - or how many blocks go in a batch: after every chunk,
+    // getOutputRing().getReadSpace() + getBlockPosition() is the latency again
+    void process(double** outputs, int nFrames) {
+        int pos = 0;
+        while (pos < nFrames) {
+            int chunkEnd = std::min(nFrames, pos + MAX_BLOCK_SIZE); // the most a batch can hold, and what keeps the ring from overfilling
+            takeIn(pos, chunkEnd, nFrames);
+            mOutputRing.read(outputs, pos, chunkEnd - pos); // play out as many frames as we just took in (already clipped)
+            pos = chunkEnd;
+        }
+        mEvents.Flush(nFrames);
+    }
+
+    inline int getBlockPosition() const { return mBlockPosition; }
+    inline OutputRing& getOutputRing() { return mOutputRing; }
+
+private:
+    // takes in frames pos..nFrames of input (or up to wherever the engine block being built is complete, if that's sooner): dispatches the queued MIDI and advances the voice envelopes.
+    // a completed block joins the batch waiting to be rendered (see renderBatch). returns the frame it got up to.
+    int advanceEngine(int pos, int nFrames, int hostFrames) {
+        if (mBlockPosition == 0) {
+            // the batch is rendered with the engine state as it is once it goes off - so it has to go before a block that changes that state
+            // (a note-on can take over a slot the batch is still playing, a knob can move), and before a block that wouldn't fit in it
+            int inputEnd = std::min(nFrames, pos + mVoiceManager.getBlockSize());
+            if (mVoiceManager.getBatchFrames() + mVoiceManager.getBlockSize() > MAX_BLOCK_SIZE || mEvents.getNextEventOffset(inputEnd) < inputEnd || mVoiceManager.hasParameterChanges()) {
+                renderBatch(hostFrames);
+            }
+            mVoiceManager.applyParameterChanges(); // knob changes land between blocks
+        }
+        int blockSize = mVoiceManager.getBlockSize();
+        int blockEnd = std::min(nFrames, pos + blockSize - mBlockPosition); // frame where the input for the current engine block is complete
+
+        mEvents.coalesceControlChanges(blockEnd); // whatever comes in before blockEnd goes into this block's render
+
+        // split the input at MIDI event timestamps - events get dispatched at segment boundaries and the voice envelopes advance a whole segment at a time
+        int segmentStart = pos;
+        while (segmentStart < blockEnd) {
+            mEvents.advance(segmentStart);
+            int segmentEnd = mEvents.getNextEventOffset(blockEnd);
+            mVoiceManager.updateVoiceDampingAndEnergy(mBlockPosition + segmentStart - pos, segmentEnd - segmentStart);
+            segmentStart = segmentEnd;
+        }
+
+        mBlockPosition += blockEnd - pos;
+        if (mBlockPosition == blockSize) {
+            mVoiceManager.queueBlock();
+            mBlockPosition = 0;
+        }
+        return blockEnd;
+    }
+
+    // renders every block gathered since the last batch in one dispatch, straight into the output ring (the render-ahead loop makes sure
+    // there's room, and in the audio callback there always is)
+    void renderBatch(int hostFrames) {
+        int batchFrames = mVoiceManager.getBatchFrames();
+        if (batchFrames == 0) return;
+        mVoiceManager.setFreeInaudibleVoices();
+        double* batchOutputs[NUM_CHANNELS] = { mOutputRing.getWritePointer(0), mOutputRing.getWritePointer(1) };
+        mVoiceManager.renderBatch(batchOutputs, mBlockPosition);
+        mOutputRing.commitWrite(batchFrames);
+        if (mBlockPosition == 0) {
+            mVoiceManager.updateBlockSize(hostFrames); // pick the size of the next block - not halfway through one
+        }
+    }
+
+    VoiceManager& mVoiceManager;
+    EventQueue& mEvents;
+    int mBlockPosition; // frames of input already gathered for the engine block currently being built
+    OutputRing mOutputRing; // rendered frames waiting to be played out - the FIFO, or in render-ahead mode, the way from the render thread to the audio thread
+};
+
+#endif /* defined(__Synthesis__BlockFifo__) */
@@ -0,0 +1,925 @@
+//
+//  GPUService.cpp
+//  Synthesis
+//
+//
+
+#define __NO_STD_VECTOR // Use cl::vector instead of STL vector
+#define __NO_STD_STRING // Use cl::string instead of STL string
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "GPUService.h"
+
+void CL_CALLBACK ping(cl_event, cl_int, void*) {
+    std::cout << "\nCallback triggered - PING!";
+}
+
+GPUService::GPUService() :
+mNumPending(0),
+mRoundInstances(0),
+mServiceRunning(false),
+mInitialized(false),
+mReady(false),
+mLost(false),
+mUsedInstances(0),
+mResyncInstances(0),
+mZeroCopy(false),
+mNumDevices(0),
+mDispatchCount(0)
+{
+    std::fill(mSlotDevices, mSlotDevices + MAX_SLOTS, -1);
+}
+
+GPUService::~GPUService() {
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mServiceRunning = false;
+    }
+    mRequestQueued.notify_one();
+    if (mServiceThread.joinable()) {
+        mServiceThread.join();
+    }
+    for (int i = 0; i < mNumDevices; i++) {
+        if (mDevices[i].persistent) {
+            stopPersistentKernel(mDevices[i]);
+        }
+    }
+}
+
+int GPUService::registerClient() {
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mInitialized) {
+        mInitialized = true;
+        initOpenCL(); // one context and one compile for the whole process, however many instances get opened
+        if (mReady) {
+            mServiceRunning = true;
+            mServiceThread = std::thread(&GPUService::serviceLoop, this);
+        }
+    }
+    if (!mReady) {
+        return -1;
+    }
+    for (int instance = 0; instance < MAX_INSTANCES; instance++) {
+        if (!(mUsedInstances & (1u << instance))) {
+            mUsedInstances |= 1u << instance;
+            mResyncInstances.fetch_or(1u << instance); // whatever the last instance in this slot left on the device is stale
+            return instance * MAX_VOICES;
+        }
+    }
+    std::cout << "\nno room for another instance on the GPU (" << MAX_INSTANCES << " max), it will be silent" << std::endl;
+    return -1;
+}
+
+void GPUService::unregisterClient(OpenCL *client) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mUsedInstances &= ~(1u << (client->mSlotBase / MAX_VOICES));
+    for (int slot = client->mSlotBase; slot < client->mSlotBase + MAX_VOICES; slot++) {
+        if (mSlotDevices[slot] >= 0) {
+            mDevices[mSlotDevices[slot]].numVoices--;
+            mSlotDevices[slot] = -1;
+        }
+    }
+}
+
+void GPUService::initOpenCL() {
+    try {
+        Platform::get(&platforms);
+
+        // Select the default platform and create a context using this platform and the GPU
+        cl_context_properties cps[3] = {
+            CL_CONTEXT_PLATFORM,
+            (cl_context_properties)(platforms[0])(),
+            0
+        };
+
+        context = Context( CL_DEVICE_TYPE_GPU, cps);
+
+        devices = context.getInfo<CL_CONTEXT_DEVICES>();
+
+//        std::cout << "DEVICES = " << devices[0].getInfo<CL_DEVICE_NAME>().c_str() << ", " << devices[1].getInfo<CL_DEVICE_NAME>().c_str() << "\n\n";
+
+        bool verbose = false;
+
+        if (verbose) {
+            // Print out details of the first device
+            std::cout << "\nDevice: " << devices[0].getInfo<CL_DEVICE_NAME>().c_str();
+            std::cout << "\nVersion: " << devices[0].getInfo<CL_DEVICE_VERSION>().c_str();
+            std::cout << "\nMax Compute Units: " << devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+            std::cout << "\nGlobal Memory Size: " << devices[0].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()/1000000.0 << " MB";
+            std::cout << "\nLocal Memory Size: " << devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << " bytes";
+            std::cout << "\nMax Memory Object Size: " << devices[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() << " bytes";
+            std::cout << "\nMax Work Group Size: " << devices[0].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+            std::cout << "\nMax Work Item Dimensions: " << devices[0].getInfo<CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS>();
+            std::cout << "\nMax Work Item Sizes: " << devices[0].getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+            std::cout << "\nPreferred Vector Width (Float): " << devices[0].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+            std::cout << "\nPreferred Vector Width (Double): " << devices[0].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE>();
+            std::cout << "\nExtensions: " << devices[0].getInfo<CL_DEVICE_EXTENSIONS>().c_str();
+        }
+
+        // Create a command queue and use the first device
+        // queue = CommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE);
+        // Let's try using the second GPU on the Mac Pro!
+        // ...or all of them - every GPU in the context gets a queue, and the voices are split across them
+        mNumDevices = std::min((int)devices.size(), MAX_RENDER_DEVICES);
+
+        // Read source file
+        std::ifstream sourceFile("opencl_kernels.cl");
+        std::string sourceCode(std::istreambuf_iterator<char>(sourceFile), (std::istreambuf_iterator<char>()));
+        Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length()+1));
+
+        // Make program of the source code in the context
+        program = Program(context, source);
+
+        // Build program for these specific devices
+        std::ostringstream buildOptions;
+        buildOptions << "-cl-finite-math-only -cl-no-signed-zeros -D NUM_VOICE_PARAMS=" << NUM_VOICE_PARAMS << " -D MAX_PARTIALS=" << MAX_PARTIALS << " -D MAX_BLOCK_SIZE=" << MAX_BLOCK_SIZE
+                     << " -D NUM_CHANNELS=" << NUM_CHANNELS << " -D NUM_INSTRUMENT_PARAMS=" << NUM_INSTRUMENT_PARAMS
+                     << " -D MULTIRATE_BANDS=" << MULTIRATE_BANDS << " -D MAX_DECIMATION=" << MAX_DECIMATION << " -D INTERPOLATOR_TAPS=" << INTERPOLATOR_TAPS << " -D BAND_ROW_LENGTH=" << BAND_ROW_LENGTH
+                     << " -D WAVETABLE_LENGTH=" << WAVETABLE_LENGTH << " -D WAVETABLE_LAYERS=" << WAVETABLE_LAYERS << " -D WAVETABLE_MAX_PARTIALS=" << WAVETABLE_MAX_PARTIALS
+                     << " -D MODAL_GROUP_SIZE=" << MODAL_GROUP_SIZE << " -D MODAL_CHUNK=" << MODAL_CHUNK << " -D MODAL_RESONATORS=" << MODAL_RESONATORS << " -D MAX_VOICES=" << MAX_VOICES
+                     << " -D PERSISTENT_KERNEL=" << PERSISTENT_KERNEL << " -D MAX_INSTANCES=" << MAX_INSTANCES << " -D MAX_SLOTS=" << MAX_SLOTS
+                     << " -D WAVETABLE_CACHE_ENTRIES=" << WAVETABLE_CACHE_ENTRIES << " -D WAVETABLE_BAKES=" << WAVETABLE_BAKES << " -D WAVETABLE_SPECTRUM_SIZE=" << WAVETABLE_SPECTRUM_SIZE;
+        program.build(devices, buildOptions.str().c_str());
+
+        string log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
+
+        std::cout << "\n\n\n" << log.c_str();
+
+        // zero-copy pays off whenever the device works out of host memory anyway - only if it does for all of them, to keep things simple
+        mZeroCopy = ZERO_COPY_BUFFERS > 0;
+        if (ZERO_COPY_BUFFERS < 0) {
+            mZeroCopy = true;
+            for (int i = 0; i < mNumDevices; i++) {
+                bool unifiedMemory = devices[i].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+                bool cpuDevice = devices[i].getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU;
+                mZeroCopy = mZeroCopy && (unifiedMemory || cpuDevice);
+            }
+        }
+
+        for (int i = 0; i < mNumDevices; i++) {
+            RenderDevice& device = mDevices[i];
+            device.device = devices[i];
+            device.queue = CommandQueue(context, devices[i], CL_QUEUE_PROFILING_ENABLE);
+
+            // Make kernel - one set per device, since each one's arguments are that device's buffers
+            device.oscillatorKernel = Kernel(program, "oscillator");
+            device.oscillatorBandsKernel = Kernel(program, "oscillator_bands");
+            device.addVoicesKernel = Kernel(program, "add_voices");
+            device.initPartialsKernel = Kernel(program, "init_partials");
+            device.bakeWavetablesKernel = Kernel(program, "bake_wavetables");
+            if (MODAL_RESONATORS) {
+                device.modalResonatorsKernel = Kernel(program, "modal_resonators"); // only in the program if it's in use
+            }
+            createBuffers(device);
+            for (int entry = 0; entry < WAVETABLE_CACHE_ENTRIES; entry++) {
+                device.wavetables[entry].slot = -1;
+                device.wavetables[entry].lastUsed = 0;
+            }
+
+            device.relativeSpeed = std::max(1.0, (double)devices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * devices[i].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>());
+            device.voiceSampleTime = 0.0;
+            device.numVoices = 0;
+            device.persistent = false;
+            device.mailbox = NULL;
+            if (PERSISTENT_KERNEL && startPersistentKernel(device)) {
+                std::cout << "\npersistent renderer running on " << devices[i].getInfo<CL_DEVICE_NAME>().c_str() << std::endl;
+            }
+        }
+
+        printf("Kernels compiled successfully!");
+        mReady = true;
+
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        cl::STRING_CLASS buildlog;
+        buildlog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
+        std::cout << "\n\n\n" << buildlog.c_str() << "\n\n\n";
+    }
+}
+
+// all the buffers are allocated once, at their max size (every instance's slots, a max-size batch each) - a dispatch only uses the front of them
+void GPUService::createBuffers(RenderDevice& device) {
+    cl_mem_flags hostVisible = mZeroCopy ? CL_MEM_ALLOC_HOST_PTR : 0;
+    device.voiceRecordBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * NUM_VOICE_PARAMS * sizeof(float));
+    device.voiceOnsetBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * sizeof(cl_uint));
+    device.activeSlotsBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * sizeof(cl_int));
+    device.voiceGroupBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * sizeof(cl_int));
+    device.groupBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_INSTANCES * sizeof(RenderGroup));
+    device.initSlotsBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * sizeof(cl_int));
+    device.partialTableBuffer = Buffer(context, CL_MEM_READ_WRITE, MAX_SLOTS * MAX_PARTIALS * sizeof(float)); // filled in by init_partials - never leaves the device
+    device.voicesEnergyBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * MAX_BLOCK_SIZE * sizeof(float));
+    device.voicesSampleBuffer = Buffer(context, CL_MEM_READ_WRITE, MAX_SLOTS * MAX_BLOCK_SIZE * NUM_CHANNELS * sizeof(float)); // one row of samples per voice in the dispatch, added up per group by the adder kernel - never leaves the device
+    device.outputSampleBuffer = Buffer(context, CL_MEM_WRITE_ONLY | hostVisible, MAX_INSTANCES * MAX_BLOCK_SIZE * NUM_CHANNELS * sizeof(float));
+    device.voicesPeakBuffer = Buffer(context, CL_MEM_READ_WRITE | hostVisible, MAX_SLOTS * sizeof(float)); // float bits, merged as uints by add_voices
+    device.voiceBandsBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * MULTIRATE_BANDS * sizeof(cl_int));
+    device.bandSampleBuffer = Buffer(context, CL_MEM_READ_WRITE, MAX_SLOTS * MULTIRATE_BANDS * BAND_ROW_LENGTH * NUM_CHANNELS * sizeof(float)); // the decimated bands of each voice in the dispatch, interleaved - never leaves the device
+    device.interpolatorBuffer = Buffer(context, CL_MEM_READ_ONLY, INTERPOLATOR_SIZE * sizeof(float));
+    device.voiceWavetablesBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * sizeof(cl_int));
+    device.wavetableBuffer = Buffer(context, CL_MEM_READ_WRITE, WAVETABLE_CACHE_ENTRIES * WAVETABLE_LAYERS * WAVETABLE_LENGTH * 4 * sizeof(float)); // baked by bake_wavetables - never leaves the device
+    device.wavetableInfoBuffer = Buffer(context, CL_MEM_READ_ONLY, WAVETABLE_CACHE_ENTRIES * sizeof(WavetableInfo));
+    device.wavetableSpectrumBuffer = Buffer(context, CL_MEM_READ_ONLY, WAVETABLE_BAKES * WAVETABLE_SPECTRUM_SIZE * sizeof(float));
+    device.wavetableBakesBuffer = Buffer(context, CL_MEM_READ_ONLY, WAVETABLE_BAKES * sizeof(cl_int));
+    if (MODAL_RESONATORS) {
+        device.voicesForceBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * MAX_BLOCK_SIZE * sizeof(float));
+        device.voiceModesBuffer = Buffer(context, CL_MEM_READ_ONLY, MAX_SLOTS * sizeof(ModalVoice));
+        device.modeStateBuffer = Buffer(context, CL_MEM_READ_WRITE, MAX_SLOTS * MAX_PARTIALS * 4 * sizeof(float)); // the resonators, carried on by modal_resonators from batch to batch - never leaves the device
+    }
+    float interpolator[INTERPOLATOR_SIZE];
+    OpenCL::buildInterpolator(interpolator); // the same coefficients every instance upsamples its CPU voices with
+    device.queue.enqueueWriteBuffer(device.interpolatorBuffer, CL_TRUE, 0, INTERPOLATOR_SIZE * sizeof(float), interpolator);
+
+    // the buffers never change, only the batch length does
+    device.oscillatorKernel.setArg(0, device.voiceRecordBuffer);
+    device.oscillatorKernel.setArg(1, device.voiceOnsetBuffer);
+    device.oscillatorKernel.setArg(2, device.activeSlotsBuffer);
+    device.oscillatorKernel.setArg(3, device.voiceGroupBuffer);
+    device.oscillatorKernel.setArg(4, device.groupBuffer);
+    device.oscillatorKernel.setArg(5, device.partialTableBuffer);
+    device.oscillatorKernel.setArg(6, device.voicesEnergyBuffer);
+    device.oscillatorKernel.setArg(7, device.voiceBandsBuffer);
+    device.oscillatorKernel.setArg(8, device.bandSampleBuffer);
+    device.oscillatorKernel.setArg(9, device.interpolatorBuffer);
+    device.oscillatorKernel.setArg(11, device.voicesSampleBuffer);
+    device.oscillatorKernel.setArg(12, device.voiceWavetablesBuffer);
+    device.oscillatorKernel.setArg(13, device.wavetableInfoBuffer);
+    device.oscillatorKernel.setArg(14, device.wavetableBuffer);
+    device.oscillatorBandsKernel.setArg(0, device.voiceRecordBuffer);
+    device.oscillatorBandsKernel.setArg(1, device.voiceOnsetBuffer);
+    device.oscillatorBandsKernel.setArg(2, device.activeSlotsBuffer);
+    device.oscillatorBandsKernel.setArg(3, device.voiceGroupBuffer);
+    device.oscillatorBandsKernel.setArg(4, device.groupBuffer);
+    device.oscillatorBandsKernel.setArg(5, device.partialTableBuffer);
+    device.oscillatorBandsKernel.setArg(6, device.voicesEnergyBuffer);
+    device.oscillatorBandsKernel.setArg(7, device.voiceBandsBuffer);
+    device.oscillatorBandsKernel.setArg(9, device.bandSampleBuffer);
+    device.addVoicesKernel.setArg(0, device.voicesSampleBuffer);
+    device.addVoicesKernel.setArg(1, device.groupBuffer);
+    device.addVoicesKernel.setArg(3, device.outputSampleBuffer);
+    device.addVoicesKernel.setArg(4, device.voicesPeakBuffer);
+    device.initPartialsKernel.setArg(0, device.voiceRecordBuffer);
+    device.initPartialsKernel.setArg(1, device.initSlotsBuffer);
+    device.initPartialsKernel.setArg(3, device.partialTableBuffer);
+    device.bakeWavetablesKernel.setArg(0, device.wavetableBakesBuffer);
+    device.bakeWavetablesKernel.setArg(1, device.wavetableInfoBuffer);
+    device.bakeWavetablesKernel.setArg(2, device.wavetableSpectrumBuffer);
+    device.bakeWavetablesKernel.setArg(3, device.wavetableBuffer);
+    if (MODAL_RESONATORS) {
+        device.modalResonatorsKernel.setArg(0, device.voiceRecordBuffer);
+        device.modalResonatorsKernel.setArg(1, device.voiceOnsetBuffer);
+        device.modalResonatorsKernel.setArg(2, device.activeSlotsBuffer);
+        device.modalResonatorsKernel.setArg(3, device.voiceGroupBuffer);
+        device.modalResonatorsKernel.setArg(4, device.groupBuffer);
+        device.modalResonatorsKernel.setArg(5, device.partialTableBuffer);
+        device.modalResonatorsKernel.setArg(6, device.voicesEnergyBuffer);
+        device.modalResonatorsKernel.setArg(7, device.voicesForceBuffer);
+        device.modalResonatorsKernel.setArg(8, device.voiceModesBuffer);
+        device.modalResonatorsKernel.setArg(9, device.modeStateBuffer);
+        device.modalResonatorsKernel.setArg(10, device.voicesSampleBuffer);
+    }
+}
+
+void GPUService::render(OpenCL *client, double** outputs) {
+    RenderRequest request = {client, outputs, false};
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPending[mNumPending++] = &request;
+    mRequestQueued.notify_one();
+    lock.unlock();
+
+    // the voices routed to the CPU get rendered right here, on the instance's own thread, while the round gathers and goes out - the dispatch
+    // only reads the client's batch, and writes nothing this touches (the GPU voices' peaks come before the CPU voices')
+    client->renderCPUVoices();
+
+    lock.lock();
+    while (!request.done) {
+        mDispatchDone.wait(lock);
+    }
+}
+
+void GPUService::serviceLoop() {
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (mServiceRunning) {
+        if (mNumPending == 0) {
+            mRequestQueued.wait(lock);
+            continue;
+        }
+        // a round has started - wait for the rest of the instances that were in the last one (the ones still registered), but not for long:
+        // one that's gone quiet drops out of the next round
+        OpenCL *first = mPending[0]->client;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((long long)(GATHER_WINDOW * first->mBatchFrames * first->mTimeStep * 1.0e6));
+        while (mServiceRunning) {
+            unsigned int pendingInstances = 0;
+            for (int i = 0; i < mNumPending; i++) {
+                pendingInstances |= 1u << (mPending[i]->client->mSlotBase / MAX_VOICES);
+            }
+            unsigned int expected = mRoundInstances & mUsedInstances;
+            if ((pendingInstances & expected) == expected || mRequestQueued.wait_until(lock, deadline) == std::cv_status::timeout) {
+                break;
+            }
+        }
+        // take the round (its clients are all waiting in render(), so they hold still) and send it off as one dispatch
+        RenderRequest *requests[MAX_INSTANCES];
+        int numRequests = mNumPending;
+        std::copy(mPending, mPending + numRequests, requests);
+        mNumPending = 0;
+        mRoundInstances = 0;
+        for (int i = 0; i < numRequests; i++) {
+            mRoundInstances |= 1u << (requests[i]->client->mSlotBase / MAX_VOICES);
+        }
+        lock.unlock();
+
+        dispatch(requests, numRequests);
+
+        lock.lock();
+        for (int i = 0; i < numRequests; i++) {
+            requests[i]->done = true;
+        }
+        mDispatchDone.notify_all();
+    }
+}
+
+// the per-instance part of a dispatch, as the kernels see it
+void GPUService::describeBatch(OpenCL *client, RenderGroup& group) {
+    group.modPrevious = client->mModPrevious;
+    group.modCurrent = client->mModCurrent;
+    group.mB = client->mB;
+    group.partialDetuneRange = client->mPartialDetuneRange;
+    group.timeStep = client->mTimeStep;
+    group.partialCeiling = client->mPartialCeiling;
+    group.blockStartSample = client->mSampleClock;
+    group.numPartials = client->NUM_PARTIALS;
+    group.frames = client->mBatchFrames; // the whole batch is one long block as far as the kernels are concerned
+    group.numVoices = 0;
+    std::copy(client->instrumentData, client->instrumentData + NUM_INSTRUMENT_PARAMS, group.instrumentData);
+}
+
+// the device with the lowest predicted oscillator time once it has one more voice. a device that hasn't rendered anything yet is
+// estimated from a measured one, scaled by their compute units * clock
+int GPUService::pickDevice() {
+    int measured = -1;
+    for (int i = 0; i < mNumDevices; i++) {
+        if (mDevices[i].voiceSampleTime > 0.0) {
+            measured = i;
+            break;
+        }
+    }
+    int best = 0;
+    double bestTime = -1.0;
+    for (int i = 0; i < mNumDevices; i++) {
+        RenderDevice& device = mDevices[i];
+        double voiceSampleTime = device.voiceSampleTime;
+        if (voiceSampleTime <= 0.0) {
+            voiceSampleTime = measured < 0 ? 1.0 / device.relativeSpeed : mDevices[measured].voiceSampleTime * mDevices[measured].relativeSpeed / device.relativeSpeed;
+        }
+        double time = (device.numVoices + 1) * voiceSampleTime;
+        if (bestTime < 0.0 || time < bestTime) {
+            bestTime = time;
+            best = i;
+        }
+    }
+    return best;
+}
+
+// keeps each of the client's playing voices on the device it's on - only new notes (whose state gets uploaded anyway) get placed, and
+// voices that stopped playing (or went over to the CPU) give up their place. under the lock, since an instance going away (unregisterClient)
+// takes its voices off the devices' counts from its own thread
+void GPUService::assignDevices(OpenCL *client, unsigned int& dirtySlots, unsigned int& staleTableSlots) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    unsigned int activeSlots = 0;
+    for (int j = 0; j < client->mNumGPUVoices; j++) {
+        activeSlots |= 1u << client->activeSlots[j];
+    }
+    for (int slot = 0; slot < MAX_VOICES; slot++) {
+        int& slotDevice = mSlotDevices[client->mSlotBase + slot];
+        bool newNote = (dirtySlots & staleTableSlots & (1u << slot)) != 0;
+        if (slotDevice >= 0 && (newNote || !(activeSlots & (1u << slot)))) {
+            mDevices[slotDevice].numVoices--;
+            slotDevice = -1;
+        }
+        if (slotDevice < 0 && (activeSlots & (1u << slot))) {
+            slotDevice = pickDevice();
+            mDevices[slotDevice].numVoices++;
+            dirtySlots |= 1u << slot; // everything it needs has to get to its new device
+            staleTableSlots |= 1u << slot;
+        }
+    }
+}
+
+// uploads only what changed since the client's last batch, each to the device the voice lives on: the records of slots that were struck,
+// stolen or re-struck, and rebuilds the partial tables of new notes - all of it tiny and rare next to the energy rows
+void GPUService::uploadVoiceState(OpenCL *client, unsigned int dirtySlots, unsigned int staleTableSlots) {
+    int firstInitSlots[MAX_RENDER_DEVICES];
+    for (int i = 0; i < mNumDevices; i++) {
+        firstInitSlots[i] = mDevices[i].numInitSlots;
+    }
+    for (int slot = 0; slot < MAX_VOICES; slot++) {
+        int globalSlot = client->mSlotBase + slot;
+        if (mSlotDevices[globalSlot] < 0) { // not playing - it gets everything when it starts again
+            continue;
+        }
+        RenderDevice& device = mDevices[mSlotDevices[globalSlot]];
+        if ((dirtySlots & (1u << slot)) && device.persistent) {
+            std::copy(&client->voiceRecords[slot * NUM_VOICE_PARAMS], &client->voiceRecords[(slot + 1) * NUM_VOICE_PARAMS], &device.mailbox->voiceRecords[globalSlot * NUM_VOICE_PARAMS]);
+            device.mailbox->voiceOnsets[globalSlot] = client->voiceOnsets[slot];
+        } else if (dirtySlots & (1u << slot)) {
+            device.queue.enqueueWriteBuffer(device.voiceRecordBuffer, CL_FALSE, globalSlot * NUM_VOICE_PARAMS * sizeof(float), NUM_VOICE_PARAMS * sizeof(float), &client->voiceRecords[slot * NUM_VOICE_PARAMS]);
+            device.queue.enqueueWriteBuffer(device.voiceOnsetBuffer, CL_FALSE, globalSlot * sizeof(cl_uint), sizeof(cl_uint), &client->voiceOnsets[slot]);
+        }
+        if (staleTableSlots & (1u << slot)) {
+            device.initDetuneRanges[device.numInitSlots] = client->mPartialDetuneRange;
+            device.initSlots[device.numInitSlots++] = globalSlot;
+        }
+    }
+    // partial tables get rebuilt with the detune range of the instance they belong to (the persistent renderer gets them all with the round)
+    for (int i = 0; i < mNumDevices; i++) {
+        RenderDevice& device = mDevices[i];
+        int numInitSlots = device.numInitSlots - firstInitSlots[i];
+        if (numInitSlots > 0 && !device.persistent) {
+            device.initPartialsKernel.setArg(2, client->mPartialDetuneRange);
+            device.queue.enqueueWriteBuffer(device.initSlotsBuffer, CL_FALSE, firstInitSlots[i] * sizeof(cl_int), numInitSlots * sizeof(cl_int), &device.initSlots[firstInitSlots[i]]);
+            device.queue.enqueueNDRangeKernel(device.initPartialsKernel, NDRange(firstInitSlots[i]), NDRange(numInitSlots), NullRange);
+        }
+    }
+}
+
+// a slot's partial table is being rebuilt - a new note, a new detune range, or a new device - so whatever was baked for it is stale, on every device
+void GPUService::dropWavetables(OpenCL *client, unsigned int staleTableSlots) {
+    for (int i = 0; i < mNumDevices; i++) {
+        for (int entry = 0; entry < WAVETABLE_CACHE_ENTRIES; entry++) {
+            WavetableEntry& wavetable = mDevices[i].wavetables[entry];
+            int slot = wavetable.slot - client->mSlotBase;
+            if (wavetable.slot >= 0 && slot >= 0 && slot < MAX_VOICES && (staleTableSlots & (1u << slot))) {
+                wavetable.slot = -1;
+            }
+        }
+    }
+}
+
+// the cache entry a wavetable voice plays from on its device this dispatch - baked first if it isn't there yet, if the knobs it was baked with
+// changed, or if the voice gets louder this batch than it was baked for (a restrike). a new one takes the entry that was played least recently.
+// -1 (the voice stays additive) if every entry is playing in this dispatch, or the device has done all the baking it's doing for one dispatch
+int GPUService::findWavetable(OpenCL *client, int slot, RenderDevice& device) {
+    int globalSlot = client->mSlotBase + slot;
+    const float *energy = &client->voicesEnergy[slot * MAX_BLOCK_SIZE];
+    float topEnergy = *std::max_element(energy, energy + client->mBatchFrames);
+    int entry = -1;
+    int oldest = -1;
+    for (int i = 0; i < WAVETABLE_CACHE_ENTRIES; i++) {
+        WavetableEntry& wavetable = device.wavetables[i];
+        if (wavetable.slot == globalSlot) {
+            entry = i;
+            break;
+        }
+        if (wavetable.lastUsed != mDispatchCount && (oldest < 0 || mDispatchCount - wavetable.lastUsed > mDispatchCount - device.wavetables[oldest].lastUsed)) {
+            oldest = i;
+        }
+    }
+    if (entry < 0 || device.wavetables[entry].generation != client->mWavetableGeneration || device.wavetables[entry].topEnergy < topEnergy) {
+        if (entry < 0) {
+            entry = oldest;
+        }
+        if (entry < 0 || device.numBakes == WAVETABLE_BAKES || !client->buildWavetable(slot, topEnergy, device.wavetableInfos[entry], &device.bakeSpectra[device.numBakes * WAVETABLE_SPECTRUM_SIZE])) {
+            return -1;
+        }
+        WavetableEntry& wavetable = device.wavetables[entry];
+        wavetable.slot = globalSlot;
+        wavetable.generation = client->mWavetableGeneration;
+        wavetable.topEnergy = topEnergy;
+        device.bakeEntries[device.numBakes++] = entry;
+    }
+    device.wavetables[entry].lastUsed = mDispatchCount;
+    return entry;
+}
+
+// one launch of each kernel for all of the device's groups, sized for the longest batch among them, and the results on their way back
+void GPUService::launch(RenderDevice& device) {
+    device.queue.enqueueWriteBuffer(device.groupBuffer, CL_FALSE, 0, device.numGroups * sizeof(RenderGroup), device.groups);
+    device.queue.enqueueWriteBuffer(device.activeSlotsBuffer, CL_FALSE, 0, device.numActiveVoices * sizeof(cl_int), device.activeSlots);
+    device.queue.enqueueWriteBuffer(device.voiceGroupBuffer, CL_FALSE, 0, device.numActiveVoices * sizeof(cl_int), device.voiceGroups);
+    device.queue.enqueueWriteBuffer(device.voiceBandsBuffer, CL_FALSE, 0, device.numActiveVoices * MULTIRATE_BANDS * sizeof(cl_int), device.voiceBands);
+    device.queue.enqueueWriteBuffer(device.voiceWavetablesBuffer, CL_FALSE, 0, device.numActiveVoices * sizeof(cl_int), device.voiceWavetables);
+
+    /// the modal engine takes the place of the bands and the oscillator - a work-group per voice, running its resonators through the batch
+
+    if (MODAL_RESONATORS) {
+        device.queue.enqueueWriteBuffer(device.voiceModesBuffer, CL_FALSE, 0, device.numActiveVoices * sizeof(ModalVoice), device.voiceModes);
+        device.queue.enqueueNDRangeKernel(device.modalResonatorsKernel, NullRange, NDRange(device.numActiveVoices * MODAL_GROUP_SIZE), NDRange(MODAL_GROUP_SIZE), NULL, &device.oscillatorEvent);
+    } else {
+        /// bake the wavetables that are new or stale first - one work-item per sample of each layer of each of them (the shorter layers' tails just return)
+
+        if (device.numBakes > 0) {
+            for (int b = 0; b < device.numBakes; b++) {
+                int entry = device.bakeEntries[b];
+                device.queue.enqueueWriteBuffer(device.wavetableInfoBuffer, CL_FALSE, entry * sizeof(WavetableInfo), sizeof(WavetableInfo), &device.wavetableInfos[entry]);
+            }
+            device.queue.enqueueWriteBuffer(device.wavetableSpectrumBuffer, CL_FALSE, 0, device.numBakes * WAVETABLE_SPECTRUM_SIZE * sizeof(float), device.bakeSpectra);
+            device.queue.enqueueWriteBuffer(device.wavetableBakesBuffer, CL_FALSE, 0, device.numBakes * sizeof(cl_int), device.bakeEntries);
+            device.queue.enqueueNDRangeKernel(device.bakeWavetablesKernel, NullRange, NDRange(device.numBakes * WAVETABLE_LAYERS * WAVETABLE_LENGTH), NullRange);
+        }
+
+        /// launch oscillator kernel
+
+        /// architecture: each work-item computes one sample for one voice, voiceStride work-items per voice (the ones past the end of a shorter batch just return)
+
+        /// a voice's partial loop runs min(NUM_PARTIALS, ceiling / frequency) times, so a work-group that straddles two voices diverges. the stride is
+        /// padded up to a whole number of work-groups, so every work-group belongs to one voice and loops the same number of times all the way across
+        /// (the voices come heaviest first, see VoiceManager::updateVoiceData - the long work-groups go out first, and the short ones fill in behind them)
+        int maxLocalSize = static_cast<int>(device.oscillatorKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device.device));
+        int localMultiple = std::max(1, static_cast<int>(device.oscillatorKernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device.device))); // the SIMD width, near enough
+        int voiceStride = (device.maxFrames + localMultiple - 1) / localMultiple * localMultiple;
+        // the biggest work-group that divides the stride - batches are a multiple of MIN_BLOCK_SIZE frames, so halving gets there quickly
+        int localSize = std::min(voiceStride, maxLocalSize);
+        while (voiceStride%localSize > 0) {
+            localSize /= 2;
+        }
+
+        /// multirate: the partials low enough for a decimated band go first, at the band's rate - one work-item per low-rate sample, each band
+        /// of each voice padded to whole work-groups the same way (the fs/4 band's tail work-groups just return)
+        if (device.hasBands) {
+            int bandStride = (device.maxFrames / 2 + INTERPOLATOR_TAPS + 1 + localMultiple - 1) / localMultiple * localMultiple;
+            int bandLocalSize = std::min(bandStride, static_cast<int>(device.oscillatorBandsKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device.device)));
+            while (bandStride%bandLocalSize > 0) {
+                bandLocalSize /= 2;
+            }
+            device.oscillatorBandsKernel.setArg(8, (short)bandStride);
+            device.queue.enqueueNDRangeKernel(device.oscillatorBandsKernel, NullRange, NDRange(bandStride * MULTIRATE_BANDS * device.numActiveVoices), NDRange(bandLocalSize), NULL, &device.bandsEvent);
+        }
+
+        device.oscillatorKernel.setArg(10, (short)voiceStride);
+
+        int globalSize = voiceStride * device.numActiveVoices;
+        device.queue.enqueueNDRangeKernel(device.oscillatorKernel, NullRange, NDRange(globalSize), NDRange(localSize), NULL, &device.oscillatorEvent);
+    }
+
+    /// launch a final adder kernel - one work-item per output sample of each group, writing the group's planar slice. it takes the per-voice
+    /// peak levels on the way (read back along with the samples so each VoiceManager can retire inaudible voices), which it merges into
+    /// zeros - and which needs each work-group inside one group, so the work-group size has to divide a group's share of work-items
+
+    device.addVoicesKernel.setArg(2, (short)device.maxFrames);
+    device.queue.enqueueFillBuffer(device.voicesPeakBuffer, (cl_uint)0, 0, device.numActiveVoices * sizeof(cl_uint));
+
+    int groupSizeAdder = device.maxFrames * NUM_CHANNELS;
+    int localSizeAdder = std::min(groupSizeAdder, static_cast<int>(device.addVoicesKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device.device)));
+    while (groupSizeAdder%localSizeAdder > 0) {
+        localSizeAdder /= 2;
+    }
+    device.queue.enqueueNDRangeKernel(device.addVoicesKernel, NullRange, NDRange(groupSizeAdder * device.numGroups), NDRange(localSizeAdder));
+    if (mZeroCopy) {
+        // map the results instead of reading them back
+        device.peaks = (const float*)device.queue.enqueueMapBuffer(device.voicesPeakBuffer, CL_FALSE, CL_MAP_READ, 0, device.numActiveVoices * sizeof(float));
+        device.samples = (const float*)device.queue.enqueueMapBuffer(device.outputSampleBuffer, CL_FALSE, CL_MAP_READ, 0, device.outputSize * sizeof(float), NULL, &device.endEvent);
+    } else {
+        device.queue.enqueueReadBuffer(device.voicesPeakBuffer, CL_FALSE, 0, device.numActiveVoices * sizeof(float), device.voicesPeak);
+        device.queue.enqueueReadBuffer(device.outputSampleBuffer, CL_FALSE, 0, device.outputSize * sizeof(float), device.outputSamples, NULL, &device.endEvent);
+        device.peaks = device.voicesPeak;
+        device.samples = device.outputSamples;
+    }
+    device.queue.flush(); // get it going before the next device's launches get queued up
+}
+
+/// persistent mode (PERSISTENT_KERNEL): a dispatch costs a doorbell write and a wait on the completion count instead of a round of launches,
+/// writes and read-backs through the driver. OpenCL 1.2 makes no promises about a running kernel and a mapped buffer, so it's only tried on
+/// devices that work out of host memory anyway (integrated GPUs, CPU devices) and only kept if a probe round gets through both ways. the modal
+/// engine keeps its per-dispatch launches - its work-group per voice doesn't fold into one
+
+// launches the device's persistent renderer and sends it an empty round - false (and the device left on the launches) if that doesn't come back
+bool GPUService::startPersistentKernel(RenderDevice& device) {
+    bool unifiedMemory = device.device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+    bool cpuDevice = device.device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU;
+    if (MODAL_RESONATORS || !(unifiedMemory || cpuDevice)) {
+        return false;
+    }
+    try {
+        device.mailboxBuffer = Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(RenderMailbox));
+        device.persistentQueue = CommandQueue(context, device.device);
+        device.mailbox = new (device.persistentQueue.enqueueMapBuffer(device.mailboxBuffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, sizeof(RenderMailbox))) RenderMailbox();
+        device.round = 0;
+
+        device.persistentKernel = Kernel(program, "persistent_renderer");
+        device.persistentKernel.setArg(0, device.mailboxBuffer);
+        device.persistentKernel.setArg(1, device.partialTableBuffer);
+        device.persistentKernel.setArg(2, device.voicesSampleBuffer);
+        device.persistentKernel.setArg(3, device.bandSampleBuffer);
+        device.persistentKernel.setArg(4, device.interpolatorBuffer);
+        device.persistentKernel.setArg(5, device.wavetableBuffer);
+        // a single work-group, since barriers are the only thing that can order its steps
+        int localSize = std::min(PERSISTENT_GROUP_SIZE, static_cast<int>(device.persistentKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device.device)));
+        device.persistentQueue.enqueueNDRangeKernel(device.persistentKernel, NullRange, NDRange(localSize), NDRange(localSize), NULL, &device.persistentEvent);
+        device.persistentQueue.flush();
+        device.persistent = true;
+    } catch(Error error) {
+        std::cout << "\npersistent renderer unavailable: " << error.what() << "(" << error.err() << ")" << std::endl;
+        if (device.mailbox != NULL) {
+            device.persistentQueue.enqueueUnmapMemObject(device.mailboxBuffer, device.mailbox);
+            device.persistentQueue.finish();
+            device.mailbox = NULL;
+        }
+        return false;
+    }
+
+    device.numGroups = 0;
+    device.numActiveVoices = 0;
+    device.maxFrames = 0;
+    device.hasBands = false;
+    device.numInitSlots = 0;
+    device.numBakes = 0;
+    ring(device);
+    if (!finishRound(device)) {
+        std::cout << "\npersistent renderer didn't answer, launching per dispatch instead" << std::endl;
+        if (!stopPersistentKernel(device)) {
+            mLost = true;
+        }
+        return false;
+    }
+    return true;
+}
+
+// asks the kernel to exit once it's idle, and waits PERSISTENT_TIMEOUT_MS at most for it to - true if it did, and the device can take launches again.
+// one that's still running keeps its mailbox mapped (it may still be writing to it) - the driver gets it back when the process goes
+bool GPUService::stopPersistentKernel(RenderDevice& device) {
+    device.persistent = false;
+    device.mailbox->quit.store(1, std::memory_order_release);
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PERSISTENT_TIMEOUT_MS);
+    while (device.persistentEvent.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE) { // negative if it was aborted - gone either way
+        if (std::chrono::steady_clock::now() > deadline) {
+            std::cout << "\npersistent renderer won't quit, giving up on its device" << std::endl;
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    device.persistentQueue.enqueueUnmapMemObject(device.mailboxBuffer, device.mailbox);
+    device.persistentQueue.finish();
+    device.mailbox = NULL;
+    return true;
+}
+
+// puts the dispatch that launch() would send in the mailbox and rings the doorbell. only ever one round in flight per device, so the results
+// can sit in the mailbox too
+void GPUService::ring(RenderDevice& device) {
+    RenderMailbox *mailbox = device.mailbox;
+    mailbox->numGroups = device.numGroups;
+    mailbox->numActiveVoices = device.numActiveVoices;
+    mailbox->maxFrames = device.maxFrames;
+    mailbox->hasBands = device.hasBands;
+    mailbox->numInitSlots = device.numInitSlots;
+    mailbox->numBakes = device.numBakes;
+    std::copy(device.groups, device.groups + device.numGroups, mailbox->groups);
+    std::copy(device.activeSlots, device.activeSlots + device.numActiveVoices, mailbox->activeSlots);
+    std::copy(device.voiceGroups, device.voiceGroups + device.numActiveVoices, mailbox->voiceGroups);
+    std::copy(device.voiceBands, device.voiceBands + device.numActiveVoices * MULTIRATE_BANDS, mailbox->voiceBands);
+    std::copy(device.voiceWavetables, device.voiceWavetables + device.numActiveVoices, mailbox->voiceWavetables);
+    std::copy(device.initSlots, device.initSlots + device.numInitSlots, mailbox->initSlots);
+    std::copy(device.initDetuneRanges, device.initDetuneRanges + device.numInitSlots, mailbox->initDetuneRanges);
+    for (int b = 0; b < device.numBakes; b++) {
+        mailbox->wavetableInfos[device.bakeEntries[b]] = device.wavetableInfos[device.bakeEntries[b]];
+    }
+    std::copy(device.bakeEntries, device.bakeEntries + device.numBakes, mailbox->bakeEntries);
+    std::copy(device.bakeSpectra, device.bakeSpectra + device.numBakes * WAVETABLE_SPECTRUM_SIZE, mailbox->wavetableSpectra);
+    device.samples = mailbox->outputSamples;
+    device.peaks = mailbox->voicesPeak;
+
+    device.round = device.round % 0x7fffffff + 1; // positive, and never the same twice running - the kernel only looks for a change
+    mailbox->probe = device.round;
+    device.roundStart = std::chrono::steady_clock::now();
+    mailbox->requestedRound.store(device.round, std::memory_order_release);
+}
+
+// waits for the round to come back - on the service thread, never an audio callback, and PERSISTENT_TIMEOUT_MS at most. false if it didn't, or
+// the probe didn't make it there and back
+bool GPUService::finishRound(RenderDevice& device) {
+    std::chrono::steady_clock::time_point deadline = device.roundStart + std::chrono::milliseconds(PERSISTENT_TIMEOUT_MS);
+    while (device.mailbox->completedRound.load(std::memory_order_acquire) != device.round) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    device.roundTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - device.roundStart).count();
+    return device.mailbox->probeEcho == device.round;
+}
+
+// a round that didn't make it - its clients get silence from the GPU
+void GPUService::silence(RenderRequest **requests, int numRequests) {
+    for (int r = 0; r < numRequests; r++) {
+        for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+            std::fill(requests[r]->outputs[channel], requests[r]->outputs[channel] + requests[r]->client->mBatchFrames, 0.0);
+        }
+    }
+}
+
+// every request in the batch becomes a RenderGroup (with its voices listed one after the other and its own slice of the output buffer) on
+// each device that has any of its voices. the devices all run at once, and their partial mixes get summed into each request's outputs
+void GPUService::dispatch(RenderRequest **requests, int numRequests) {
+
+    if (mLost) {
+        silence(requests, numRequests);
+        return;
+    }
+    bool launched = false;
+
+    try {
+
+        for (int i = 0; i < mNumDevices; i++) {
+            RenderDevice& device = mDevices[i];
+            device.numGroups = 0;
+            device.numActiveVoices = 0;
+            device.numInitSlots = 0;
+            device.outputSize = 0;
+            device.maxFrames = 0;
+            device.hasBands = false;
+            device.numBakes = 0;
+        }
+        mDispatchCount++;
+
+        for (int r = 0; r < numRequests; r++) {
+            OpenCL *client = requests[r]->client;
+            int instance = client->mSlotBase / MAX_VOICES;
+            unsigned int dirtySlots = client->mDirtySlots;
+            unsigned int staleTableSlots = client->mStaleTableSlots;
+            if (mResyncInstances.fetch_and(~(1u << instance)) & (1u << instance)) {
+                dirtySlots = staleTableSlots = ~0u >> (32 - MAX_VOICES);
+            }
+            client->mDirtySlots = 0;
+            client->mStaleTableSlots = 0;
+            assignDevices(client, dirtySlots, staleTableSlots);
+            uploadVoiceState(client, dirtySlots, staleTableSlots);
+            dropWavetables(client, staleTableSlots);
+
+            for (int i = 0; i < mNumDevices; i++) {
+                mDevices[i].requestGroups[r] = -1;
+            }
+            // energy rows are indexed by voice slot, not by active voice order, so voices starting mid-block land in the right row - only the batch's part of the playing voices' rows goes up
+            for (int j = 0; j < client->mNumGPUVoices; j++) {
+                int slot = client->activeSlots[j];
+                int globalSlot = client->mSlotBase + slot;
+                RenderDevice& device = mDevices[mSlotDevices[globalSlot]];
+                if (device.requestGroups[r] < 0) {
+                    RenderGroup& group = device.groups[device.numGroups];
+                    describeBatch(client, group);
+                    group.firstVoice = device.numActiveVoices;
+                    group.outputOffset = device.outputSize;
+                    device.outputSize += group.frames * NUM_CHANNELS;
+                    device.maxFrames = std::max(device.maxFrames, group.frames);
+                    device.requestGroups[r] = device.numGroups++;
+                }
+                device.groups[device.requestGroups[r]].numVoices++;
+                // the device's first write of the dispatch starts its clock (see the cost model below) - the records and partial tables
+                // uploaded before it for new notes are next to nothing
+                if (device.persistent) {
+                    std::copy(&client->voicesEnergy[slot * MAX_BLOCK_SIZE], &client->voicesEnergy[slot * MAX_BLOCK_SIZE] + client->mBatchFrames, &device.mailbox->voicesEnergy[globalSlot * MAX_BLOCK_SIZE]);
+                } else {
+                    device.queue.enqueueWriteBuffer(device.voicesEnergyBuffer, CL_FALSE, globalSlot * MAX_BLOCK_SIZE * sizeof(float), client->mBatchFrames * sizeof(float), &client->voicesEnergy[slot * MAX_BLOCK_SIZE], NULL, device.numActiveVoices == 0 ? &device.startEvent : NULL);
+                }
+                device.activeSlots[device.numActiveVoices] = globalSlot;
+                device.voiceGroups[device.numActiveVoices] = device.requestGroups[r];
+                std::copy(&client->mVoiceBandEnds[slot * MULTIRATE_BANDS], &client->mVoiceBandEnds[(slot + 1) * MULTIRATE_BANDS], &device.voiceBands[device.numActiveVoices * MULTIRATE_BANDS]);
+                device.hasBands = device.hasBands || client->mVoiceBandEnds[slot * MULTIRATE_BANDS] > 0; // band 0 ends last
+                device.voiceWavetables[device.numActiveVoices] = j < client->mNumWavetableVoices ? findWavetable(client, slot, device) : -1; // they come first
+                if (MODAL_RESONATORS) {
+                    ModalVoice& modes = device.voiceModes[device.numActiveVoices];
+                    modes = client->mVoiceModes[slot];
+                    if ((dirtySlots & staleTableSlots & (1u << slot)) && !modes.clearModes) {
+                        // moved to this device mid-note - whatever state is there belongs to something else, so it starts again from the top (a new note clears at its onset anyway)
+                        modes.resetSample = 0;
+                        modes.clearModes = 1;
+                    }
+                    device.queue.enqueueWriteBuffer(device.voicesForceBuffer, CL_FALSE, globalSlot * MAX_BLOCK_SIZE * sizeof(float), client->mBatchFrames * sizeof(float), &client->voicesForce[slot * MAX_BLOCK_SIZE], NULL, NULL);
+                }
+                device.numActiveVoices++;
+            }
+        }
+
+        for (int i = 0; i < mNumDevices; i++) {
+            if (mDevices[i].numActiveVoices > 0 && mDevices[i].persistent) {
+                ring(mDevices[i]);
+            } else if (mDevices[i].numActiveVoices > 0) {
+                launch(mDevices[i]);
+                launched = true;
+            }
+        }
+
+        // wait for all of them (which also means all the writes from the clients' arrays are done), and update each device's throughput
+        for (int i = 0; i < mNumDevices; i++) {
+            RenderDevice& device = mDevices[i];
+            if (device.numActiveVoices == 0) {
+                continue;
+            }
+            if (device.persistent) {
+                if (!finishRound(device)) {
+                    // whatever the device has of this round is lost - it goes back to the launches (re-uploading everything the kernel kept), or
+                    // if the kernel won't let go of it, nothing more goes to it at all
+                    std::cout << "\npersistent renderer stopped answering, falling back to launching per dispatch" << std::endl;
+                    if (stopPersistentKernel(device)) {
+                        mResyncInstances.fetch_or(~0u);
+                        for (int entry = 0; entry < WAVETABLE_CACHE_ENTRIES; entry++) {
+                            device.wavetables[entry].slot = -1; // the infos only went to the mailbox
+                        }
+                    } else {
+                        mLost = true;
+                    }
+                    throw Error(CL_OUT_OF_RESOURCES, "persistent renderer");
+                }
+                // no profiling events - the round trip, kernels and all, stands in for the oscillator's time
+                double voiceSampleTime = device.roundTime / ((double)device.numActiveVoices * device.maxFrames);
+                device.voiceSampleTime = device.voiceSampleTime > 0.0 ? device.voiceSampleTime + (voiceSampleTime - device.voiceSampleTime) * 0.05 : voiceSampleTime;
+                continue;
+            }
+            device.queue.finish();
+            cl_ulong start = device.oscillatorEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            cl_ulong end = device.oscillatorEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            if (device.hasBands) {
+                end += device.bandsEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - device.bandsEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            }
+            if (end > start) {
+                double voiceSampleTime = (end - start) * 1.0e-9 / ((double)device.numActiveVoices * device.maxFrames);
+                device.voiceSampleTime = device.voiceSampleTime > 0.0 ? device.voiceSampleTime + (voiceSampleTime - device.voiceSampleTime) * 0.05 : voiceSampleTime;
+            }
+        }
+
+        // each client's GPU time, for its cost model (OpenCL::updateRenderCostModel): a device's time from its first write being queued to the
+        // read-back finishing - the launch, the transfers and the kernels - shared out among the round's requests by their partial-samples on it.
+        // the devices run side by side, so a request takes the biggest of its shares
+        for (int r = 0; r < numRequests; r++) {
+            requests[r]->client->mGPURenderTime = 0.0;
+        }
+        for (int i = 0; i < mNumDevices; i++) {
+            RenderDevice& device = mDevices[i];
+            if (device.numActiveVoices == 0) {
+                continue;
+            }
+            double span = device.roundTime;
+            if (!device.persistent) {
+                cl_ulong queued = device.startEvent.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+                cl_ulong finished = device.endEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+                span = finished > queued ? (finished - queued) * 1.0e-9 : 0.0;
+            }
+            double partialSamples = 0.0;
+            for (int g = 0; g < device.numGroups; g++) {
+                partialSamples += (double)device.groups[g].numVoices * device.groups[g].frames * device.groups[g].numPartials;
+            }
+            if (span <= 0.0 || partialSamples <= 0.0) {
+                continue;
+            }
+            for (int r = 0; r < numRequests; r++) {
+                if (device.requestGroups[r] < 0) {
+                    continue;
+                }
+                RenderGroup& group = device.groups[device.requestGroups[r]];
+                double share = (double)group.numVoices * group.frames * group.numPartials / partialSamples;
+                OpenCL *client = requests[r]->client;
+                client->mGPURenderTime = std::max(client->mGPURenderTime, span * share);
+            }
+        }
+
+        // Set callback function
+        //callbackEvent.setCallback(CL_COMPLETE, &ping, (void*)samples);
+
+        // the adder kernel already summed and de-interleaved each batch, so all that's left is float -> double, one contiguous run per channel,
+        // plus the other devices' partial mixes. the client adds its CPU voices and clips
+        for (int r = 0; r < numRequests; r++) {
+            OpenCL *client = requests[r]->client;
+            int frames = client->mBatchFrames;
+            for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+                double *output = requests[r]->outputs[channel];
+                std::fill(output, output + frames, 0.0);
+                for (int i = 0; i < mNumDevices; i++) {
+                    RenderDevice& device = mDevices[i];
+                    if (device.numActiveVoices == 0 || device.requestGroups[r] < 0) {
+                        continue;
+                    }
+                    const float *channelSamples = &device.samples[device.groups[device.requestGroups[r]].outputOffset + channel * frames];
+                    for (int k = 0; k < frames; k++) {
+                        output[k] += channelSamples[k];
+                    }
+                }
+            }
+            // each device lists the request's voices in the same order as the client does, so walking them in step lines the peaks up
+            int nextVoices[MAX_RENDER_DEVICES];
+            for (int i = 0; i < mNumDevices; i++) {
+                nextVoices[i] = mDevices[i].requestGroups[r] < 0 ? 0 : mDevices[i].groups[mDevices[i].requestGroups[r]].firstVoice;
+            }
+            for (int j = 0; j < client->mNumGPUVoices; j++) {
+                int i = mSlotDevices[client->mSlotBase + client->activeSlots[j]];
+                client->voicesPeak[j] = mDevices[i].peaks[nextVoices[i]++];
+            }
+        }
+
+        if (mZeroCopy) {
+            for (int i = 0; i < mNumDevices; i++) {
+                RenderDevice& device = mDevices[i];
+                if (device.numActiveVoices > 0 && !device.persistent) {
+                    device.queue.enqueueUnmapMemObject(device.voicesPeakBuffer, (void*)device.peaks);
+                    device.queue.enqueueUnmapMemObject(device.outputSampleBuffer, (void*)device.samples);
+                }
+            }
+        }
+
+    } catch(Error error) {
+        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
+        silence(requests, numRequests);
+        if (mZeroCopy && launched) {
+            // we can't tell which buffers are still mapped, so go back to reading back from here on
+            std::cout << "\nzero-copy buffers failed, falling back to copying" << std::endl;
+            mZeroCopy = false;
+        }
+    }
+}
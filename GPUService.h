@@ -0,0 +1,213 @@
+//
+//  GPUService.h
+//  Synthesis
+//
+//  The one OpenCL context, program and set of device buffers shared by every plugin instance in the process. Each instance (OpenCL)
+//  registers for MAX_VOICES slots in the shared buffers and hands its batches in through render() - the service's own thread gathers
+//  each round of them (one batch per instance) and renders them together, in one launch of each kernel.
+//  With more than one GPU in the context, the voices are split across them: each one renders a partial mix of the voices that live
+//  on it, and the partial mixes get summed here.
+//
+
+#ifndef __Synthesis__GPUService__
+#define __Synthesis__GPUService__
+
+#include "OpenCL.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <new>
+
+#define MAX_INSTANCES 32 // plugin instances that can share the device - each one gets MAX_VOICES slots in the shared buffers (has to fit a bitmask)
+#define MAX_SLOTS (MAX_INSTANCES*MAX_VOICES)
+#define GATHER_WINDOW 0.25 // longest the service waits for the rest of a round, as a fraction of the first batch's duration, before it dispatches what it has
+#define MAX_RENDER_DEVICES 2 // GPUs the voices get split across - any more in the context sit idle. each one adds VOICES_PER_DEVICE of polyphony, so past
+                             // MAX_VOICES / VOICES_PER_DEVICE they'd only split the same voices thinner
+#define WAVETABLE_CACHE_ENTRIES 16 // voices' wavetables each device keeps baked (WAVETABLE_LAYERS * WAVETABLE_LENGTH float4s apiece) - the one played least recently makes way
+#define WAVETABLE_BAKES 4 // most wavetables a device bakes per dispatch - the voices past that stay additive until the next one
+#define WAVETABLE_SPECTRUM_SIZE (WAVETABLE_LAYERS*WAVETABLE_MAX_PARTIALS*3) // floats of OpenCL::buildWavetable's spectrum
+#define ZERO_COPY_BUFFERS -1 // -1 = map the output buffers instead of reading them back if the device shares memory with the host (integrated GPUs, CPU devices), 0 = always copy, 1 = always map (pinned memory on discrete GPUs)
+#ifndef PERSISTENT_KERNEL
+#define PERSISTENT_KERNEL 0 // 1 = opt in to the persistent renderer on the devices that can take it (see GPUService::startPersistentKernel) - it spins on the device for as long as the
+                            // plugin's loaded, so only for compute devices without a display watchdog. also a -D build option: with 0 the kernel isn't built at all
+#endif
+#define PERSISTENT_GROUP_SIZE 256 // work-items in the persistent renderer's one work-group, at most
+#define PERSISTENT_TIMEOUT_MS 50 // a round the persistent renderer hasn't answered by then means it's gone - the device goes back to launching per dispatch
+
+static_assert(MAX_RENDER_DEVICES * VOICES_PER_DEVICE <= MAX_VOICES, "every device's share of the polyphony has to fit in an instance's MAX_VOICES slots");
+static_assert(sizeof(std::atomic<cl_int>) == sizeof(cl_int), "the mailbox's doorbells are plain ints on the device");
+
+/// persistent mode (PERSISTENT_KERNEL): everything a dispatch sends a device and gets back, in one host-visible buffer that stays mapped while the
+/// device's persistent renderer polls it. the host fills in the round, bumps requestedRound, and waits for the kernel to post it back in
+/// completedRound - keep in sync with RenderMailbox in opencl_kernels.cl
+struct RenderMailbox {
+    std::atomic<cl_int> requestedRound;
+    std::atomic<cl_int> completedRound;
+    std::atomic<cl_int> quit;
+    cl_int probe; // the kernel copies it to probeEcho every round - if that doesn't come back, the device isn't seeing the host's writes
+    cl_int probeEcho;
+    cl_int numGroups;
+    cl_int numActiveVoices;
+    cl_int maxFrames;
+    cl_int hasBands;
+    cl_int numInitSlots;
+    cl_int numBakes;
+    RenderGroup groups[MAX_INSTANCES];
+    cl_int activeSlots[MAX_SLOTS];
+    cl_int voiceGroups[MAX_SLOTS];
+    cl_int voiceBands[MAX_SLOTS*MULTIRATE_BANDS];
+    cl_int voiceWavetables[MAX_SLOTS];
+    cl_int initSlots[MAX_SLOTS];
+    float initDetuneRanges[MAX_SLOTS];
+    cl_int bakeEntries[WAVETABLE_BAKES];
+    float voiceRecords[MAX_SLOTS*NUM_VOICE_PARAMS];
+    cl_uint voiceOnsets[MAX_SLOTS];
+    float voicesEnergy[MAX_SLOTS*MAX_BLOCK_SIZE];
+    WavetableInfo wavetableInfos[WAVETABLE_CACHE_ENTRIES];
+    float wavetableSpectra[WAVETABLE_BAKES*WAVETABLE_SPECTRUM_SIZE];
+    float outputSamples[MAX_INSTANCES*MAX_BLOCK_SIZE*NUM_CHANNELS];
+    float voicesPeak[MAX_SLOTS];
+};
+
+class GPUService {
+public:
+    static GPUService& getInstance()
+    {
+        static GPUService instance;
+        return instance;
+    }
+    int registerClient(); // sets up the device on the first call - returns the new client's first slot, or -1 if there's no device or no room
+    void unregisterClient(OpenCL *client);
+    void render(OpenCL *client, double** outputs); // renders the client's GPU voices into outputs, along with the rest of its round - and its CPU voices meanwhile
+    inline bool isZeroCopy() { return mZeroCopy; }
+    inline int getNumDevices() { return mNumDevices; }
+
+private:
+    GPUService();
+    ~GPUService();
+    GPUService(const GPUService&);
+    void operator=(const GPUService&);
+
+    struct RenderRequest {
+        OpenCL *client;
+        double **outputs;
+        bool done;
+    };
+
+    /// what a device's wavetable cache entry holds: the global slot whose voice it was baked for (-1 = nothing), the client's wavetable generation
+    /// and the energy it was baked up to then, and the last dispatch that played from it
+    struct WavetableEntry {
+        int slot;
+        unsigned int generation;
+        float topEnergy;
+        unsigned int lastUsed;
+    };
+
+    /// one GPU's share of the work: its own queue, kernels and buffers, holding the records and partial tables of the voices that live on it,
+    /// its cache of baked wavetables, and the modal engine's resonators
+    struct RenderDevice {
+        Device device;
+        CommandQueue queue;
+        Kernel oscillatorKernel, oscillatorBandsKernel, addVoicesKernel, initPartialsKernel, bakeWavetablesKernel, modalResonatorsKernel;
+        Buffer voiceRecordBuffer, voiceOnsetBuffer, activeSlotsBuffer, voiceGroupBuffer, groupBuffer, initSlotsBuffer, partialTableBuffer, voicesEnergyBuffer, voicesSampleBuffer, outputSampleBuffer, voicesPeakBuffer;
+        Buffer voiceBandsBuffer, bandSampleBuffer, interpolatorBuffer;
+        Buffer voiceWavetablesBuffer, wavetableBuffer, wavetableInfoBuffer, wavetableSpectrumBuffer, wavetableBakesBuffer;
+        Buffer voicesForceBuffer, voiceModesBuffer, modeStateBuffer;
+        WavetableEntry wavetables[WAVETABLE_CACHE_ENTRIES];
+        WavetableInfo wavetableInfos[WAVETABLE_CACHE_ENTRIES]; // host copy of what's in wavetableInfoBuffer
+        double relativeSpeed; // compute units * clock, to go on until it's been measured
+        double voiceSampleTime; // measured seconds of oscillator kernel per voice-sample (0 until it's rendered something)
+        int numVoices; // voices living on it, all instances
+        
+        // the dispatch being put together - one group per request that has voices here, voices listed request by request
+        int numGroups;
+        int requestGroups[MAX_INSTANCES]; // group of each request in the dispatch, -1 if none of its voices are here
+        RenderGroup groups[MAX_INSTANCES];
+        int numActiveVoices;
+        int activeSlots[MAX_SLOTS]; // global slot (instance slot base + voice slot) of each voice in the dispatch
+        int voiceGroups[MAX_SLOTS]; // which group each of them belongs to
+        int voiceBands[MAX_SLOTS*MULTIRATE_BANDS]; // and where its bands end (see OpenCL::updateBands)
+        bool hasBands; // any of them has a partial in a band - otherwise oscillator_bands doesn't need launching
+        int voiceWavetables[MAX_SLOTS]; // and the cache entry it plays from, -1 if it's additive
+        int numBakes;
+        int bakeEntries[WAVETABLE_BAKES]; // cache entries bake_wavetables is (re)baking, and their spectra
+        float bakeSpectra[WAVETABLE_BAKES*WAVETABLE_SPECTRUM_SIZE];
+        ModalVoice voiceModes[MAX_SLOTS]; // each voice's batch for the modal engine, if that's the one in use
+        int numInitSlots;
+        int initSlots[MAX_SLOTS]; // global slots whose partial tables init_partials is rebuilding
+        float initDetuneRanges[MAX_SLOTS]; // ...and their instances' detune ranges, for the persistent renderer
+        int outputSize;
+        int maxFrames;
+        Event oscillatorEvent, bandsEvent, startEvent, endEvent; // startEvent / endEvent: the dispatch's first write and last read-back, for the clients' cost models
+        float outputSamples[MAX_INSTANCES*MAX_BLOCK_SIZE*NUM_CHANNELS]; // every group's planar output slice, back to back, as read back from outputSampleBuffer
+        float voicesPeak[MAX_SLOTS];
+        const float *samples; // outputSamples / voicesPeak, or the mapped buffers in zero-copy mode (or the mailbox in persistent mode)
+        const float *peaks;
+        
+        bool persistent; // its persistent renderer is running, and the dispatches go through the mailbox instead of launches
+        CommandQueue persistentQueue; // the kernel never finishes, so it gets a queue of its own
+        Kernel persistentKernel;
+        Event persistentEvent;
+        Buffer mailboxBuffer;
+        RenderMailbox *mailbox; // mapped for as long as the kernel runs
+        cl_int round; // the last one rung
+        std::chrono::steady_clock::time_point roundStart;
+        double roundTime; // seconds from ringing the doorbell to the round coming back, for the cost models - there are no events to profile
+    };
+
+    void initOpenCL();
+    void serviceLoop();
+    void createBuffers(RenderDevice& device);
+    void dispatch(RenderRequest **requests, int numRequests);
+    void assignDevices(OpenCL *client, unsigned int& dirtySlots, unsigned int& staleTableSlots);
+    int pickDevice();
+    void uploadVoiceState(OpenCL *client, unsigned int dirtySlots, unsigned int staleTableSlots);
+    void launch(RenderDevice& device);
+    bool startPersistentKernel(RenderDevice& device);
+    bool stopPersistentKernel(RenderDevice& device);
+    void ring(RenderDevice& device);
+    bool finishRound(RenderDevice& device);
+    void silence(RenderRequest **requests, int numRequests);
+    void describeBatch(OpenCL *client, RenderGroup& group);
+    int findWavetable(OpenCL *client, int slot, RenderDevice& device);
+    void dropWavetables(OpenCL *client, unsigned int staleTableSlots);
+
+    /// flat combining, on a thread of its own: render() queues its request and waits. the service thread gathers a round - every instance that
+    /// was in the last one, or whatever has come in by GATHER_WINDOW of a batch after the first request - and dispatches it all at once. GPU
+    /// instances always render ahead (see Synthesis::setRenderAheadBlocks), so what waits on the round is their render thread, never a host's
+    /// audio callback
+    std::mutex mMutex;
+    std::condition_variable mRequestQueued, mDispatchDone;
+    RenderRequest *mPending[MAX_INSTANCES];
+    int mNumPending;
+    unsigned int mRoundInstances; // bit per instance that was in the last round - the ones the next one waits for
+    std::thread mServiceThread;
+    bool mServiceRunning;
+
+    bool mInitialized; // initOpenCL() ran
+    bool mReady; // ...and everything got built
+    bool mLost; // a persistent renderer stopped answering and wouldn't quit - nothing else can go to its device, so every round is silent
+    unsigned int mUsedInstances; // bit per instance slot that's registered
+    std::atomic<unsigned int> mResyncInstances; // bit per instance whose device-side records and partial tables all need re-uploading / rebuilding - set on
+                                                // registering, taken by the service thread's dispatch
+
+    /// zero-copy mode: the output and peak buffers live in host-visible memory (CL_MEM_ALLOC_HOST_PTR) and get mapped for reading instead of
+    /// read back. the inputs are always copied in - every instance fills its energy rows on its own thread, whenever it likes
+    bool mZeroCopy;
+
+    /// voice -> device affinity: a voice stays on the device it started on for as long as it plays, since its record and partial table (and
+    /// in the modal engine, its resonators) only live there. new notes go wherever the predicted load is lowest
+    RenderDevice mDevices[MAX_RENDER_DEVICES];
+    int mNumDevices;
+    int mSlotDevices[MAX_SLOTS]; // device each global slot's voice lives on, -1 if it isn't playing
+    unsigned int mDispatchCount; // for the wavetable caches' least recently used
+
+    cl::vector<Platform> platforms;
+    Context context;
+    cl::vector<Device> devices;
+    Program program;
+};
+
+#endif /* defined(__Synthesis__GPUService__) */
@@ -0,0 +1,106 @@
+//
+//  IFFTRenderer.cpp
+//  Synthesis
+//
+
+#include "IFFTRenderer.h"
+#include <algorithm>
+
+// 4-term Blackman-Harris, centered on n = 0 (the usual signs of the odd terms flip)
+static double window(int n) {
+    double x = 2.0 * M_PI * n / IFFT_SIZE;
+    return 0.35875 + 0.48829 * cos(x) + 0.14128 * cos(2.0 * x) + 0.01168 * cos(3.0 * x);
+}
+
+IFFTRenderer::IFFTRenderer() {
+    // the window's spectrum, summed straight from its samples - a cosine sum, since it's symmetric about the center
+    for (int i = 0; i < IFFT_LOBE_BINS * IFFT_LOBE_OVERSAMPLING + 2; i++) {
+        double offset = (double)i / IFFT_LOBE_OVERSAMPLING - 0.5 * IFFT_LOBE_BINS;
+        double sum = 0.0;
+        for (int n = -IFFT_SIZE/2; n < IFFT_SIZE/2; n++) {
+            sum += window(n) * cos(2.0 * M_PI * offset * n / IFFT_SIZE);
+        }
+        mLobe[i] = (float)(sum / IFFT_SIZE);
+    }
+    for (int i = 0; i < IFFT_SIZE/2; i++) {
+        mCos[i] = (float)cos(2.0 * M_PI * i / IFFT_SIZE);
+        mSin[i] = (float)sin(2.0 * M_PI * i / IFFT_SIZE);
+    }
+    int bits = 0;
+    while ((1 << bits) < IFFT_SIZE) {
+        bits++;
+    }
+    for (int i = 0; i < IFFT_SIZE; i++) {
+        int reversed = 0;
+        for (int b = 0; b < bits; b++) {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        mBitReverse[i] = reversed;
+    }
+    for (int n = -IFFT_HOP; n < IFFT_HOP; n++) {
+        mCrossfade[n + IFFT_HOP] = (float)((1.0 - fabs((double)n) / IFFT_HOP) / window(n));
+    }
+    clear();
+}
+
+void IFFTRenderer::clear() {
+    std::fill(mReal, mReal + IFFT_SIZE, 0.0f);
+    std::fill(mImag, mImag + IFFT_SIZE, 0.0f);
+}
+
+// a real sinusoid is two lobes, one at +bin with amplitude/2 * e^(i(phase - pi/2)) and its conjugate at -bin. each gets multiplied by
+// gainLeft + i * gainRight, which is what puts it in the left channel (real part) and the right channel (imaginary part) of the output
+void IFFTRenderer::addSinusoid(float bin, float amplitude, float phase, float gainLeft, float gainRight) {
+    float real = 0.5f * amplitude * sinf(phase);
+    float imag = -0.5f * amplitude * cosf(phase);
+
+    for (int side = 0; side < 2; side++) {
+        float center = side == 0 ? bin : -bin;
+        float lobeImag = side == 0 ? imag : -imag;
+        float valueReal = gainLeft * real - gainRight * lobeImag;
+        float valueImag = gainLeft * lobeImag + gainRight * real;
+        int first = (int)ceilf(center - 0.5f * IFFT_LOBE_BINS);
+        int last = (int)floorf(center + 0.5f * IFFT_LOBE_BINS);
+        for (int b = first; b <= last; b++) {
+            float weight = lobe((float)b - center);
+            int index = b & (IFFT_SIZE - 1); // wraps the negative bins round to the top
+            mReal[index] += valueReal * weight;
+            mImag[index] += valueImag * weight;
+        }
+    }
+}
+
+void IFFTRenderer::synthesize() {
+    // iterative radix-2, decimation in time, with the twiddles' sign flipped for the inverse
+    for (int i = 0; i < IFFT_SIZE; i++) {
+        int j = mBitReverse[i];
+        if (j > i) {
+            std::swap(mReal[i], mReal[j]);
+            std::swap(mImag[i], mImag[j]);
+        }
+    }
+    for (int size = 2; size <= IFFT_SIZE; size *= 2) {
+        int half = size / 2;
+        int step = IFFT_SIZE / size;
+        for (int start = 0; start < IFFT_SIZE; start += size) {
+            for (int k = 0; k < half; k++) {
+                float twiddleReal = mCos[k * step];
+                float twiddleImag = mSin[k * step];
+                int even = start + k;
+                int odd = even + half;
+                float oddReal = mReal[odd] * twiddleReal - mImag[odd] * twiddleImag;
+                float oddImag = mReal[odd] * twiddleImag + mImag[odd] * twiddleReal;
+                mReal[odd] = mReal[even] - oddReal;
+                mImag[odd] = mImag[even] - oddImag;
+                mReal[even] += oddReal;
+                mImag[even] += oddImag;
+            }
+        }
+    }
+    // the frame comes out windowed and centered on sample 0 (wrapped) - the middle of it gets the window divided back out and crossfaded
+    for (int n = -IFFT_HOP; n < IFFT_HOP; n++) {
+        int index = n & (IFFT_SIZE - 1);
+        frameLeft[n + IFFT_HOP] = mReal[index] * mCrossfade[n + IFFT_HOP];
+        frameRight[n + IFFT_HOP] = mImag[index] * mCrossfade[n + IFFT_HOP];
+    }
+}
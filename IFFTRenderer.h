@@ -0,0 +1,51 @@
+//
+//  IFFTRenderer.h
+//  Synthesis
+//
+//  Additive synthesis by inverse FFT (the FFT^-1 method). Every IFFT_HOP samples, each partial's amplitude, frequency, phase and pan at that
+//  moment go into a spectrum as the few bins of the window's main lobe around its frequency, and one inverse FFT turns all of them into a
+//  frame of samples at once. The frames get crossfaded into each other (triangles, IFFT_HOP each side of the frame's center). A frame costs
+//  about the same whatever the partial count, which is how voices with hundreds of partials get rendered (see OpenCL::renderIFFTVoice).
+//  Left and right come out of the same transform, as its real and imaginary parts.
+//
+
+#ifndef __Synthesis__IFFTRenderer__
+#define __Synthesis__IFFTRenderer__
+
+#include <math.h>
+
+#define IFFT_SIZE 512
+#define IFFT_HOP (IFFT_SIZE/4) // samples between frame centers - only the middle half of each frame is used, where the window isn't too small to divide back out
+#define IFFT_LOBE_BINS 9 // bins each sinusoid gets spread over - the Blackman-Harris main lobe is 8 wide, and its sidelobes are down 92dB
+#define IFFT_LOBE_OVERSAMPLING 64 // lobe table entries per bin
+
+class IFFTRenderer {
+public:
+    IFFTRenderer();
+    void clear();
+    // adds amplitude * sin(phase + 2pi * bin * n / IFFT_SIZE) to the frame (n counted from its center), into the left and right channels at
+    // gainLeft and gainRight. bin is the frequency in bins, fractional
+    void addSinusoid(float bin, float amplitude, float phase, float gainLeft, float gainRight);
+    // transforms the spectrum into frameLeft / frameRight - the 2 * IFFT_HOP samples around the frame's center (frame[IFFT_HOP] is the center),
+    // already crossfaded, so overlapping frames just get added up
+    void synthesize();
+    float frameLeft[2*IFFT_HOP];
+    float frameRight[2*IFFT_HOP];
+
+private:
+    inline float lobe(float offset) { // the window's spectrum, offset bins from the sinusoid's frequency - linear between table entries
+        float position = (offset + 0.5f * IFFT_LOBE_BINS) * IFFT_LOBE_OVERSAMPLING;
+        int index = (int)position;
+        float fraction = position - (float)index;
+        return mLobe[index] + (mLobe[index + 1] - mLobe[index]) * fraction;
+    }
+    float mReal[IFFT_SIZE]; // the spectrum - left + i * right, so both channels come out of one transform
+    float mImag[IFFT_SIZE];
+    float mLobe[IFFT_LOBE_BINS*IFFT_LOBE_OVERSAMPLING + 2]; // includes the 1/IFFT_SIZE of the inverse transform
+    float mCos[IFFT_SIZE/2]; // twiddles
+    float mSin[IFFT_SIZE/2];
+    int mBitReverse[IFFT_SIZE];
+    float mCrossfade[2*IFFT_HOP]; // triangle / window, around the frame's center
+};
+
+#endif /* defined(__Synthesis__IFFTRenderer__) */
@@ -9,46 +9,84 @@
 #include "MIDIReceiver.h"
 
 void MIDIReceiver::onMessageReceived(IMidiMsg* midiMessage) {
-    IMidiMsg::EStatusMsg status = midiMessage->StatusMsg();
-    IMidiMsg::EControlChangeMsg controlChange = midiMessage->ControlChangeIdx();
-    // We're only interested in Note On/Off messages (not CC, pitch, etc.)
-    if(status == IMidiMsg::kNoteOn || status == IMidiMsg::kNoteOff) {
-        //mMidiQueue.Add(midiMessage);
+    // this can run on the host's or RtMidi's MIDI thread, concurrently with rendering - so all we do here is drop the message into the ring
+    if (!mInputRing.push(*midiMessage)) {
+        mOverflowCount++;
     }
-    if(status == IMidiMsg::kPitchWheel) {
-//        printf("\nPITCH WHEEL! %f", midiMessage->PitchWheel());
+}
+
+// takes everything received since the last call
+int MIDIReceiver::readInput(IMidiMsg* midiMessages, int maxMessages) {
+    return mInputRing.read(midiMessages, maxMessages);
+}
+
+// floods of mod wheel / expression CCs (e.g. from a controller being swept) are coalesced: of the messages queued before blockEnd - the rest of the
+// engine block being built, which all goes into the same render - only the latest value of each is kept, the ones in between would be gone before
+// anything got to hear them. BlockFifo calls this once it knows where the block ends, so values never get merged across blocks. sustain isn't
+// coalesced, every pedal change matters for which voices get held.
+void MIDIReceiver::coalesceControlChanges(int blockEnd) {
+    if (mMidiQueue.Empty() || mMidiQueue.Peek()->mOffset >= blockEnd) return; // nothing in this block - the usual case
+    int numMessages = 0;
+    int numInBlock = 0;
+    while (!mMidiQueue.Empty() && numMessages < MIDI_QUEUE_SIZE) {
+        IMidiMsg* midiMessage = mMidiQueue.Peek();
+        if (midiMessage->mOffset < blockEnd) {
+            numInBlock++;
+        }
+        mCoalescedMessages[numMessages++] = *midiMessage;
+        mMidiQueue.Remove();
     }
-    if(controlChange == IMidiMsg::kSustainOnOff) {
-//        printf("\nSUSTAYN %f", midiMessage->ControlChange(controlChange));
+    int lastModWheel = -1;
+    int lastExpression = -1;
+    for (int i = numInBlock - 1; i >= 0; i--) {
+        if (mCoalescedMessages[i].StatusMsg() != IMidiMsg::kControlChange) continue;
+        IMidiMsg::EControlChangeMsg controlChange = mCoalescedMessages[i].ControlChangeIdx();
+        int* last = controlChange == IMidiMsg::kModWheel ? &lastModWheel : controlChange == IMidiMsg::kExpressionController ? &lastExpression : NULL;
+        if (!last) continue;
+        if (*last >= 0) {
+            mCoalescedMessages[i].mStatus = 0; // superseded by a later value in the same block - dropped below
+        } else {
+            *last = i;
+        }
     }
-    if(controlChange == IMidiMsg::kModWheel) {
-//        printf("\nMOD WHEEEEL %f", midiMessage->ControlChange(controlChange));
+    // back into the queue in order (anything that didn't fit in mCoalescedMessages is still there, later than all of these - Add sorts them in ahead of it)
+    for (int i = 0; i < numMessages; i++) {
+        if (mCoalescedMessages[i].mStatus) {
+            mMidiQueue.Add(&mCoalescedMessages[i]);
+        }
     }
-    if(controlChange == IMidiMsg::kExpressionController) {
-//        printf("\nEXPRESSISIIIOOON %f", midiMessage->ControlChange(controlChange));
+}
+
+void MIDIReceiver::processInput() {
+    int numMessages = readInput(mInputMessages, MIDI_INPUT_RING_SIZE);
+    for (int i = 0; i < numMessages; i++) {
+        addEvent(&mInputMessages[i]);
     }
+}
+
+void MIDIReceiver::addEvent(IMidiMsg* midiMessage) {
     mMidiQueue.Add(midiMessage);
 }
 
-// this is called on every sample while we're generating a buffer; as long as there are messages in the queue, we're processing and removing them from the front (using Peek and Remove). But we only do this for MIDI messages whose mOffset isn't greater than the current offset into the buffer. This means that we process every message at the right sample, keeping the relative timing intact.
-// After reading noteNumber and velocity, the if statement distinguishes note on and off messages (no velocity is interpreted as note off). In both cases, we're keeping track of which notes are being played, as well as how many of them. We also update the mLast... members so the already mentioned last note priority happens. This is the place where we know the frequency has to change, so we're updating it here. Finally, the mOffset is incremented so that the receiver knows how far into the buffer it currently is. An alternative would be to pass the offset in as an argument. So we now have a class that can receive all incoming MIDI note on/off messages. It always keeps track of which notes are being played and what the last played note (and frequency) was. 
-void MIDIReceiver::advance() {
+// this is called at each segment boundary while we're generating a buffer (the block is split at event timestamps, so this runs once per event rather than once per sample); as long as there are messages in the queue, we're processing and removing them from the front (using Peek and Remove). But we only do this for MIDI messages whose mOffset isn't greater than the given offset into the buffer. This means that we process every message at the right sample, keeping the relative timing intact.
+// After reading noteNumber and velocity, the if statement distinguishes note on and off messages (no velocity is interpreted as note off). In both cases, we're keeping track of which notes are being played, as well as how many of them.
+void MIDIReceiver::advance(int offset) {
     while (!mMidiQueue.Empty()) {
         IMidiMsg* midiMessage = mMidiQueue.Peek();
-        if (midiMessage->mOffset > mOffset) break;
+        if (midiMessage->mOffset > offset) break;
         
         IMidiMsg::EStatusMsg status = midiMessage->StatusMsg();
         int noteNumber = midiMessage->NoteNumber();
         int velocity = midiMessage->Velocity();
         
-        // There are only note on/off messages in the queue, see ::OnMessageReceived
+        // CC messages share the queue with notes, so only note on/off messages may touch the key status (NoteNumber() is -1 for anything else)
         if (status == IMidiMsg::kNoteOn && velocity) {
             if(mKeyStatus[noteNumber] == false) {
                 mKeyStatus[noteNumber] = true;
                 mNumKeys += 1;
                 noteOn(noteNumber, velocity);
             }
-        } else {
+        } else if (status == IMidiMsg::kNoteOn || status == IMidiMsg::kNoteOff) {
             if(mKeyStatus[noteNumber] == true) {
                 mKeyStatus[noteNumber] = false;
                 mNumKeys -= 1;
@@ -56,22 +94,32 @@ void MIDIReceiver::advance() {
             }
         }
         
-        IMidiMsg::EControlChangeMsg controlChange = midiMessage->ControlChangeIdx();
-        switch (controlChange) {
-            case IMidiMsg::kSustainOnOff:
-                sustainChange(midiMessage->ControlChange(controlChange));
-                break;
-            case IMidiMsg::kModWheel:
-                modChange(midiMessage->ControlChange(controlChange));
-                break;
-            case IMidiMsg::kExpressionController:
-                expressionChange(midiMessage->ControlChange(controlChange));
-                break;
-            default:
-                break;
+        // ControlChangeIdx() just returns the first data byte, so check the status first or note 64 would read as a sustain change
+        if (status == IMidiMsg::kControlChange) {
+            IMidiMsg::EControlChangeMsg controlChange = midiMessage->ControlChangeIdx();
+            switch (controlChange) {
+                case IMidiMsg::kSustainOnOff:
+                    sustainChange(midiMessage->ControlChange(controlChange));
+                    break;
+                case IMidiMsg::kModWheel:
+                    modChange(midiMessage->ControlChange(controlChange));
+                    break;
+                case IMidiMsg::kExpressionController:
+                    expressionChange(midiMessage->ControlChange(controlChange));
+                    break;
+                default:
+                    break;
+            }
         }
         
         mMidiQueue.Remove();
     }
-    mOffset++;
+}
+
+// returns where the next segment of the block ends: the offset of the next queued message, or nFrames if there's none before the end of the block
+int MIDIReceiver::getNextEventOffset(int nFrames) {
+    if (mMidiQueue.Empty() || mMidiQueue.Peek()->mOffset >= nFrames) {
+        return nFrames;
+    }
+    return mMidiQueue.Peek()->mOffset;
 }
\ No newline at end of file
@@ -16,16 +16,21 @@
 #pragma clang diagnostic pop
 
 #include "IMidiQueue.h"
+#include "RingBuffer.h"
 #include "Signal.h"
 using Gallant::Signal1;
 using Gallant::Signal2; //Signal2 is a signal that passes two parameters. There's Signal0 through Signal8, so you can choose depending on how many parameters you need.
 
+#define MIDI_INPUT_RING_SIZE 1024 // messages that can arrive between two audio buffers before we start dropping them
+#define MIDI_QUEUE_SIZE 1024 // preallocated, so IMidiQueue never has to grow on the audio thread
+
 class MIDIReceiver {
     
 public:
     MIDIReceiver() :
-    mNumKeys(0),
-    mOffset(0) {
+    mOverflowCount(0),
+    mMidiQueue(MIDI_QUEUE_SIZE),
+    mNumKeys(0) {
         for (int i = 0; i < keyCount; i++) {
             mKeyStatus[i] = false;
         }
@@ -35,9 +40,15 @@ public:
     inline bool getKeyStatus(int keyIndex) const { return mKeyStatus[keyIndex]; }
     // Returns the number of keys currently pressed
     inline int getNumKeys() const { return mNumKeys; }
-    void advance();
-    void onMessageReceived(IMidiMsg* midiMessage);
-    inline void Flush(int nFrames) { mMidiQueue.Flush(nFrames); mOffset = 0; }
+    void advance(int offset);
+    int getNextEventOffset(int nFrames);
+    void onMessageReceived(IMidiMsg* midiMessage); // any one thread (host MIDI thread, RtMidi callback...) - never blocks or allocates
+    int readInput(IMidiMsg* midiMessages, int maxMessages); // audio/render thread: takes the messages received so far
+    void processInput(); // audio/render thread: moves the messages received so far into the queue
+    void addEvent(IMidiMsg* midiMessage); // audio/render thread: queues a message directly, e.g. from the virtual keyboard
+    void coalesceControlChanges(int blockEnd); // audio/render thread: drops the mod wheel / expression values superseded before blockEnd
+    inline int getOverflowCount() const { return mOverflowCount.load(); }
+    inline void Flush(int nFrames) { mMidiQueue.Flush(nFrames); }
     inline void Resize(int blockSize) { mMidiQueue.Resize(blockSize); }
     
     // both of these signal generators will pass two ints
@@ -48,11 +59,14 @@ public:
     Signal1< double > modChange;
     
 private:
+    RingBuffer<IMidiMsg, MIDI_INPUT_RING_SIZE> mInputRing; // from the thread receiving MIDI to the one processing it
+    IMidiMsg mInputMessages[MIDI_INPUT_RING_SIZE];
+    std::atomic<int> mOverflowCount; // messages dropped because mInputRing was full
     IMidiQueue mMidiQueue;
+    IMidiMsg mCoalescedMessages[MIDI_QUEUE_SIZE]; // the queue, taken out while coalesceControlChanges goes through it
     static const int keyCount = 128;
     int mNumKeys; // how mnay keys are being played at the moment (via midi)
     bool mKeyStatus[keyCount]; // array of on/off for each key (index is note number)
-    int mOffset;
 };
 
 #endif /* defined(__Synthesis__MIDIReceiver__) */
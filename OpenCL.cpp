@@ -13,309 +13,937 @@
 #define __CL_ENABLE_EXCEPTIONS
 
 #include "OpenCL.h"
-
-void CL_CALLBACK ping(cl_event event, cl_int status, void* data) {
-    std::cout << "\nCallback triggered - PING!";
-}
+#include "GPUService.h"
 
 
 void OpenCL::initOpenCL() {
     mTime = 0.0f;
-    sampleRate = 44100.0f;
     NUM_PARTIALS = 64;
-    mTimeStep = 1.0f/sampleRate;
+    setSampleRate(44100.0); // until the host tells us (Synthesis::Reset)
+    buildInterpolator(mInterpolator);
     MIDIParams[0] = 0.0f;
-
     
-    try {
-        Platform::get(&platforms);
-        
-        // Select the default platform and create a context using this platform and the GPU
-        cl_context_properties cps[3] = {
-            CL_CONTEXT_PLATFORM,
-            (cl_context_properties)(platforms[0])(),
-            0
-        };
-        
-        context = Context( CL_DEVICE_TYPE_GPU, cps);
-        
-        devices = context.getInfo<CL_CONTEXT_DEVICES>();
-        
-//        std::cout << "DEVICES = " << devices[0].getInfo<CL_DEVICE_NAME>().c_str() << ", " << devices[1].getInfo<CL_DEVICE_NAME>().c_str() << "\n\n";
-        
-        bool verbose = false;
-        
-        if (verbose) {
-            // Print out details of the first device
-            std::cout << "\nDevice: " << devices[0].getInfo<CL_DEVICE_NAME>().c_str();
-            std::cout << "\nVersion: " << devices[0].getInfo<CL_DEVICE_VERSION>().c_str();
-            std::cout << "\nMax Compute Units: " << devices[0].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-            std::cout << "\nGlobal Memory Size: " << devices[0].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()/1000000.0 << " MB";
-            std::cout << "\nLocal Memory Size: " << devices[0].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << " bytes";
-            std::cout << "\nMax Memory Object Size: " << devices[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() << " bytes";
-            std::cout << "\nMax Work Group Size: " << devices[0].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
-            std::cout << "\nMax Work Item Dimensions: " << devices[0].getInfo<CL_DEVICE_MAX_WORK_ITEM_DIMENSIONS>();
-            std::cout << "\nMax Work Item Sizes: " << devices[0].getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
-            std::cout << "\nPreferred Vector Width (Float): " << devices[0].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
-            std::cout << "\nPreferred Vector Width (Double): " << devices[0].getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE>();
-            std::cout << "\nExtensions: " << devices[0].getInfo<CL_DEVICE_EXTENSIONS>().c_str();
+    // the device, program and buffers are shared by every instance in the process - we just get our own slots in them
+    mService = &GPUService::getInstance();
+    mSlotBase = mService->registerClient();
+    if (mSlotBase >= 0) {
+        mMaxVoices = std::min(MAX_VOICES, VOICES_PER_DEVICE * mService->getNumDevices());
+    }
+}
+
+// the engine counts time in samples everywhere except the envelopes and the oscillators' phase, which go by mTimeStep - the voice
+// onsets and block sizes don't need touching
+void OpenCL::setSampleRate(double rate) {
+    sampleRate = (float)rate;
+    mTimeStep = 1.0f/sampleRate;
+    mPartialCeiling = std::min(AUDIBLE_CEILING, 0.5f * sampleRate);
+    mIFFTOnsetSamples = (int)(IFFT_ONSET_TIME * sampleRate); // the hammer strike lasts as long at any rate
+    mWavetableOnsetSamples = (int)(WAVETABLE_ONSET_TIME * sampleRate);
+    mWavetableGeneration++; // the ceiling's in the partial counts they were baked with
+}
+
+// the polyphase upsampler's coefficients, band by band and phase by phase: a Blackman-windowed sinc cut off at the band's Nyquist, INTERPOLATOR_TAPS
+// low-rate samples wide. tap t of phase p weighs the low-rate sample (INTERPOLATOR_TAPS/2 - 1 - t) * decimation + p samples before the one being
+// rendered (negative = after it). each phase sums to 1, so a band comes back at the level it was rendered at
+void OpenCL::buildInterpolator(float *coefficients) {
+    std::fill(coefficients, coefficients + INTERPOLATOR_SIZE, 0.0f);
+    for (int band = 0; band < MULTIRATE_BANDS; band++) {
+        int decimation = 2 << band;
+        double halfWidth = INTERPOLATOR_TAPS / 2 * decimation;
+        for (int phase = 0; phase < decimation; phase++) {
+            float *phaseCoefficients = &coefficients[(band * MAX_DECIMATION + phase) * INTERPOLATOR_TAPS];
+            double taps[INTERPOLATOR_TAPS];
+            double sum = 0.0;
+            for (int tap = 0; tap < INTERPOLATOR_TAPS; tap++) {
+                double x = phase + (INTERPOLATOR_TAPS / 2 - 1 - tap) * decimation;
+                double sinc = x == 0.0 ? 1.0 : sin(M_PI * x / decimation) / (M_PI * x / decimation);
+                double window = 0.42 + 0.5 * cos(M_PI * x / halfWidth) + 0.08 * cos(2.0 * M_PI * x / halfWidth);
+                taps[tap] = sinc * window;
+                sum += taps[tap];
+            }
+            for (int tap = 0; tap < INTERPOLATOR_TAPS; tap++) {
+                phaseCoefficients[tap] = (float)(taps[tap] / sum);
+            }
         }
-        
-        
-        
-        
-        // Create a command queue and use the first device
-        // queue = CommandQueue(context, devices[0], CL_QUEUE_PROFILING_ENABLE);
-        // Let's try using the second GPU on the Mac Pro!
-        queue = CommandQueue(context, devices[1], CL_QUEUE_PROFILING_ENABLE);
-        
-        // Read source file
-        std::ifstream sourceFile("opencl_kernels.cl");
-        std::string sourceCode(std::istreambuf_iterator<char>(sourceFile), (std::istreambuf_iterator<char>()));
-        Program::Sources source(1, std::make_pair(sourceCode.c_str(), sourceCode.length()+1));
-        
-        // Make program of the source code in the context
-        program = Program(context, source);
-                
-        // Build program for these specific devices
-        program.build(devices, "-cl-finite-math-only -cl-no-signed-zeros");
-        
-        string log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
-        
-        std::cout << "\n\n\n" << log.c_str();
-        
-        // Make kernel
-        oscillatorKernel = Kernel(program, "oscillator");
-        addVoicesKernel = Kernel(program, "add_voices");
-        
-        printf("Kernels compiled successfully!");
-        
-    } catch(Error error) {
-        std::cout << "\nline 92 .cpp\n";
-        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
-        cl::STRING_CLASS buildlog;
-        buildlog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
-        std::cout << "\n\n\n" << buildlog.c_str() << "\n\n\n";
     }
 }
 
-void OpenCL::calculateSamples() {
-    
-    try {
-        
-//        // copy voice data into array for loading to buffer
-//        for(int i = 0; i < NUM_ACTIVE_VOICES*NUM_VOICE_PARAMS; i++) {
-//            A[i] = voicesData[i];
-//            //std::cout << "\nvoicesData " << i << " = " << voicesData[i];
-//        }
-                
-        voicesDataBuffer = Buffer(context, CL_MEM_READ_ONLY, NUM_ACTIVE_VOICES * NUM_VOICE_PARAMS * sizeof(float));
+// splits each active voice's partials into bands for the batch. band b takes the partials (in float4s, the way the kernel loops over them) that
+// stay under MULTIRATE_GUARD of its Nyquist, fs / (4 << b), worst case - as far as the partial table's detune can stretch them, and with the
+// inharmonicity as strong as it gets (right at the onset), so it holds for every sample of the batch
+void OpenCL::updateBands() {
+    float maxRand = 1.0f + 32768.0f * mPartialDetuneRange / 7000000.0f; // the partial tables are shorts * range / 7000000 + 1
+    float mPitchBendCoarse = 2.0f * instrumentData[5];
+    float mPitchBendFine = 0.02f * instrumentData[6];
+    for (int j = 0; j < NUM_ACTIVE_VOICES; j++) {
+        int slot = activeSlots[j];
+        if (j < mNumWavetableVoices) { // no partials of their own - it's all in the tables (or all at the full rate, if GPUService can't bake them one)
+            std::fill(&mVoiceBandEnds[slot * MULTIRATE_BANDS], &mVoiceBandEnds[(slot + 1) * MULTIRATE_BANDS], 0);
+            continue;
+        }
+        const float *record = &voiceRecords[slot * NUM_VOICE_PARAMS];
+        float mFrequency = record[0];
+        float maxStretch = maxRand * std::max(1.0f, record[2]); // string 2 is randStringMult off string 1
+        float mB = voiceInharmonicity(this->mB, mFrequency, record[1], 0.0f);
+        int numPartials = std::max(0, std::min((numVoicePartials(mFrequency) + 3) / 4 * 4, MAX_PARTIALS)); // the partials the voice renders at all, in 4s
+        
+        int partials = 0;
+        for (int band = MULTIRATE_BANDS - 1; band >= 0; band--) {
+            float limit = MULTIRATE_GUARD * 0.5f * sampleRate / (float)(2 << band);
+            while (partials < numPartials) {
+                float eye = (float)(partials + 4); // the highest of the next 4
+                float freq = partialFrequency(eye, mFrequency, mB, mPitchBendCoarse, mPitchBendFine) * maxStretch;
+                if (!(freq < limit)) {
+                    break;
+                }
+                partials += 4;
+            }
+            mVoiceBandEnds[slot * MULTIRATE_BANDS + band] = partials;
+        }
+    }
+}
 
-        Event profileEventWriteBuffer;
-        //cl_ulong start, end;
+OpenCL::~OpenCL() {
+    if (mSlotBase >= 0) {
+        mService->unregisterClient(this);
+    }
+}
 
-        // Copy voiceData to memory buffer for writing to device
-        queue.enqueueWriteBuffer(voicesDataBuffer, CL_FALSE, 0, NUM_ACTIVE_VOICES * NUM_VOICE_PARAMS * sizeof(float), &voicesData, NULL, &profileEventWriteBuffer);
-        
-        
-        // create energy buffer and enqueue it for writing to GPU memory
-        voicesEnergyBuffer = Buffer(context, CL_MEM_READ_WRITE, BLOCK_SIZE * NUM_ACTIVE_VOICES * sizeof(float));
-        queue.enqueueWriteBuffer(voicesEnergyBuffer, CL_FALSE, 0, NUM_ACTIVE_VOICES * BLOCK_SIZE * sizeof(float), &voicesEnergy, NULL, NULL);
-        
-//        start = profileEventWriteBuffer.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-//        end = profileEventWriteBuffer.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-//        std::cout << "\nElapsed time (write buffer): " << (end-start)/1000.0 << " μs";
-        
-        voicesSampleBuffer = Buffer(context, CL_MEM_READ_WRITE, BLOCK_SIZE * NUM_CHANNELS * sizeof(float) * NUM_ACTIVE_VOICES); // intermediate output buffer storing one block of samples per voice (e.g. 64 blocks of 512 samples) which will get added by adder kernel later
-        
-        
-        // extra instrument data (could merge mB, mStringDetuneRange, etc. into this array! WAY cleaner!)
-        instrumentDataBuffer = Buffer(context, CL_MEM_READ_ONLY, NUM_INSTRUMENT_PARAMS * sizeof(float));
-        queue.enqueueWriteBuffer(instrumentDataBuffer, CL_FALSE, 0, NUM_INSTRUMENT_PARAMS * sizeof(float), &instrumentData, NULL, NULL);
-        
-        
-//        Buffer MIDIParamsBuffer = Buffer(context, CL_MEM_READ_WRITE, 1 * sizeof(float));
-//        queue.enqueueWriteBuffer(MIDIParamsBuffer, CL_FALSE, 0, 1 * sizeof(float), &MIDIParams);
-        
-        /// testing MIDI
-        
-        //printf("\nsustain = %f", MIDIParams[0]);
+void OpenCL::calculateSamples(double** outputs) {
+    
+    std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+    
+    /// testing MIDI
+    
+    //printf("\nsustain = %f", MIDIParams[0]);
 //        printf("%f\n", MIDIParams[2]);
 //        printf("%f\n", mModCurrent);
-        
-        
-        
-        // Calculate smoothed mod wheel values
-        // add new value to modBuffer and calculate SMA
-        modBuffer.push(mModCurrent);
-        // add the newest value and subtract out the oldest value from SMA (if we have more than X values in there already)
-        mModSmoothed += (mModCurrent - modBuffer.back()) / modBuffer.size();
-        if (modBuffer.size() > 4) {
-            modBuffer.pop();
-        }
+    
+    // Calculate smoothed mod wheel values
+    // add new value to modBuffer and calculate SMA
+    modBuffer.push(mModCurrent);
+    // add the newest value and subtract out the oldest value from SMA (if we have more than X values in there already)
+    mModSmoothed += (mModCurrent - modBuffer.back()) / modBuffer.size();
+    if (modBuffer.size() > 4) {
+        modBuffer.pop();
+    }
 //        printf("modBuffer length: %d\n", (int)modBuffer.size());
 //        printf("%f\n", mModSmoothed);
-        
-        
-//        float mModDelta = mModCurrent - mModPrevious;
-//        printf("mModDelta = %f", mModDelta);
-        
-//        printf("voicesData:\n");
-//        for (int i = 0; i < 5; i++) {
-//            std::cout << voicesData[i] << std::endl;
-//        }
-//        printf("------\n");
+    
+    routeVoices();
+    if (usesModalResonators()) {
+        updateModes();
+    } else {
+        updateBands();
+    }
+    if (mNumGPUVoices > 0) {
+        mService->render(this, outputs); // goes out in a round with the other instances' batches, renders our CPU voices meanwhile - it's all back in outputs (unclipped) and mCPUMix when this returns
+    } else {
+        for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+            std::fill(outputs[channel], outputs[channel] + mBatchFrames, 0.0);
+        }
+        renderCPUVoices();
+    }
+    
+    // add in the CPU's share and clip the lot
+    mMixPeak = 0.0f;
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        double *output = outputs[channel];
+        const float *cpuMix = &mCPUMix[channel * MAX_BLOCK_SIZE];
+        bool cpuVoices = mNumGPUVoices < NUM_ACTIVE_VOICES;
+        for (int i = 0; i < mBatchFrames; i++) {
+            double sample = cpuVoices ? output[i] + cpuMix[i] : output[i];
+            output[i] = std::max(-0.99, std::min(0.99, sample));
+            mMixPeak = fmaxf(mMixPeak, fabsf((float)output[i]));
+        }
+    }
+    
+    mModPrevious = mModCurrent;
+    
+    updateRenderCostModel(std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count());
+}
 
-        
-        // Set arguments to kernel
-        oscillatorKernel.setArg(0, voicesDataBuffer);
-        oscillatorKernel.setArg(1, voicesEnergyBuffer);
-        oscillatorKernel.setArg(2, instrumentDataBuffer);
-        oscillatorKernel.setArg(3, mModPrevious); // mod wheel
-        oscillatorKernel.setArg(4, mModCurrent);
-        oscillatorKernel.setArg(5, mB);
-        oscillatorKernel.setArg(6, mPartialDetuneRange);
-        oscillatorKernel.setArg(7, mTimeStep);
-        oscillatorKernel.setArg(8, NUM_PARTIALS);
-        oscillatorKernel.setArg(9, BLOCK_SIZE);
-        oscillatorKernel.setArg(10, NUM_CHANNELS);
-        oscillatorKernel.setArg(11, voicesSampleBuffer);
-        
-        mModPrevious = mModCurrent;
-        
-        /// test print out mEnergy array
-//        for (int i = 0; i < NUM_ACTIVE_VOICES * BLOCK_SIZE; i++) {
-//            printf("%f\n", voicesEnergy[i]);
-//        }
-        
-        
-        
-//        std::cout << "\nMax work-items per work-group for this kernel: " << oscillatorKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[0]); /// warning: I think this is OpenCL 1.1 only.
-//        std::cout << "\nPreferred work-group size multiple for this kernel: " << oscillatorKernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(devices[0]); /// warning: I think this is OpenCL 1.1 only.
-//        std::cout << "\nLocal memory size used by this kernel: " << oscillatorKernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(devices[0]);
-//        std::cout << "\nPrivate memory size used by this kernel: " << oscillatorKernel.getWorkGroupInfo<CL_KERNEL_PRIVATE_MEM_SIZE>(devices[0]);
-        
-        GLOBAL_SIZE = BLOCK_SIZE * NUM_ACTIVE_VOICES; // each work-item calculates one stereo (or mono) sample for one voice
-        globalSize = GLOBAL_SIZE; // NDRange var
-        
-        // find max work group size supported on the device for this kernel.
-        /// NOTE: OpenCL 1.1 only, I think. Later on, default this to 256, and then say, hey, if you have OpenCL 1.1 or above, then check what the max work group size is for this kernel, then use THAT number. As a fallback, use 256.
-        MAX_WORK_GROUP_SIZE = static_cast<int>(oscillatorKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[0]));
-        WORK_GROUP_SIZE = MAX_WORK_GROUP_SIZE;
-        
-        
-        // make sure local size isn't bigger than global size
-        // e.g. if only doing 1 synth voice with 128 samples, global size would be 128 but max work group size could be 256, causing -54 error (can't have local size bigger than global size)
-        if (WORK_GROUP_SIZE > GLOBAL_SIZE) {
-            WORK_GROUP_SIZE = GLOBAL_SIZE;
+// how long a batch of this many voices is predicted to take, split the best way between the GPU and the CPU (which run at the same time) -
+// and how many of the voices go to the CPU for that. honors CPU_VOICES and the modal engine (GPU only), and everything goes to the CPU if we never got a GPU. the IFFT
+// voices (as many as in the last batch routed) are always on the CPU's side, and the wavetable voices on the GPU's - a couple of table
+// reads a sample is next to nothing, so all they cost is the launch
+double OpenCL::predictRenderTime(int voices, int frames, int *cpuVoices) {
+    int wavetableVoices = std::min(mNumWavetableVoices, voices);
+    voices -= wavetableVoices;
+    int ifftVoices = std::min(mNumIFFTVoices, voices);
+    double ifftTime = mIFFTVoiceSampleTime * ifftVoices * frames;
+    voices -= ifftVoices;
+    int minCPUVoices = 0;
+    int maxCPUVoices = voices;
+    if (CPU_VOICES > 0 || mSlotBase < 0) {
+        minCPUVoices = voices;
+    } else if (CPU_VOICES == 0 || usesModalResonators()) {
+        maxCPUVoices = 0;
+    }
+    double partialSamples = (double)frames * NUM_PARTIALS;
+    int bestCPUVoices = minCPUVoices;
+    double bestTime = -1.0;
+    for (int c = minCPUVoices; c <= maxCPUVoices; c++) {
+        double gpuTime = c < voices || wavetableVoices > 0 ? mLaunchTime + mPartialSampleTime * (voices - c) * partialSamples : 0.0;
+        double cpuTime = mCPUPartialSampleTime * c * partialSamples + ifftTime;
+        double time = std::max(gpuTime, cpuTime);
+        if (bestTime < 0.0 || time < bestTime) {
+            bestTime = time;
+            bestCPUVoices = c;
         }
-        // this is to make sure that global size is always divisible by local size (to avoid -54 error, e.g. globalsize 384 and local size 256)
-        if (GLOBAL_SIZE%WORK_GROUP_SIZE > 0) {
-            WORK_GROUP_SIZE = BLOCK_SIZE;
+    }
+    if (cpuVoices) {
+        *cpuVoices = bestCPUVoices + ifftVoices;
+    }
+    return bestTime;
+}
+
+// splits this batch's voices. the wavetable voices go to the very front, for the GPU. of the rest, the ones over IFFT_PARTIALS are the
+// lowest notes, so they're at the front of the list - they go to the back, except while they're still in the hammer strike, and the split
+// is between the GPU and the CPU's direct renderer for the rest. the CPU side gets calibrated with a single voice first - until then it looks free.
+// the modal engine keeps them all on the GPU
+void OpenCL::routeVoices() {
+    mNumWavetableVoices = 0;
+    if (usesModalResonators()) { // the resonators' state is on the device - nothing else can carry on from it
+        mNumIFFTVoices = 0;
+        mNumGPUVoices = NUM_ACTIVE_VOICES;
+        return;
+    }
+    for (int j = 0; j < NUM_ACTIVE_VOICES; j++) {
+        if (isWavetableVoice(activeSlots[j])) {
+            std::rotate(activeSlots + mNumWavetableVoices, activeSlots + j, activeSlots + j + 1); // to the front, in order
+            mNumWavetableVoices++;
         }
-        localSize = WORK_GROUP_SIZE; // NDRange var
-        
-        //printf("global size = %d, local size = %d\n", GLOBAL_SIZE, WORK_GROUP_SIZE);
-        
-        // Create profiling event
-        Event profileEvent;
-        Event profileEventAdder;
-        Event profileEventRead;
-        // Configure callback event
-        Event callbackEvent;
-        
-        
-        /// launch oscillator kernel
-        
-        /// architecture: each work-item computes one sample for one voice. they do not talk to each other, so feedback is not possible.
-        
-        // Compute!
-        //printf("just before oscillatorkernel");
-        queue.enqueueNDRangeKernel(oscillatorKernel, NullRange, globalSize, localSize, NULL, &profileEvent); // second arg is offset
-//
-        
-//        std::cout << "\nNumber of voices: " << NUM_ACTIVE_VOICES;
-//        std::cout << "\nNumber of partials per voice: " << NUM_PARTIALS;
-//        std::cout << "\nTotal number of partials: " << NUM_PARTIALS * NUM_ACTIVE_VOICES;
+    }
+    int heavyVoices = mNumWavetableVoices;
+    while (IFFT_PARTIALS >= 0 && heavyVoices < NUM_ACTIVE_VOICES && numVoicePartials(voiceRecords[activeSlots[heavyVoices] * NUM_VOICE_PARAMS]) > IFFT_PARTIALS) {
+        heavyVoices++;
+    }
+    int strikingVoices = mNumWavetableVoices;
+    for (int j = mNumWavetableVoices; j < heavyVoices; j++) {
+        if ((int)(mSampleClock - voiceOnsets[activeSlots[j]]) < mIFFTOnsetSamples) {
+            std::rotate(activeSlots + strikingVoices, activeSlots + j, activeSlots + j + 1); // to the front, in order
+            strikingVoices++;
+        }
+    }
+    mNumIFFTVoices = heavyVoices - strikingVoices;
+    std::rotate(activeSlots + strikingVoices, activeSlots + heavyVoices, activeSlots + NUM_ACTIVE_VOICES);
+    int cpuVoices;
+    predictRenderTime(NUM_ACTIVE_VOICES, mBatchFrames, &cpuVoices);
+    if (mCPUPartialSampleTime <= 0.0 && CPU_VOICES < 0 && mSlotBase >= 0) {
+        cpuVoices = std::min(mNumIFFTVoices + 1, NUM_ACTIVE_VOICES - mNumWavetableVoices);
+    }
+    mNumGPUVoices = NUM_ACTIVE_VOICES - cpuVoices;
+}
 
-        /// elapsed oscillator kernel time
-        
-//        queue.finish();
-//        cl_ulong start, end;
-//        start = profileEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-//        end = profileEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-//        std::cout << "\nElapsed time (oscillator): " << (int)((end-start)/1000.0) << " μs";
-//        // only print the bad ones
-//        //        if ((end-start)/1000.0 > 500) {
-//        //            std::cout << "\n*****Elapsed time (oscillator): " << (end-start)/1000.0 << " μs";
-//        //        }
-//        std::cout << "\nOne block of samples time length: " << mTimeStep*BLOCK_SIZE*1000000 << " μs";
-        
-        
-        
-        /// launch a final adder kernel
-        
-        /// this kernel adds up the array of samples for each voice - e.g. we have 16 blocks of 512 samples (256 * 2 channels), and each work-item is going to add up one sample index, e.g. 0 + 512 + 1024 + 1536...
+// whether a voice plays from wavetables this batch: there's a GPU to play them on, it's past the hammer strike, it has the partials to make
+// it worth it (and few enough for the tables), and all of them are within WAVETABLE_MAX_DETUNE of n times the fundamental. that's worst
+// case, the way updateBands() goes about it - the highest partial, the partial table's widest detune, and the inharmonicity as strong as it
+// gets this batch. the fine pitch bend's stretch counts too. string 2 is randStringMult off string 1 as a whole, which the tables can do
+bool OpenCL::isWavetableVoice(int slot) {
+    int blockAge = (int)(mSampleClock - voiceOnsets[slot]);
+    if (WAVETABLE_PARTIALS < 0 || mSlotBase < 0 || CPU_VOICES > 0 || blockAge < mWavetableOnsetSamples) {
+        return false;
+    }
+    const float *record = &voiceRecords[slot * NUM_VOICE_PARAMS];
+    float mFrequency = record[0];
+    int numPartials = (numVoicePartials(mFrequency) + 3) / 4 * 4;
+    if (numPartials < WAVETABLE_PARTIALS || numPartials > WAVETABLE_MAX_PARTIALS) {
+        return false;
+    }
+    float maxRand = 1.0f + 32768.0f * mPartialDetuneRange / 7000000.0f;
+    float mPitchBendCoarse = 2.0f * instrumentData[5];
+    float mPitchBendFine = 0.02f * instrumentData[6];
+    float mTime = mTimeStep * (float)blockAge;
+    float mB = voiceInharmonicity(this->mB, mFrequency, record[1], mTime);
+    float eye = (float)numPartials;
+    float stretch = (mPitchBendCoarse + mPitchBendFine * powf(eye, 0.3f)) / (mPitchBendCoarse + mPitchBendFine) * sqrtf((1.0f + mB * eye * eye) / (1.0f + mB));
+    return stretch * maxRand - 1.0f <= WAVETABLE_MAX_DETUNE;
+}
 
-        float *samples = new float[BLOCK_SIZE * NUM_CHANNELS];
-        
-        outputSampleBuffer = Buffer(context, CL_MEM_READ_WRITE, BLOCK_SIZE * NUM_CHANNELS * sizeof(float));
-        
-        addVoicesKernel.setArg(0, voicesSampleBuffer);
-        addVoicesKernel.setArg(1, NUM_ACTIVE_VOICES);
-        addVoicesKernel.setArg(2, BLOCK_SIZE);
-        addVoicesKernel.setArg(3, NUM_CHANNELS);
-        addVoicesKernel.setArg(4, outputSampleBuffer);
-        
-        MAX_WORK_GROUP_SIZE = static_cast<int>(addVoicesKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(devices[0]));
+// what bake_wavetables needs to bake a voice's layers on the device: for each layer, each partial's amplitude at the layer's level of the
+// energy curve (random amplitude and all), and that weighted by string 1's pan and by string 2's (spectrum, WAVETABLE_MAX_PARTIALS * 3 floats a
+// layer) - and for playing them back, where the layers are (info). partial n is taken to be at n times the fundamental, brightness exponent and
+// all. the top layer is at topEnergy, as loud as the voice gets while they're in use, and each layer leaves out the partials that are too quiet
+// in it to matter, so it's shorter too. false if the voice is silent at topEnergy
+bool OpenCL::buildWavetable(int slot, float topEnergy, WavetableInfo& info, float *spectrum) {
+    
+    float mLinearTerm = instrumentData[0];
+    float mSquaredTerm = instrumentData[1];
+    float mCubicTerm = instrumentData[2];
+    float energyCurve = topEnergy*(mLinearTerm + topEnergy*(mSquaredTerm + topEnergy*(mCubicTerm)));
+    if (!(energyCurve > 0.0f)) {
+        return false;
+    }
+    if (mCPUTableSeeds[slot] != voiceRecords[slot * NUM_VOICE_PARAMS + 3] || mCPUTableDetuneRanges[slot] != mPartialDetuneRange) {
+        buildCPUPartialTable(slot);
+    }
+    const float *partialRands = &mCPUPartialTables[slot * MAX_PARTIALS];
+    float mFrequency = voiceRecords[slot * NUM_VOICE_PARAMS];
+    float mBrightnessA = 1.0f - instrumentData[3];
+    float mBrightnessB = 10000.0f * instrumentData[4];
+    float fundamental = (2.0f * instrumentData[5] + 0.02f * instrumentData[6]) * mFrequency;
+    float partialDetuneRange = mPartialDetuneRange / 7000000.0f;
+    int numPartials = (numVoicePartials(mFrequency) + 3) / 4 * 4;
+    
+    float exponents[WAVETABLE_MAX_PARTIALS], amps[WAVETABLE_MAX_PARTIALS], pans[WAVETABLE_MAX_PARTIALS];
+    info.transientMono = 0.0f;
+    info.transientPan = 0.0f;
+    for (int i = 0; i < numPartials; i++) {
+        float rand = partialRands[i];
+        float eye = (float)i + 1.0f;
+        exponents[i] = powf(eye, mBrightnessA) + eye * fundamental/mBrightnessB;
+        amps[i] = partialAmp(rand, partialDetuneRange);
+        pans[i] = partialPan(rand, partialDetuneRange);
+        if (i % 4 == 0) {
+            info.transientMono += fabsf(rand - 1.0f);
+            info.transientPan += fabsf(rand - 1.0f) * pans[i];
+        }
+    }
+    
+    // the top step moves the brightest partial by WAVETABLE_LAYER_STEP, and the ratio between steps gets the layers down WAVETABLE_DEPTH - by
+    // bisection, since the depth only goes up with it
+    info.topLogEnergy = logf(energyCurve);
+    info.firstStep = std::min(WAVETABLE_LAYER_STEP / exponents[numPartials - 1], 0.5f * WAVETABLE_DEPTH / (WAVETABLE_LAYERS - 1));
+    float lowRatio = 1.0f;
+    float highRatio = 4.0f;
+    for (int i = 0; i < 32; i++) {
+        float ratio = 0.5f * (lowRatio + highRatio);
+        if (info.firstStep * (powf(ratio, (float)(WAVETABLE_LAYERS - 1)) - 1.0f) / (ratio - 1.0f) < WAVETABLE_DEPTH) {
+            lowRatio = ratio;
+        } else {
+            highRatio = ratio;
+        }
+    }
+    info.ratio = highRatio;
+    info.bottomExponent = exponents[0];
+    
+    for (int layer = 0; layer < WAVETABLE_LAYERS; layer++) {
+        float logEnergy = info.topLogEnergy - info.firstStep * (powf(info.ratio, (float)layer) - 1.0f) / (info.ratio - 1.0f);
+        // the exponents only go up with the partial number, so the loudest partial is the fundamental (or the top one, if the energy curve is
+        // over 1), and the ones that are too quiet are at the top
+        float loudest = logEnergy * (logEnergy < 0.0f ? exponents[0] : exponents[numPartials - 1]);
+        int partials = numPartials;
+        while (partials > 1 && logEnergy * exponents[partials - 1] - loudest < WAVETABLE_FLOOR) {
+            partials--;
+        }
+        int length = 1;
+        while (length < WAVETABLE_OVERSAMPLING * partials) {
+            length *= 2;
+        }
+        info.lengths[layer] = length;
+        info.partials[layer] = partials;
+        float *layerSpectrum = &spectrum[layer * WAVETABLE_MAX_PARTIALS * 3];
+        for (int i = 0; i < partials; i++) {
+            float amp = expf(logEnergy * exponents[i]) * amps[i];
+            layerSpectrum[3 * i] = amp;
+            layerSpectrum[3 * i + 1] = amp * pans[i];
+            layerSpectrum[3 * i + 2] = amp * pans[i / 4 * 4 + string2Pans[i % 4]];
+        }
+    }
+    return true;
+}
+
+// d log(energy curve) / d log(energy) - how many times faster than the energy itself the energy curve dies away, or gets turned down
+static float energyCurveSlope(const float *instrumentData, float energy) {
+    float curve = instrumentData[0] + energy*(instrumentData[1] + energy*instrumentData[2]);
+    return curve > 0.0f ? (instrumentData[0] + energy*(2.0f*instrumentData[1] + energy*3.0f*instrumentData[2])) / curve : 1.0f;
+}
+
+// a strike at sampleIndex (counted from the start of the batch): a new note, or a restrike of a ringing string, which leaves remaining of
+// its energy before the hammer puts strikeEnergy in (see VoiceManager::onNoteOn). a new note's resonators start from nothing, and a restrike's
+// get turned down the way the additive engine turns its partials down, by the energy curve to each one's exponent. two strikes before a batch
+// goes off land together, at the first one
+void OpenCL::strikeModes(int slot, int sampleIndex, float energy, float remaining, float strikeEnergy, bool newNote) {
+    ModalVoice& modes = mVoiceModes[slot];
+    bool clear = newNote || !(remaining > 0.0f && energy > 0.0f);
+    float resetLogEnergy = clear ? 0.0f : energyCurveSlope(instrumentData, energy) * logf(remaining);
+    if ((int)(mStrikeClocks[slot] - mSampleClock) >= 0) { // there's one waiting for this batch already
+        modes.clearModes = modes.clearModes || clear;
+        modes.resetLogEnergy += resetLogEnergy;
+    } else {
+        mStrikeClocks[slot] = mSampleClock + sampleIndex;
+        modes.clearModes = clear;
+        modes.resetLogEnergy = resetLogEnergy;
+    }
+    // the spectrum's shaped at the energy the string ends up with - brighter the harder it's hit - and a new note's hammer brings all of it
+    float level = (clear ? 0.0f : energy * remaining) + strikeEnergy;
+    float curve = level*(instrumentData[0] + level*(instrumentData[1] + level*(instrumentData[2])));
+    bool audible = curve > 0.0f && strikeEnergy > 0.0f;
+    modes.strikeLogEnergy = audible ? logf(curve) : 0.0f;
+    modes.strikeScale = audible ? 1.0f / (clear ? strikeEnergy : level) : 0.0f;
+}
 
-        int global_size_adder = BLOCK_SIZE * NUM_CHANNELS;
-        globalSizeAdder = global_size_adder;
-        int local_size_adder = MAX_WORK_GROUP_SIZE;
-        // make sure that local size isn't bigger than global size
-        if (local_size_adder > global_size_adder) {
-            local_size_adder = global_size_adder;
+// the modal engine's part of each active voice's batch: how fast the energy curve dies away - the energy rows' decay from sample to sample,
+// with the hammer's force and any strike's reset taken out, times the energy curve's log slope in the middle of the batch - and where a
+// strike lands in it, if one does
+void OpenCL::updateModes() {
+    for (int j = 0; j < NUM_ACTIVE_VOICES; j++) {
+        int slot = activeSlots[j];
+        ModalVoice& modes = mVoiceModes[slot];
+        const float *energy = &voicesEnergy[slot * MAX_BLOCK_SIZE];
+        const float *force = &voicesForce[slot * MAX_BLOCK_SIZE];
+        int resetSample = (int)(mStrikeClocks[slot] - mSampleClock);
+        modes.resetSample = resetSample >= 0 && resetSample < mBatchFrames ? resetSample : -1;
+        double decay = 1.0;
+        int samples = 0;
+        for (int k = 1; k < mBatchFrames; k++) {
+            if (energy[k - 1] > 0.0f && k != modes.resetSample) {
+                decay *= (energy[k] - force[k]) / energy[k - 1];
+                samples++;
+            }
+        }
+        float logDecay = samples > 0 && decay > 0.0 ? (float)(log(decay) / samples) : 0.0f;
+        modes.logDecay = std::min(0.0f, energyCurveSlope(instrumentData, energy[mBatchFrames / 2]) * logDecay);
+    }
+}
+
+// renders the voices from mNumGPUVoices on into mCPUMix, and their peaks - the IFFT voices at the end by inverse FFT, the others directly
+void OpenCL::renderCPUVoices() {
+    std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+    if (mNumGPUVoices == NUM_ACTIVE_VOICES) {
+        mCPURenderTime = 0.0;
+        mIFFTRenderTime = 0.0;
+        return;
+    }
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        std::fill(&mCPUMix[channel * MAX_BLOCK_SIZE], &mCPUMix[channel * MAX_BLOCK_SIZE + mBatchFrames], 0.0f);
+    }
+    int firstIFFTVoice = NUM_ACTIVE_VOICES - mNumIFFTVoices;
+    for (int j = mNumGPUVoices; j < NUM_ACTIVE_VOICES; j++) {
+        int slot = activeSlots[j];
+        if (mCPUTableSeeds[slot] != voiceRecords[slot * NUM_VOICE_PARAMS + 3] || mCPUTableDetuneRanges[slot] != mPartialDetuneRange) {
+            buildCPUPartialTable(slot);
+        }
+        if (j == firstIFFTVoice) {
+            std::chrono::steady_clock::time_point ifftStart = std::chrono::steady_clock::now();
+            mCPURenderTime = std::chrono::duration<double>(ifftStart - renderStart).count();
+            renderStart = ifftStart;
+        }
+        voicesPeak[j] = j < firstIFFTVoice ? renderCPUVoice(slot, mCPUMix) : renderIFFTVoice(slot, mCPUMix);
+    }
+    double renderTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+    if (mNumIFFTVoices > 0) {
+        mIFFTRenderTime = renderTime;
+    } else {
+        mCPURenderTime = renderTime;
+        mIFFTRenderTime = 0.0;
+    }
+}
+
+// the same xorshift sequence as build_partial_table in opencl_kernels.cl, so a voice sounds the same whichever side renders it
+void OpenCL::buildCPUPartialTable(int slot) {
+    
+    short x = (short)voiceRecords[slot * NUM_VOICE_PARAMS + 3]; // random seed
+    
+    float partialDetuneRange = mPartialDetuneRange / 7000000.0f;
+    
+    for (int i = 0; i < MAX_PARTIALS; i++) {
+        // xorshift deterministic RNG, the way OpenCL C does it with a short: shift counts are taken modulo the width of int (so >> 35 is >> 3),
+        // and whatever << 21 does is above the 16 bits that are kept
+        x = (short)(x ^ (x >> 3));
+        x = (short)(x ^ (short)((unsigned short)x << 4));
+        mCPUPartialTables[slot * MAX_PARTIALS + i] = (float)x * partialDetuneRange + 1.0f;
+    }
+    mCPUTableSeeds[slot] = voiceRecords[slot * NUM_VOICE_PARAMS + 3];
+    mCPUTableDetuneRanges[slot] = mPartialDetuneRange;
+}
+
+static int floorDiv(int a, int d) {
+    return (a >= 0 ? a : a - d + 1) / d;
+}
+
+// one voice's batch on the host, added into mix - the same steps as the oscillator_bands and oscillator kernels in opencl_kernels.cl: the
+// decimated bands first (a little past both ends of the batch), then the full-rate partials with the bands upsampled in. returns the voice's peak level
+float OpenCL::renderCPUVoice(int slot, float *mix) {
+    
+    int blockAge = (int)(mSampleClock - voiceOnsets[slot]); // samples since the note started, at the start of the batch
+    const int *bandEnds = &mVoiceBandEnds[slot * MULTIRATE_BANDS];
+    for (int i = 0; i < MAX_PARTIALS; i++) {
+        mHarmonicSpans[i].anchor = -1; // the last voice's
+    }
+    
+    for (int band = 0; band < MULTIRATE_BANDS; band++) {
+        int firstPartial = band + 1 < MULTIRATE_BANDS ? bandEnds[band + 1] : 0;
+        if (firstPartial >= bandEnds[band]) {
+            continue;
+        }
+        int decimation = 2 << band;
+        int firstSample = floorDiv(blockAge, decimation) - INTERPOLATOR_TAPS/2 + 1;
+        int numSamples = floorDiv(blockAge + mBatchFrames - 1, decimation) + INTERPOLATOR_TAPS/2 + 1 - firstSample;
+        float *bandSamples = &mCPUBandSamples[band * BAND_ROW_LENGTH * NUM_CHANNELS];
+        for (int i = 0; i < numSamples; i++) {
+            int age = (firstSample + i) * decimation;
+            float sampleL = 0.0f;
+            float sampleR = 0.0f;
+            if (age >= 0) {
+                renderCPUPartials(slot, age, std::min(std::max(age - blockAge, 0), mBatchFrames - 1), firstPartial, bandEnds[band], sampleL, sampleR);
+            }
+            bandSamples[NUM_CHANNELS * i] = sampleL;
+            bandSamples[NUM_CHANNELS * i + 1] = sampleR;
+        }
+    }
+    
+    float peak = 0.0f;
+    for (int sampleIndex = 0; sampleIndex < mBatchFrames; sampleIndex++) {
+        int age = blockAge + sampleIndex;
+        if (age < 0) { // not started yet - silent
+            continue;
+        }
+        float sampleL = 0.0f;
+        float sampleR = 0.0f;
+        renderCPUPartials(slot, age, sampleIndex, bandEnds[0], MAX_PARTIALS, sampleL, sampleR);
+        
+        for (int band = 0; band < MULTIRATE_BANDS; band++) {
+            int firstPartial = band + 1 < MULTIRATE_BANDS ? bandEnds[band + 1] : 0;
+            if (firstPartial >= bandEnds[band]) {
+                continue;
+            }
+            int decimation = 2 << band;
+            int center = age / decimation;
+            int firstTap = center - INTERPOLATOR_TAPS/2 + 1 - (floorDiv(blockAge, decimation) - INTERPOLATOR_TAPS/2 + 1);
+            const float *coefficients = &mInterpolator[(band * MAX_DECIMATION + age - center * decimation) * INTERPOLATOR_TAPS];
+            const float *bandSamples = &mCPUBandSamples[(band * BAND_ROW_LENGTH + firstTap) * NUM_CHANNELS];
+            for (int tap = 0; tap < INTERPOLATOR_TAPS; tap++) {
+                sampleL += coefficients[tap] * bandSamples[NUM_CHANNELS * tap];
+                sampleR += coefficients[tap] * bandSamples[NUM_CHANNELS * tap + 1];
+            }
         }
-        localSizeAdder = local_size_adder;
-        
-        queue.enqueueNDRangeKernel(addVoicesKernel, NullRange, globalSizeAdder, localSizeAdder, NULL, &profileEventAdder); // second arg is offset
-        
-        
-//        start = profileEventAdder.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-//        end = profileEventAdder.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-//        std::cout << "\nElapsed time (adder kernel): " << (end-start)/1000.0 << " μs";
-        
-        // read back final summed samples
-        queue.enqueueReadBuffer(outputSampleBuffer, CL_TRUE, 0, BLOCK_SIZE * NUM_CHANNELS * sizeof(float), samples, NULL, &profileEventRead);
-        
-        //queue.finish();
-        
-//        start = profileEventRead.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-//        end = profileEventRead.getProfilingInfo<CL_PROFILING_COMMAND_END>();
-//        std::cout << "\nElapsed time (read buffer): " << (end-start)/1000.0 << " μs";
-        
-        
-        // Set callback function
-        //callbackEvent.setCallback(CL_COMPLETE, &ping, (void*)samples);
         
-        // Copy output buffer to blockOfSamples for returning
-        for (int i = 0; i < BLOCK_SIZE * NUM_CHANNELS; i++) {
-            blockOfSamples[i] = (double)samples[i];
+        sampleL *= 0.15f;
+        sampleR *= 0.15f;
+        mix[sampleIndex] += sampleL;
+        mix[MAX_BLOCK_SIZE + sampleIndex] += sampleR;
+        peak = fmaxf(peak, fmaxf(fabsf(sampleL), fabsf(sampleR)));
+    }
+    return peak;
+}
+
+// one voice's batch by inverse FFT, added into mix. a frame every IFFT_HOP samples from the start of the batch (or the onset, if it's inside),
+// holding each partial the way it is at the frame's center - the same partials renderCPUPartials() adds up sample by sample (the transient,
+// which is an offset rather than a sinusoid, goes in at 0Hz). the last frame sits past the end of the batch, with the last energy sample - so
+// nothing carries over to the next batch, which starts with a frame of its own. returns the voice's peak level
+float OpenCL::renderIFFTVoice(int slot, float *mix) {
+    
+    const float *record = &voiceRecords[slot * NUM_VOICE_PARAMS];
+    float mFrequency = record[0];
+    float mVelocity = record[1];
+    float randStringMult = record[2];
+    const float *partialRands = &mCPUPartialTables[slot * MAX_PARTIALS];
+    
+    float mLinearTerm = instrumentData[0];
+    float mSquaredTerm = instrumentData[1];
+    float mCubicTerm = instrumentData[2];
+    float mBrightnessA = 1.0f - instrumentData[3];
+    float mBrightnessB = 10000.0f * instrumentData[4];
+    float mPitchBendCoarse = 2.0f * instrumentData[5]; // (0, 2)
+    float mPitchBendFine = 0.02f * instrumentData[6]; // (0, 0.02)
+    
+    int numPartials = numVoicePartials(mFrequency);
+    float partialDetuneRange = mPartialDetuneRange / 7000000.0f;
+    float binsPerHz = (float)IFFT_SIZE / sampleRate;
+    
+    int blockAge = (int)(mSampleClock - voiceOnsets[slot]);
+    for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+        std::fill(&mIFFTSamples[channel * MAX_BLOCK_SIZE], &mIFFTSamples[channel * MAX_BLOCK_SIZE + mBatchFrames], 0.0f);
+    }
+    int firstSample = std::max(-blockAge, 0);
+    for (int center = firstSample; center < mBatchFrames + IFFT_HOP - 1; center += IFFT_HOP) {
+        float mTime = mTimeStep * (float)(blockAge + center);
+        float mEnergy = voicesEnergy[slot * MAX_BLOCK_SIZE + std::min(center, mBatchFrames - 1)];
+        
+        float mB = voiceInharmonicity(this->mB, mFrequency, mVelocity, mTime);
+        
+        float energyCurve = mEnergy*(mLinearTerm + mEnergy*(mSquaredTerm + mEnergy*(mCubicTerm)));
+        float transient = powf(0.5f, mTime*50.0f) * 20.0f * mEnergy * mEnergy * (1.0f + mEnergy);
+        float panSpeed = voicePanSpeed(mTime);
+        float offsetL = 0.0f;
+        float offsetR = 0.0f;
+        
+        mIFFT.clear();
+        for (int i = 0; i < numPartials; i += 4) {
+            float pans[4];
+            for (int k = 0; k < 4; k++) {
+                pans[k] = partialPan(partialRands[i + k], partialDetuneRange);
+            }
+            for (int k = 0; k < 4; k++) {
+                float rand = partialRands[i + k];
+                float eye = (float)(i + k) + 1.0f;
+                float freq = partialFrequency(eye, mFrequency, mB, mPitchBendCoarse, mPitchBendFine);
+                float amp = powf(energyCurve, powf(eye, mBrightnessA) + freq/mBrightnessB) * partialAmp(rand, partialDetuneRange);
+                float bin = freq * rand * binsPerHz;
+                float pan = pans[k];
+                float string2Pan = pans[string2Pans[k]];
+                mIFFT.addSinusoid(bin, amp, 6.2831853f * mTime * freq * rand, panLeft(pan, panSpeed), panRight(pan, panSpeed));
+                mIFFT.addSinusoid(bin * randStringMult, amp, 6.2831853f * mTime * freq * rand * randStringMult, panLeft(string2Pan, panSpeed), panRight(string2Pan, panSpeed));
+            }
+            float offset = fabsf(partialRands[i] - 1.0f) * transient;
+            offsetL += offset * panLeft(pans[0], panSpeed);
+            offsetR += offset * panRight(pans[0], panSpeed);
+        }
+        mIFFT.addSinusoid(0.0f, 1.0f, 1.5707963f, offsetL, offsetR); // sin(pi/2) = 1 at 0Hz
+        mIFFT.synthesize();
+        
+        for (int n = 1 - IFFT_HOP; n < IFFT_HOP; n++) {
+            int sampleIndex = center + n;
+            if (sampleIndex >= firstSample && sampleIndex < mBatchFrames) {
+                mIFFTSamples[sampleIndex] += mIFFT.frameLeft[n + IFFT_HOP];
+                mIFFTSamples[MAX_BLOCK_SIZE + sampleIndex] += mIFFT.frameRight[n + IFFT_HOP];
+            }
+        }
+    }
+    
+    float peak = 0.0f;
+    for (int sampleIndex = 0; sampleIndex < mBatchFrames; sampleIndex++) {
+        float sampleL = mIFFTSamples[sampleIndex] * 0.15f;
+        float sampleR = mIFFTSamples[MAX_BLOCK_SIZE + sampleIndex] * 0.15f;
+        mix[sampleIndex] += sampleL;
+        mix[MAX_BLOCK_SIZE + sampleIndex] += sampleR;
+        peak = fmaxf(peak, fmaxf(fabsf(sampleL), fabsf(sampleR)));
+    }
+    return peak;
+}
+
+// partials firstPartial..lastPartial-1 of one voice at one moment, added to sampleL / sampleR - a straight port of voice_partials in
+// opencl_kernels.cl, with the float4s unrolled into a loop of 4. with HARMONIC_SPAN on, the CPU takes its own path instead (the same sound,
+// to well under the float path's own error), which the GPU doesn't have
+void OpenCL::renderCPUPartials(int slot, int age, int sampleIndex, int firstPartial, int lastPartial, float& sampleL, float& sampleR) {
+    
+    if (HARMONIC_SPAN > 0) {
+        renderHarmonicPartials(slot, age, sampleIndex, firstPartial, lastPartial, sampleL, sampleR);
+        return;
+    }
+    
+    const float *record = &voiceRecords[slot * NUM_VOICE_PARAMS];
+    float mFrequency = record[0];
+    float mVelocity = record[1];
+    float randStringMult = record[2];
+    const float *partialRands = &mCPUPartialTables[slot * MAX_PARTIALS];
+    
+    float mLinearTerm = instrumentData[0];
+    float mSquaredTerm = instrumentData[1];
+    float mCubicTerm = instrumentData[2];
+    float mBrightnessA = 1.0f - instrumentData[3];
+    float mBrightnessB = 10000.0f * instrumentData[4];
+    float mPitchBendCoarse = 2.0f * instrumentData[5]; // (0, 2)
+    float mPitchBendFine = 0.02f * instrumentData[6]; // (0, 0.02)
+    
+    int numPartials = std::min(numVoicePartials(mFrequency), lastPartial);
+    float partialDetuneRange = mPartialDetuneRange / 7000000.0f;
+    
+    float mTime = mTimeStep * (float)age;
+    float mEnergy = voicesEnergy[slot * MAX_BLOCK_SIZE + sampleIndex];
+    
+    float mB = voiceInharmonicity(this->mB, mFrequency, mVelocity, mTime);
+    
+    float energyCurve = mEnergy*(mLinearTerm + mEnergy*(mSquaredTerm + mEnergy*(mCubicTerm)));
+    float transient = powf(0.5f, mTime*50.0f) * 20.0f * mEnergy * mEnergy * (1.0f + mEnergy);
+    float panSpeed = voicePanSpeed(mTime);
+    
+    for (int i = firstPartial; i < numPartials; i += 4) {
+        float valuesOne[4], valuesTwo[4], pans[4];
+        for (int k = 0; k < 4; k++) {
+            float rand = partialRands[i + k];
+            float eye = (float)(i + k) + 1.0f;
+            float freq = partialFrequency(eye, mFrequency, mB, mPitchBendCoarse, mPitchBendFine);
+            float amp = powf(energyCurve, powf(eye, mBrightnessA) + freq/mBrightnessB) * partialAmp(rand, partialDetuneRange);
+            valuesOne[k] = sinf(6.2831853f * mTime * freq * rand) * amp;
+            valuesTwo[k] = sinf(6.2831853f * mTime * freq * rand * randStringMult) * amp;
+            pans[k] = partialPan(rand, partialDetuneRange);
+        }
+        valuesOne[0] += fabsf(partialRands[i] - 1.0f) * transient;
+        
+        for (int k = 0; k < 4; k++) {
+            float pan = pans[k];
+            float string2Pan = pans[string2Pans[k]];
+            sampleL += valuesOne[k] * panLeft(pan, panSpeed);
+            sampleL += valuesTwo[k] * panLeft(string2Pan, panSpeed);
+            sampleR += valuesOne[k] * panRight(pan, panSpeed);
+            sampleR += valuesTwo[k] * panRight(string2Pan, panSpeed);
+        }
+    }
+}
+
+// the same partials by the angle-addition recurrence: sin((n+1)x) and cos((n+1)x) come from sin(nx), cos(nx) and sin(x), cos(x), so n times
+// the base phase (string 1's first partial without its random detune) costs a complex multiply per partial instead of a sinf. what each partial
+// is ahead of that - its detune, the inharmonicity, the fine pitch bend - moves slowly, so buildHarmonicSpan() works it out once every
+// HARMONIC_SPAN samples, with how it's moving, and here it's just a small rotation by polynomial. the amplitude goes the same way, from the
+// middle of the span. a partial that's too far off harmonic (or an energy that moves too fast) for HARMONIC_TAYLOR_LIMIT gets sinf / expf for
+// that part instead, so the path works for any patch - it's only near-harmonic ones that get it for free. host only: voice_partials on the
+// device has a work-item per sample, with nothing to share a span's corrections through short of a table built in a pass of its own, and
+// its native sin is a fraction of what sinf costs here
+void OpenCL::renderHarmonicPartials(int slot, int age, int sampleIndex, int firstPartial, int lastPartial, float& sampleL, float& sampleR) {
+    
+    const float *record = &voiceRecords[slot * NUM_VOICE_PARAMS];
+    float randStringMult = record[2];
+    const float *partialRands = &mCPUPartialTables[slot * MAX_PARTIALS];
+    
+    float mLinearTerm = instrumentData[0];
+    float mSquaredTerm = instrumentData[1];
+    float mCubicTerm = instrumentData[2];
+    
+    int numPartials = std::min(numVoicePartials(record[0]), lastPartial);
+    if (firstPartial >= numPartials) {
+        return;
+    }
+    float partialDetuneRange = mPartialDetuneRange / 7000000.0f;
+    
+    int anchor = age / HARMONIC_SPAN * HARMONIC_SPAN + HARMONIC_SPAN/2;
+    HarmonicSpan& span = mHarmonicSpans[firstPartial];
+    if (span.anchor != anchor) {
+        buildHarmonicSpan(slot, anchor, firstPartial, numPartials);
+    }
+    float offset = (float)(age - anchor);
+    
+    float mTime = mTimeStep * (float)age;
+    float mEnergy = voicesEnergy[slot * MAX_BLOCK_SIZE + sampleIndex];
+    float energyCurve = mEnergy*(mLinearTerm + mEnergy*(mSquaredTerm + mEnergy*(mCubicTerm)));
+    float logEnergy = logf(energyCurve);
+    float energyChange = logEnergy - span.logEnergy;
+    float transient = powf(0.5f, mTime*50.0f) * 20.0f * mEnergy * mEnergy * (1.0f + mEnergy);
+    float panSpeed = voicePanSpeed(mTime);
+    // partialPan's and partialAmp's scales, out of the loop - a rounding off them, which is well under this path's own error
+    float panScale = 214.0f / partialDetuneRange / 7000000.0f;
+    float ampScale = 75.0f / partialDetuneRange / 7000000.0f;
+    // (1-pan) - (0.5-pan)/panSpeed and (pan) - (pan-0.5)/panSpeed, multiplied out so there's no dividing per partial
+    float panFixedL = 1.0f - 0.5f / panSpeed;
+    float panFixedR = 0.5f / panSpeed;
+    float panSlope = 1.0f - 1.0f / panSpeed;
+    
+    // the base phase and where the recurrence starts, for each string
+    float phaseOne = span.phaseOne + span.step * offset;
+    float phaseTwo = span.phaseTwo + span.step * randStringMult * offset;
+    float startOne = span.startOne + span.step * (float)(firstPartial + 1) * offset;
+    float startTwo = span.startTwo + span.step * randStringMult * (float)(firstPartial + 1) * offset;
+    // four recurrences a base phase apart, each stepping 4 at a time - one for each partial of the 4s, and none of them waiting on another
+    float cosOne[4], sinOne[4], cosTwo[4], sinTwo[4];
+    cosOne[0] = cosf(startOne), sinOne[0] = sinf(startOne);
+    cosTwo[0] = cosf(startTwo), sinTwo[0] = sinf(startTwo);
+    float stepCosOne = cosf(phaseOne), stepSinOne = sinf(phaseOne);
+    float stepCosTwo = cosf(phaseTwo), stepSinTwo = sinf(phaseTwo);
+    for (int k = 1; k < 4; k++) {
+        cosOne[k] = cosOne[k-1] * stepCosOne - sinOne[k-1] * stepSinOne;
+        sinOne[k] = sinOne[k-1] * stepCosOne + cosOne[k-1] * stepSinOne;
+        cosTwo[k] = cosTwo[k-1] * stepCosTwo - sinTwo[k-1] * stepSinTwo;
+        sinTwo[k] = sinTwo[k-1] * stepCosTwo + cosTwo[k-1] * stepSinTwo;
+    }
+    float step4CosOne = cosf(4.0f * phaseOne), step4SinOne = sinf(4.0f * phaseOne);
+    float step4CosTwo = cosf(4.0f * phaseTwo), step4SinTwo = sinf(4.0f * phaseTwo);
+    
+    for (int i = firstPartial; i < numPartials; i += 4) {
+        float valuesOne[4], valuesTwo[4], pans[4];
+        for (int k = 0; k < 4; k++) {
+            const HarmonicPartial& partial = mHarmonicPartials[i + k];
+            float rand = partialRands[i + k];
+            
+            float turnOne = offset * (partial.drift + offset * partial.curve);
+            float turnTwo = turnOne * randStringMult;
+            float turnCosOne, turnSinOne, turnCosTwo, turnSinTwo;
+            if (fabsf(turnTwo) <= HARMONIC_TAYLOR_LIMIT && fabsf(turnOne) <= HARMONIC_TAYLOR_LIMIT) {
+                float squareOne = turnOne * turnOne;
+                float squareTwo = turnTwo * turnTwo;
+                turnCosOne = 1.0f - 0.5f * squareOne * (1.0f - squareOne * (1.0f/12.0f));
+                turnSinOne = turnOne * (1.0f - squareOne * (1.0f/6.0f) * (1.0f - squareOne * (1.0f/20.0f)));
+                turnCosTwo = 1.0f - 0.5f * squareTwo * (1.0f - squareTwo * (1.0f/12.0f));
+                turnSinTwo = turnTwo * (1.0f - squareTwo * (1.0f/6.0f) * (1.0f - squareTwo * (1.0f/20.0f)));
+            } else {
+                turnCosOne = cosf(turnOne), turnSinOne = sinf(turnOne);
+                turnCosTwo = cosf(turnTwo), turnSinTwo = sinf(turnTwo);
+            }
+            // sin(n * base + lead) = sin(n * base) cos(lead) + cos(n * base) sin(lead), with the lead turned on from the middle of the span
+            float leadCosOne = partial.cosOne * turnCosOne - partial.sinOne * turnSinOne;
+            float leadSinOne = partial.sinOne * turnCosOne + partial.cosOne * turnSinOne;
+            float leadCosTwo = partial.cosTwo * turnCosTwo - partial.sinTwo * turnSinTwo;
+            float leadSinTwo = partial.sinTwo * turnCosTwo + partial.cosTwo * turnSinTwo;
             
-//            // add in bandlimited noise
-//            blockOfSamples[i/2] += mFilterL.process(0.01f * (static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/2.0f)) - 1.0f));
-//            blockOfSamples[i/2+1] += mFilterR.process(0.01f * (static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/2.0f)) - 1.0f));
-//            if (isnan(blockOfSamples[i])) {
-//                blockOfSamples[i] = 0.0;
-//            }
-            //std::cout << "\nSample " << i/2 << " = " << blockOfSamples[i];
+            float change = partial.exponent * energyChange;
+            float amp;
+            if (fabsf(change) <= HARMONIC_TAYLOR_LIMIT) {
+                amp = partial.amp * (1.0f + change * (1.0f + change * 0.5f * (1.0f + change * (1.0f/3.0f) * (1.0f + change * 0.25f))));
+            } else {
+                amp = expf(logEnergy * partial.exponent) * ((1.0f-rand)*ampScale+0.7f);
+            }
+            valuesOne[k] = (sinOne[k] * leadCosOne + cosOne[k] * leadSinOne) * amp;
+            valuesTwo[k] = (sinTwo[k] * leadCosTwo + cosTwo[k] * leadSinTwo) * amp;
+            pans[k] = fabsf(rand - 1.0f) * panScale;
+            
+            // on to this lane's next partial, 4 up
+            float nextCos = cosOne[k] * step4CosOne - sinOne[k] * step4SinOne;
+            sinOne[k] = sinOne[k] * step4CosOne + cosOne[k] * step4SinOne;
+            cosOne[k] = nextCos;
+            nextCos = cosTwo[k] * step4CosTwo - sinTwo[k] * step4SinTwo;
+            sinTwo[k] = sinTwo[k] * step4CosTwo + cosTwo[k] * step4SinTwo;
+            cosTwo[k] = nextCos;
         }
-        
-        
-    } catch(Error error) {
-        std::cout << error.what() << "(" << error.err() << ")" << std::endl;
-//        cl::STRING_CLASS buildlog;
-//        buildlog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(devices[0]);
-//        std::cout << "\n\n\n" << buildlog.c_str() << "\n\n\n";
+        valuesOne[0] += fabsf(partialRands[i] - 1.0f) * transient;
+        
+        for (int k = 0; k < 4; k++) {
+            float pan = pans[k];
+            float string2Pan = pans[string2Pans[k]];
+            sampleL += valuesOne[k] * (panFixedL - pan * panSlope);
+            sampleL += valuesTwo[k] * (panFixedL - string2Pan * panSlope);
+            sampleR += valuesOne[k] * (panFixedR + pan * panSlope);
+            sampleR += valuesTwo[k] * (panFixedR + string2Pan * panSlope);
+        }
+    }
+}
+
+// the span of a voice's age around anchor, for partials firstPartial..lastPartial-1 (in 4s, like the renderers). done in double - the phases
+// are in cycles since the onset, and what's wanted is the little that's left after taking n times the base off them. the lead's drift and
+// curve come from the middle and both ends of the span
+void OpenCL::buildHarmonicSpan(int slot, int anchor, int firstPartial, int lastPartial) {
+    
+    const float *record = &voiceRecords[slot * NUM_VOICE_PARAMS];
+    double mFrequency = record[0];
+    double mVelocity = record[1];
+    double randStringMult = record[2];
+    const float *partialRands = &mCPUPartialTables[slot * MAX_PARTIALS];
+    
+    float mLinearTerm = instrumentData[0];
+    float mSquaredTerm = instrumentData[1];
+    float mCubicTerm = instrumentData[2];
+    float mBrightnessA = 1.0f - instrumentData[3];
+    float mBrightnessB = 10000.0f * instrumentData[4];
+    double mPitchBendCoarse = 2.0f * instrumentData[5];
+    double mPitchBendFine = 0.02f * instrumentData[6];
+    float partialDetuneRange = mPartialDetuneRange / 7000000.0f;
+    
+    double halfSpan = HARMONIC_SPAN/2;
+    double times[3] = {mTimeStep * (anchor - halfSpan), mTimeStep * (double)anchor, mTimeStep * (anchor + halfSpan)};
+    double mBs[3];
+    for (int j = 0; j < 3; j++) {
+        mBs[j] = mB * (0.1 + mFrequency/10000.0) * (0.1 + mFrequency*mFrequency/50000000.0);
+        mBs[j] *= 1.01 / (1.01 - (mVelocity/(1.0+times[j]*10.0)) / 5.0);
+    }
+    double base = (mPitchBendCoarse + mPitchBendFine) * mFrequency * sqrt(1.0 + mBs[1]); // Hz
+    double baseCycles = times[1] * base;
+    
+    HarmonicSpan& span = mHarmonicSpans[firstPartial];
+    span.anchor = anchor;
+    span.phaseOne = (float)(2.0 * M_PI * (baseCycles - floor(baseCycles)));
+    span.phaseTwo = (float)(2.0 * M_PI * (baseCycles * randStringMult - floor(baseCycles * randStringMult)));
+    double startCycles = baseCycles * (firstPartial + 1);
+    span.startOne = (float)(2.0 * M_PI * (startCycles - floor(startCycles)));
+    span.startTwo = (float)(2.0 * M_PI * (startCycles * randStringMult - floor(startCycles * randStringMult)));
+    span.step = (float)(2.0 * M_PI * base * mTimeStep);
+    
+    int anchorIndex = std::min(std::max(anchor - (int)(mSampleClock - voiceOnsets[slot]), 0), mBatchFrames - 1);
+    float mEnergy = voicesEnergy[slot * MAX_BLOCK_SIZE + anchorIndex];
+    span.logEnergy = logf(mEnergy*(mLinearTerm + mEnergy*(mSquaredTerm + mEnergy*(mCubicTerm))));
+    
+    for (int i = firstPartial; i < lastPartial; i += 4) {
+        for (int k = 0; k < 4; k++) {
+            HarmonicPartial& partial = mHarmonicPartials[i + k];
+            float rand = partialRands[i + k];
+            double eye = i + k + 1;
+            double leads[3]; // cycles string 1 is ahead of eye times the base
+            for (int j = 0; j < 3; j++) {
+                double freq = (mPitchBendCoarse + mPitchBendFine * pow(eye, 0.3)) * eye * mFrequency * sqrt(1.0 + mBs[j] * eye * eye);
+                leads[j] = times[j] * (freq * rand - eye * base);
+                if (j == 1) {
+                    partial.exponent = powf((float)eye, mBrightnessA) + (float)freq/mBrightnessB;
+                }
+            }
+            double leadTwo = leads[1] * randStringMult;
+            partial.cosOne = (float)cos(2.0 * M_PI * (leads[1] - floor(leads[1])));
+            partial.sinOne = (float)sin(2.0 * M_PI * (leads[1] - floor(leads[1])));
+            partial.cosTwo = (float)cos(2.0 * M_PI * (leadTwo - floor(leadTwo)));
+            partial.sinTwo = (float)sin(2.0 * M_PI * (leadTwo - floor(leadTwo)));
+            partial.drift = (float)(2.0 * M_PI * (leads[2] - leads[0]) / (2.0 * halfSpan));
+            partial.curve = (float)(2.0 * M_PI * (leads[2] + leads[0] - 2.0 * leads[1]) / (2.0 * halfSpan * halfSpan));
+            partial.amp = expf(span.logEnergy * partial.exponent) * partialAmp(rand, partialDetuneRange);
+        }
+    }
+}
+
+// the input for the next block may already be partly in when the batch goes off (the caller needed its output before the block was complete).
+// its energy sits right behind the batch in the rows, and the rows start over at the next batch
+void OpenCL::holdCarriedEnergy(int carryFrames) {
+    for (int slot = 0; slot < MAX_VOICES && carryFrames > 0; slot++) {
+        std::copy(&voicesEnergy[slot * MAX_BLOCK_SIZE + mBatchFrames], &voicesEnergy[slot * MAX_BLOCK_SIZE + mBatchFrames + carryFrames], &mCarriedEnergy[slot * MAX_BLOCK_SIZE]);
+        std::copy(&voicesForce[slot * MAX_BLOCK_SIZE + mBatchFrames], &voicesForce[slot * MAX_BLOCK_SIZE + mBatchFrames + carryFrames], &mCarriedForce[slot * MAX_BLOCK_SIZE]);
+    }
+}
+
+void OpenCL::restoreCarriedEnergy(int carryFrames) {
+    for (int slot = 0; slot < MAX_VOICES && carryFrames > 0; slot++) {
+        std::copy(&mCarriedEnergy[slot * MAX_BLOCK_SIZE], &mCarriedEnergy[slot * MAX_BLOCK_SIZE + carryFrames], &voicesEnergy[slot * MAX_BLOCK_SIZE]);
+        std::copy(&mCarriedForce[slot * MAX_BLOCK_SIZE], &mCarriedForce[slot * MAX_BLOCK_SIZE + carryFrames], &voicesForce[slot * MAX_BLOCK_SIZE]);
+    }
+}
+
+// keeps a running least-squares fit of GPU render time against voices * frames * partials (exponentially forgetting old batches), which splits
+// the measured time into a fixed launch + driver cost per dispatch and a cost per partial-sample - that's what lets us predict other block
+// sizes, and other splits between the GPU and the CPU. the GPU time is the device's own, from the profiled events (mGPURenderTime): the wall
+// clock would count the CPU voices and the wait for the rest of the round too. the CPU side has no fixed cost worth fitting, just a running
+// average per partial-sample
+void OpenCL::updateRenderCostModel(double renderTime) {
+    mLastRenderTime = renderTime;
+    double forget = 0.05;
+    int cpuVoices = NUM_ACTIVE_VOICES - mNumGPUVoices - mNumIFFTVoices;
+    if (mNumIFFTVoices > 0) {
+        double ifftVoiceSampleTime = mIFFTRenderTime / ((double)mNumIFFTVoices * mBatchFrames);
+        mIFFTVoiceSampleTime = mIFFTVoiceSampleTime > 0.0 ? mIFFTVoiceSampleTime + (ifftVoiceSampleTime - mIFFTVoiceSampleTime) * forget : ifftVoiceSampleTime;
     }
-}
\ No newline at end of file
+    if (cpuVoices > 0) {
+        double cpuPartialSampleTime = mCPURenderTime / ((double)cpuVoices * mBatchFrames * NUM_PARTIALS);
+        mCPUPartialSampleTime = mCPUPartialSampleTime > 0.0 ? mCPUPartialSampleTime + (cpuPartialSampleTime - mCPUPartialSampleTime) * forget : cpuPartialSampleTime;
+    }
+    if (mNumGPUVoices == 0 || mGPURenderTime <= 0.0) {
+        return;
+    }
+    double x = (double)(mNumGPUVoices - mNumWavetableVoices) * mBatchFrames * NUM_PARTIALS; // what the wavetable voices cost goes in with the launch
+    mFitX += (x - mFitX) * forget;
+    mFitT += (mGPURenderTime - mFitT) * forget;
+    mFitXX += (x * x - mFitXX) * forget;
+    mFitXT += (x * mGPURenderTime - mFitXT) * forget;
+    double variance = mFitXX - mFitX * mFitX;
+    if (variance > 1.0) { // only refit the slope once the block size or voice count has actually varied
+        mPartialSampleTime = std::max(0.0, (mFitXT - mFitX * mFitT) / variance);
+    }
+    mLaunchTime = std::max(0.0, mFitT - mPartialSampleTime * mFitX);
+}
+
+void OpenCL::setMaxBlockSize(int maxBlockSize) {
+    mMaxBlockSize = MIN_BLOCK_SIZE;
+    while (mMaxBlockSize * 2 <= maxBlockSize && mMaxBlockSize * 2 <= MAX_BLOCK_SIZE) {
+        mMaxBlockSize *= 2;
+    }
+    if (mBlockSize > mMaxBlockSize) {
+        mBlockSize = mMaxBlockSize;
+    }
+}
+
+// picks the size of the next block. the worst host callback has to render max(1, hostFrames/blockSize) blocks before its deadline
+// (hostFrames worth of time), so small blocks pay the launch cost over and over, and big blocks land in one callback all at once.
+// we use the smallest block that keeps the predicted load under half the deadline (finest event/modulation grid while the GPU has
+// headroom), or failing that whichever block size has the lowest predicted load (amortizing launch overhead when it doesn't). the
+// prediction is for the best CPU/GPU split at each size - small blocks of a few voices are cheap on the CPU, launch cost and all.
+// with batching that's the worst case - blocks only go out one per dispatch when every one of them has MIDI or a knob change in it.
+// called between blocks only, right after a render, so the measurement is fresh
+void OpenCL::updateBlockSize(int hostFrames) {
+    mBlocksSinceBlockSizeChange++;
+    if (NUM_ACTIVE_VOICES == 0 || mBlocksSinceBlockSizeChange < 16) { // nothing was measured, or give the fit time to settle after a change
+        return;
+    }
+    double deadline = hostFrames * mTimeStep;
+    double targetLoad = 0.5;
+    int bestBlockSize = mBlockSize;
+    double bestLoad = -1.0;
+    for (int blockSize = MIN_BLOCK_SIZE; blockSize <= mMaxBlockSize; blockSize *= 2) {
+        double rendersPerCallback = std::max(1.0, (double)hostFrames / blockSize);
+        double load = rendersPerCallback * predictRenderTime(NUM_ACTIVE_VOICES, blockSize) / deadline;
+        if (load <= targetLoad) {
+            bestBlockSize = blockSize;
+            break;
+        }
+        if (bestLoad < 0.0 || load < bestLoad) {
+            bestLoad = load;
+            bestBlockSize = blockSize;
+        }
+    }
+    if (bestBlockSize != mBlockSize) {
+        mBlockSize = bestBlockSize;
+        mBlocksSinceBlockSizeChange = 0;
+    }
+}
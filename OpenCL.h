@@ -14,36 +14,221 @@
 #define __CL_ENABLE_EXCEPTIONS
 
 #include <math.h>
-#include <boost/array.hpp>
 #include <queue>
 #include <utility>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
 //#include <boost/circular_buffer.hpp>
 #include <OpenCL/cl.hpp>
+#include "IFFTRenderer.h"
 using namespace cl;
 
-#define BLOCK_SIZE 256
+#define MIN_BLOCK_SIZE 64 // smallest internal block size the engine adapts down to
+#define MAX_BLOCK_SIZE 1024 // largest internal block size - host-side arrays are sized for this
+#define DEFAULT_MAX_BLOCK_SIZE 256 // default upper bound for the adaptive block size (the Max Block Size knob), which is also the engine latency
 #define NUM_CHANNELS 2
-#define MAX_VOICES 16
-#define NUM_VOICE_PARAMS 5 // num params per voice - mTime, mFrequency, mVelocity, randStringMult, randomSeed
+#define MAX_VOICES 32 // voice slots per instance (bitmasks of them have to fit an unsigned int) - how many of them get used depends on the number of GPUs
+#define VOICES_PER_DEVICE 16 // polyphony each GPU adds
+#define NUM_VOICE_PARAMS 4 // num params in each voice slot's record on the device - mFrequency, mVelocity, randStringMult, randomSeed (also passed to the kernels as a -D build option)
+#define MAX_PARTIALS 512 // size of each voice slot's partial table - the most partials the Partials knob goes up to (also a -D build option)
 //#define numAuxiliaryParams 4
+#define IFFT_PARTIALS 128 // voices with more partials than this get rendered on the CPU by inverse FFT (IFFTRenderer) instead - -1 = never
+#define IFFT_ONSET_TIME 0.0116f // ...once they're this old, in seconds (512 samples at 44.1k). the energy moves too fast during the hammer strike for frames IFFT_HOP apart
+#define HARMONIC_SPAN 32 // samples of a voice's age that share one set of corrections on the CPU's near-harmonic path (see OpenCL::renderHarmonicPartials) - 0 = always the direct one. the GPU always is
+#define HARMONIC_TAYLOR_LIMIT 0.25f // most a partial's correction can move (radians, or log amplitude) and still go by polynomial - past that it gets sinf / expf
+#define WAVETABLE_PARTIALS 16 // voices with at least this many partials play from baked wavetables on the GPU instead, while the patch keeps them harmonic (see OpenCL::routeVoices) - -1 = never
+#define WAVETABLE_MAX_DETUNE 0.0006f // most any partial can be off n times the fundamental (relative - about a cent, detune, inharmonicity and fine pitch bend together) for a voice to count as harmonic
+#define WAVETABLE_ONSET_TIME 0.0116f // ...once they're this old, in seconds - the hammer strike stays additive
+#define WAVETABLE_LENGTH 4096 // samples in one period of the biggest layer - the layers' stride in the cache
+#define WAVETABLE_OVERSAMPLING 16 // table samples per period of a layer's highest partial, at least (it's played back by linear interpolation)
+#define WAVETABLE_MAX_PARTIALS (WAVETABLE_LENGTH/WAVETABLE_OVERSAMPLING) // so voices with more partials than this stay additive
+#define WAVETABLE_LAYERS 24 // energy layers per voice, from the top of its energy curve down WAVETABLE_DEPTH
+#define WAVETABLE_DEPTH 12.0f // log energy curve the layers span - below that the bottom one just gets turned down
+#define WAVETABLE_LAYER_STEP 0.5f // log amplitude the brightest partial moves by between the top two layers (the ones further down are further apart)
+#define WAVETABLE_FLOOR -12.0f // log amplitude under the layer's loudest partial that a partial has to be over to get baked into it (the mip levels)
+#ifndef MODAL_RESONATORS
+#define MODAL_RESONATORS 0 // 1 = the modal engine: every partial of every voice is a damped resonator that keeps ringing on the device from batch to batch, excited by the hammer (see modal_resonators in opencl_kernels.cl). GPU voices only - an instance without a GPU stays additive. also a -D build option: with 0 the kernel and its buffers aren't built at all
+#endif
+#define MODAL_GROUP_SIZE 128 // work-items per voice in the modal engine, each one taking every MODAL_GROUP_SIZE-th partial (the device has to allow work-groups this big)
+#define MODAL_CHUNK 16 // samples the modal engine's work-items run their resonators for before they add them up (divides MIN_BLOCK_SIZE)
+#ifndef CPU_VOICES
+#define CPU_VOICES -1 // -1 = route each batch's voices between the CPU and the GPU(s) by the cost model, 0 = always the GPU, 1 = always the CPU
+#endif
+#define AUDIBLE_CEILING 20000.0f // Hz - partials above this don't get rendered, whatever the sample rate (nor above Nyquist, at rates under 40k)
+#define MULTIRATE_BANDS 2 // a voice's lowest partials get rendered at fs/2, fs/4, ... (one band per halving, at least 1) and upsampled back to the full rate
+#define MULTIRATE_GUARD 0.6f // a band only takes partials under this fraction of its own Nyquist - the rest is the interpolator's transition band. 0 = every partial at the full rate
+#define INTERPOLATOR_TAPS 16 // low-rate samples that go into each upsampled one (even)
+#define MAX_DECIMATION (2 << (MULTIRATE_BANDS - 1))
+#define INTERPOLATOR_SIZE (MULTIRATE_BANDS * MAX_DECIMATION * INTERPOLATOR_TAPS) // a set of INTERPOLATOR_TAPS coefficients for each phase of each band
+#define BAND_ROW_LENGTH (MAX_BLOCK_SIZE/2 + INTERPOLATOR_TAPS + 1) // most low-rate samples a band renders for a batch (frames / 2, plus the lead-in and run-on)
 #define NUM_INSTRUMENT_PARAMS 7 // linear term, squared term, cubic term, brightness A, brightness B, pitch bend (coarse), pitch bend (fine)
 
+// everything that's per plugin instance in a dispatch - keep in sync with RenderGroup in opencl_kernels.cl
+struct RenderGroup {
+    float modPrevious;
+    float modCurrent;
+    float mB;
+    float partialDetuneRange;
+    float timeStep;
+    float partialCeiling;
+    cl_uint blockStartSample;
+    cl_int numPartials;
+    cl_int frames;
+    cl_int firstVoice;
+    cl_int numVoices;
+    cl_int outputOffset;
+    float instrumentData[NUM_INSTRUMENT_PARAMS];
+};
+
+// one voice's wavetables in a device's cache: WAVETABLE_LAYERS one-period tables, each the voice's partials at one level of the energy curve. the
+// layers go down in log energy curve from topLogEnergy, firstStep apart at the top and ratio times further apart each layer down - keep in sync
+// with WavetableInfo in opencl_kernels.cl
+struct WavetableInfo {
+    float topLogEnergy;
+    float firstStep;
+    float ratio;
+    float bottomExponent; // the fundamental's energy curve exponent - how the bottom layer gets turned down below its level
+    float transientMono, transientPan; // the transient's weight (|rand - 1| of every 4th partial, summed), and pan-weighted
+    cl_int lengths[WAVETABLE_LAYERS]; // samples in each layer's period (a power of 2)
+    cl_int partials[WAVETABLE_LAYERS]; // partials baked into it
+};
+
+// what the modal engine needs for one voice's batch on top of what the additive one does (OpenCL::updateModes) - keep in sync with ModalVoice
+// in opencl_kernels.cl. partial n rings at exponent n times the per-sample rates here, where exponent n is its energy curve exponent (the
+// brightness), the same way its amplitude goes as the energy curve to that power in the additive engine
+struct ModalVoice {
+    float logDecay; // log of how much the energy curve shrinks per sample (<= 0)
+    float strikeLogEnergy; // log of the energy curve the last strike takes the string up to - the level its spectrum is shaped at
+    float strikeScale; // what the hammer's energy gets multiplied by to come out at that level (1 / the energy it brings)
+    float resetLogEnergy; // log of what a strike this batch leaves of the energy curve of the string's motion, before the hammer gets going
+    cl_int resetSample; // the sample it's at, -1 = none this batch
+    cl_int clearModes; // ...and it's a new note, so nothing's left of the last one
+};
+
+// one partial of the span the CPU's near-harmonic path is in (OpenCL::buildHarmonicSpan) - what's left of it once the recurrence has done n times
+// the base phase
+struct HarmonicPartial {
+    float cosOne, sinOne; // how far string 1 is ahead of the recurrence, at the middle of the span
+    float cosTwo, sinTwo; // string 2 - randStringMult times as far
+    float drift, curve; // how string 1's lead moves away from that, per sample and per sample squared
+    float exponent; // of the energy curve, for the amplitude
+    float amp; // at the middle of the span, with the random partial amplitude in
+};
+
+// the rest of the span, for one range of partials (they're kept by the range's first partial)
+struct HarmonicSpan {
+    int anchor; // age at the middle of the span, -1 = not built for this voice yet
+    float phaseOne, phaseTwo; // each string's base phase there (radians, wrapped)
+    float startOne, startTwo; // ... times the range's first partial number (wrapped) - where the recurrence starts
+    float step; // string 1's base phase per sample
+    float logEnergy; // log of the energy curve there
+};
+
+/// the voice math every renderer shares - the same expressions, in the same order, as the helpers at the top of opencl_kernels.cl, so a voice
+/// sounds the same whichever side renders it
+
+static const int string2Pans[4] = {2, 0, 3, 1}; // string 2 takes the pans of the partials in each 4 in this order (string 1's, shuffled)
+
+// the voice's inharmonicity coefficient mTime into the note: the knob's, made to sound about as strong across the octaves (it gets much bigger
+// up high), and stronger while the string is still deformed from a hard strike - that wears off fast
+inline float voiceInharmonicity(float mB, float mFrequency, float mVelocity, float mTime) {
+    mB *= 0.1f + mFrequency/10000.0f;
+    mB *= 0.1f + mFrequency*mFrequency/50000000.0f;
+    mB *= 1.01f / (1.01f - (mVelocity/(1.0f+mTime*10.0f)) / 5.0f);
+    return mB;
+}
+
+// partial eye's frequency (eye = 1 for the fundamental), before its random detune
+inline float partialFrequency(float eye, float mFrequency, float mB, float mPitchBendCoarse, float mPitchBendFine) {
+    return (mPitchBendCoarse + mPitchBendFine * powf(eye, 0.3f)) * eye * mFrequency * sqrtf(1.0f + mB * eye * eye);
+}
+
+// a partial's random amplitude and pan position (0..1), from its partial table entry rand - both undo the detune range the table was built
+// with (partialDetuneRange is the knob's / 7000000, the way the table has it)
+inline float partialAmp(float rand, float partialDetuneRange) {
+    return (1.0f-rand)*(75.0f/partialDetuneRange/7000000.0f)+0.7f;
+}
+inline float partialPan(float rand, float partialDetuneRange) {
+    return fabsf(rand - 1.0f) * 214.0f / partialDetuneRange / 7000000.0f;
+}
 
+// the pans start out in the middle and wash out to each partial's own, panSpeed times closer to it mTime into the note
+inline float voicePanSpeed(float mTime) {
+    return 5.0f * mTime + 1.0f;
+}
+inline float panLeft(float pan, float panSpeed) {
+    return (1.0f-pan) - (0.5f - pan)/panSpeed;
+}
+inline float panRight(float pan, float panSpeed) {
+    return (pan) - (pan - 0.5f)/panSpeed;
+}
+
+class GPUService;
+
+/// one plugin instance's side of the engine: its voices' state, energy rows and block size model, all host-side. the device itself - context,
+/// program, buffers - belongs to the process-wide GPUService, which renders every instance's batches (several at once when they line up)
 class OpenCL {
 public:
     friend class VoiceManager;
+    friend class GPUService;
     OpenCL() :
+    mMixPeak(0.0f),
+    mService(NULL),
+    mSlotBase(-1),
+    mMaxVoices(VOICES_PER_DEVICE),
+    mSampleClock(0),
+    mDirtySlots(0),
+    mStaleTableSlots(0),
+    mNumGPUVoices(0),
+    mNumIFFTVoices(0),
+    mIFFTOnsetSamples((int)(IFFT_ONSET_TIME * 44100.0f)),
+    mNumWavetableVoices(0),
+    mWavetableOnsetSamples((int)(WAVETABLE_ONSET_TIME * 44100.0f)),
+    mWavetableGeneration(0),
+    NUM_PARTIALS(140),
     mTime(0.0f),
+    mTimeStep(1.0f/44100),
+    mPartialCeiling(AUDIBLE_CEILING),
+    mBlockSize(DEFAULT_MAX_BLOCK_SIZE),
+    mMaxBlockSize(DEFAULT_MAX_BLOCK_SIZE),
+    mBlocksSinceBlockSizeChange(0),
+    mBatchFrames(0),
+    mLastRenderTime(0.0),
+    mGPURenderTime(0.0),
+    mFitX(0.0),
+    mFitT(0.0),
+    mFitXX(0.0),
+    mFitXT(0.0),
+    mLaunchTime(0.0),
+    mPartialSampleTime(0.0),
+    mCPUPartialSampleTime(0.0),
+    mCPURenderTime(0.0),
+    mIFFTVoiceSampleTime(0.0),
+    mIFFTRenderTime(0.0),
     sampleRate(44100.0f),
-    NUM_PARTIALS(140),
     mStringDetuneRange(0.001f),
-    mDamping(2.5f),
-    mTimeStep(1.0f/44100)
+    mDamping(2.5f)
 //    instrumentData[0.3, 1.0f, 0.3f]
     {
+        for (int i = 0; i < NUM_INSTRUMENT_PARAMS; i++) {
+            instrumentData[i] = 0.0f;
+        }
+        for (int i = 0; i < MAX_VOICES; i++) {
+            activeSlots[i] = -1;
+            mCPUTableSeeds[i] = -1.0f;
+            mVoiceModes[i].logDecay = 0.0f;
+            mVoiceModes[i].strikeLogEnergy = 0.0f;
+            mVoiceModes[i].strikeScale = 0.0f;
+            mVoiceModes[i].resetLogEnergy = 0.0f;
+            mVoiceModes[i].resetSample = -1;
+            mVoiceModes[i].clearModes = 0;
+            mStrikeClocks[i] = mSampleClock - 1; // long gone
+        }
+        std::fill(mVoiceBandEnds, mVoiceBandEnds + MAX_VOICES*MULTIRATE_BANDS, 0);
         
         /// init variables
         
@@ -113,41 +298,142 @@ public:
     
         
     };
+    ~OpenCL();
     void initOpenCL();
-    inline boost::array<double, BLOCK_SIZE*NUM_CHANNELS> getBlockOfSamples() {
-        calculateSamples();
-        mTime += mTimeStep * BLOCK_SIZE;
-        return blockOfSamples;
+    void setSampleRate(double rate);
+    static void buildInterpolator(float *coefficients);
+    /// batches: the engine gathers the input for several blocks before it renders any of them - their energy rows sit one after the other,
+    /// and they all go to the device in a single dispatch, as if they were one long block. up to MAX_BLOCK_SIZE frames in a batch
+    inline void queueBlock() { mBatchFrames += mBlockSize; } // the block being gathered is complete - it joins the batch
+    inline int getBatchFrames() { return mBatchFrames; }
+    // renders the batch (mBatchFrames frames) straight into the caller's planar buffers (outputs[channel][frame]), already clipped - on the
+    // GPU(s), the CPU or both, whichever the cost model says is quickest
+    inline void renderBatch(double** outputs) {
+        calculateSamples(outputs);
+        skipBatch();
     }
-    float voicesEnergy[MAX_VOICES*BLOCK_SIZE];
+    // moves the sample clock on past the batch without rendering it (no voices playing)
+    inline void skipBatch() {
+        mTime += mTimeStep * mBatchFrames;
+        mSampleClock += mBatchFrames;
+        mBatchFrames = 0;
+    }
+    void holdCarriedEnergy(int carryFrames);
+    void restoreCarriedEnergy(int carryFrames);
+    inline int getMaxVoices() { return mMaxVoices; }
+    inline int getBlockSize() { return mBlockSize; }
+    inline int getMaxBlockSize() { return mMaxBlockSize; }
+    void setMaxBlockSize(int maxBlockSize);
+    void updateBlockSize(int hostFrames);
+    inline bool usesGPU() { return mSlotBase >= 0 && CPU_VOICES <= 0; } // got a place on the device, and may send voices there
+    float voicesEnergy[MAX_VOICES*MAX_BLOCK_SIZE]; // one row of MAX_BLOCK_SIZE energy values per voice slot (index into VoiceManager's voices[]), the batch first, then the block being gathered
+    float voicesForce[MAX_VOICES*MAX_BLOCK_SIZE]; // alongside the energy rows: how much energy the hammer put in at each sample (the modal engine's excitation)
+    float voicesPeak[MAX_VOICES]; // peak output level of each active voice in the last block, in the same order as activeSlots
+    float mMixPeak; // peak output level of the last block, all voices summed
 
 private:
     //void runOpenCL();
     //float *samples[128];
-    boost::array<double, BLOCK_SIZE*NUM_CHANNELS> blockOfSamples;
-    void calculateSamples();
+    void calculateSamples(double** outputs);
+    float mCarriedEnergy[MAX_VOICES*MAX_BLOCK_SIZE]; // the part of the block being gathered that was already in the energy rows when the batch went off
+    float mCarriedForce[MAX_VOICES*MAX_BLOCK_SIZE]; // ...and in the force rows
+    GPUService *mService;
+    int mSlotBase; // this instance's first slot in the service's shared buffers (-1 if it didn't get any - it renders on the CPU)
+    int mMaxVoices; // polyphony - VOICES_PER_DEVICE for each GPU the voices get split across, up to MAX_VOICES
+    
+    /// device-resident voice state: every voice keeps the same slot (mSlotBase + its index in VoiceManager's voices[]) on the device for as long as it plays - its record,
+    /// onset and partial table only get uploaded / rebuilt when VoiceManager marks the slot (note-on, steal, restrike), not every block
+    unsigned int mSampleClock; // engine sample clock at the start of the batch - wraps around, the kernel only ever looks at differences
+    float voiceRecords[MAX_VOICES*NUM_VOICE_PARAMS]; // host copy of each slot's record
+    unsigned int voiceOnsets[MAX_VOICES]; // value of mSampleClock at each slot's note onset
+    int activeSlots[MAX_VOICES]; // slots of the voices rendered this batch, in voicesPeak order
+    unsigned int mDirtySlots; // bit per slot whose record / onset changed since the last upload
+    unsigned int mStaleTableSlots; // bit per slot whose partial table needs rebuilding
+    inline void markSlotDirty(int slot, bool newNote) {
+        mDirtySlots |= 1u << slot;
+        if (newNote) {
+            mStaleTableSlots |= 1u << slot;
+        }
+    }
+    void updateRenderCostModel(double renderTime);
     
-    vector<Platform> platforms;
-    Context context;
-    vector<Device> devices;
-    CommandQueue queue;
-    Program program;
-    Kernel oscillatorKernel;
-    Kernel addVoicesKernel;
+    /// hybrid dispatch: a launch costs the same whether it renders one voice or thirty, so a light batch is quicker on the CPU, and a heavy one
+    /// on the GPU. each batch, the first mNumGPUVoices active voices go to the GPU and the rest get rendered on the host - while the GPU works
+    /// on its share, if there is one. the split comes from the cost model: the slowest of the two sides, predicted, is as short as it gets
+    int mNumGPUVoices;
+    double predictRenderTime(int voices, int frames, int *cpuVoices = NULL);
+    void routeVoices();
+    void renderCPUVoices(); // on the instance's own thread - by GPUService::render() while the round is on the device, or by calculateSamples() if there's no GPU share
+    float renderCPUVoice(int slot, float *mix);
+    void buildCPUPartialTable(int slot);
+    float mCPUMix[NUM_CHANNELS*MAX_BLOCK_SIZE]; // the CPU voices summed, planar, MAX_BLOCK_SIZE per channel
+    float mCPUBandSamples[MULTIRATE_BANDS*BAND_ROW_LENGTH*NUM_CHANNELS]; // the voice being rendered's bands, interleaved like bandSampleBuffer on the device
+    float mCPUPartialTables[MAX_VOICES*MAX_PARTIALS]; // host copies of the partial tables, built from the same seeds as on the device
+    float mCPUTableSeeds[MAX_VOICES]; // seed and detune range each table was built with - it gets rebuilt when they change
+    float mCPUTableDetuneRanges[MAX_VOICES];
+    
+    /// voices with more than IFFT_PARTIALS partials go to the IFFT engine instead, which costs about the same per frame however many partials
+    /// there are. they're the lowest notes, so they start out at the front of activeSlots - routeVoices() moves them to the very end, behind
+    /// the CPU's share of the rest (once they're past the hammer strike, IFFT_ONSET_TIME)
+    int mNumIFFTVoices;
+    int mIFFTOnsetSamples; // IFFT_ONSET_TIME at the current sample rate
+    float renderIFFTVoice(int slot, float *mix);
+    IFFTRenderer mIFFT;
+    float mIFFTSamples[NUM_CHANNELS*MAX_BLOCK_SIZE]; // the voice being rendered, planar
+    /// voices that sound the same from a one-period table - a patch with (next to) no detune or inharmonicity - get baked into wavetables on the
+    /// device and play back from them, a couple of table reads per sample however many partials they have (GPUService keeps the cache). they're
+    /// GPU voices, so routeVoices() puts them at the very front of activeSlots. the tables don't depend on the energy - that picks the layers
+    int mNumWavetableVoices;
+    int mWavetableOnsetSamples; // WAVETABLE_ONSET_TIME at the current sample rate
+    unsigned int mWavetableGeneration; // goes up whenever a knob baked into the tables changes (VoiceManager::applyParameterChanges) - they get baked again
+    bool isWavetableVoice(int slot);
+    bool buildWavetable(int slot, float topEnergy, WavetableInfo& info, float *spectrum);
+    /// the modal engine (MODAL_RESONATORS): the voices' partials are resonators on the device, their state kept there between batches, so
+    /// every voice goes to the GPU whatever the cost model says - no wavetables, IFFT or bands. the energy rows only shape the transient and
+    /// the decay now: the hammer's force rows (voicesForce) are what excites the partials
+    inline bool usesModalResonators() { return MODAL_RESONATORS && mSlotBase >= 0; }
+    void strikeModes(int slot, int sampleIndex, float energy, float remaining, float strikeEnergy, bool newNote);
+    void updateModes();
+    ModalVoice mVoiceModes[MAX_VOICES]; // each slot's, for the batch - the strike's level and scale stay put until the next strike
+    unsigned int mStrikeClocks[MAX_VOICES]; // value of mSampleClock (plus the sample) at each slot's last strike
+    inline int numVoicePartials(float frequency) { // partials the oscillator renders for a note - NUM_PARTIALS, or fewer if they'd go over the ceiling
+        return std::min((int)NUM_PARTIALS, (int)(mPartialCeiling / frequency));
+    }
     
     short NUM_PARTIALS; // max number of partials to calculate for each note
     short NUM_ACTIVE_VOICES;
     
     //short NUM_CHANNELS;
     
-    int GLOBAL_SIZE;
-    int MAX_WORK_GROUP_SIZE;
-    int WORK_GROUP_SIZE;
-    
     float mTime, mTimeStep;
+    float mPartialCeiling; // highest partial frequency worth rendering at the current sample rate - a note gets mPartialCeiling / frequency partials at most
+    
+    /// multirate: the partials of a voice that sit well under Nyquist get rendered at a fraction of the sample rate and upsampled, see
+    /// oscillator_bands in opencl_kernels.cl. both the GPU and the CPU go by the same band split and the same interpolator
+    void updateBands();
+    void renderCPUPartials(int slot, int age, int sampleIndex, int firstPartial, int lastPartial, float& sampleL, float& sampleR);
+    void renderHarmonicPartials(int slot, int age, int sampleIndex, int firstPartial, int lastPartial, float& sampleL, float& sampleR);
+    void buildHarmonicSpan(int slot, int anchor, int firstPartial, int lastPartial);
+    HarmonicPartial mHarmonicPartials[MAX_PARTIALS]; // the voice being rendered's
+    HarmonicSpan mHarmonicSpans[MAX_PARTIALS];
+    int mVoiceBandEnds[MAX_VOICES*MULTIRATE_BANDS]; // where each slot's bands end this batch, in partials - band b starts where band b+1 ends, the full-rate partials where band 0 does
+    float mInterpolator[INTERPOLATOR_SIZE];
+    
+    /// adaptive block size - the engine picks a size between MIN_BLOCK_SIZE and mMaxBlockSize from how long rendering actually takes
+    int mBlockSize; // size of the block currently being gathered/rendered
+    int mMaxBlockSize;
+    int mBlocksSinceBlockSizeChange;
+    int mBatchFrames; // frames in the complete blocks waiting to be rendered
+    double mLastRenderTime; // seconds the last calculateSamples() took, wall clock - the CPU voices, and waiting for the round to gather and come back
+    double mGPURenderTime; // device seconds the last batch's GPU share took, from the profiled events - its share of the round (see GPUService::dispatch). 0 if not measured
+    double mFitX, mFitT, mFitXX, mFitXT; // running averages for the least-squares fit of GPU render time = mLaunchTime + mPartialSampleTime * voices * frames * partials
+    double mLaunchTime, mPartialSampleTime;
+    double mCPUPartialSampleTime; // host render time per voice * frame * partial (0 until it's been measured)
+    double mCPURenderTime; // seconds the last renderCPUVoices() took, not counting the IFFT voices
+    double mIFFTVoiceSampleTime; // IFFT engine render time per voice * frame (0 until it's been measured)
+    double mIFFTRenderTime; // seconds the last batch's IFFT voices took
     float sampleRate;
-    float voicesData[MAX_VOICES*NUM_VOICE_PARAMS];
-    //float voicesDamping[MAX_VOICES*BLOCK_SIZE];
+    //float voicesDamping[MAX_VOICES*MAX_BLOCK_SIZE];
     float MIDIParams[3]; // sustain, expression, mod
     float mModPrevious, mModCurrent, mModSmoothed;
     std::queue<float> modBuffer;
@@ -159,9 +445,7 @@ private:
     float mDamping;
     
     float instrumentData[NUM_INSTRUMENT_PARAMS]; // linear term, squared term, cubic term
-    
-    Buffer voicesDataBuffer, voicesEnergyBuffer, instrumentDataBuffer, voicesSampleBuffer, outputSampleBuffer, ADSRBuffer;
-    NDRange globalSize, localSize, globalSizeAdder, localSizeAdder;
+
 };
 
 #endif /* defined(__Synthesis__OpenCL__) */
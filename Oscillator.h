@@ -48,13 +48,21 @@ public:
         mOscillatorMode(OSCILLATOR_MODE_SINE),
         mPI(2*acos(0.0)),
         twoPI(2 * mPI),
-        mTimeStep(1.0 / 44100.0),
-
+        mMaxFreq(20000.0), // eventually might want to limit this to human hearing for performance reasons - will be generating partials way above human hearing at 96k, 192k, etc. sample rates
+        mMaxPartials(500.0), // max number of partials possible (governs things like array length for storing slightly-inharmonic partial frequencies)
         mNumStringsPerNote(2),
+        mB(0.0001), // sample inharmonic coefficient for A2 piano string, default .00012, .0012 sounds super cool! .0002 is subtler
     
-        mStringDetuneRange(0.001), // .002 is good
+        mVelocity(0),
+        mPitchMod(0.0),
+        mFrequency(440.0),
+        mLastFrequency(220.0), // could be anything, just needs to be different than mFrequency for starters, or else comparison returns true on first note strike after program init (and we want it to return false)
         mStringRatio(1.0), // calculated dynamically based on mStringDetuneRange (value here doesn't matter)
-        mB(0.0001), // sample inharmonic coefficient for A2 piano string, default .00012, .0012 sounds super cool! .0002 is subtler
+        mPartialInharmonicityCoeff(1.0),
+        //mPartialInharmonicityCoeffs({ })
+        mPartialFrequency(0.0),
+        mTimeStep(1.0 / 44100.0),
+        mAmplitude(0.0),
     
         // for lorenz
         mLX(0.0),
@@ -70,8 +78,8 @@ public:
     
         // for tinkerbell map
         mTX(-0.72),
-        mTY(-0.64),
         mTXnew(0.0),
+        mTY(-0.64),
         mTYnew(0.0),
         mTa(0.9),
         mTb(-0.6013),
@@ -87,17 +95,8 @@ public:
         mStringHitLocation(0.166),
         mLocationBasedAmplitude(1.0),
     
-        mFrequency(440.0),
-        mLastFrequency(220.0), // could be anything, just needs to be different than mFrequency for starters, or else comparison returns true on first note strike after program init (and we want it to return false)
-        mVelocity(0),
-        mPitchMod(0.0),
         mNumPartials(30),
-        mMaxFreq(20000.0), // eventually might want to limit this to human hearing for performance reasons - will be generating partials way above human hearing at 96k, 192k, etc. sample rates
-        mMaxPartials(500.0), // max number of partials possible (governs things like array length for storing slightly-inharmonic partial frequencies)
-        //mPartialInharmonicityCoeffs({ })
-        mPartialFrequency(0.0),
-        mAmplitude(0.0),
-        mPartialInharmonicityCoeff(1.0)
+        mStringDetuneRange(0.001) // .002 is good
         {
             updateTime();
             updateInstrumentModel();
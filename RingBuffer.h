@@ -0,0 +1,152 @@
+//
+//  RingBuffer.h
+//  Synthesis
+//
+//  Lock-free single-producer / single-consumer ring buffer. One thread pushes, one other thread pops, and neither ever blocks or allocates -
+//  safe to use from the audio thread.
+//
+
+#ifndef __Synthesis__RingBuffer__
+#define __Synthesis__RingBuffer__
+
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+
+template <typename T, int Capacity>
+class RingBuffer {
+
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "RingBuffer capacity must be a power of two");
+
+public:
+    RingBuffer() :
+    mWriteCount(0),
+    mReadCount(0) {};
+
+    // number of items waiting to be read (consumer side)
+    inline int getReadSpace() const { return (int)(mWriteCount.load(std::memory_order_acquire) - mReadCount.load(std::memory_order_relaxed)); }
+    // number of free slots (producer side)
+    inline int getWriteSpace() const { return Capacity - (int)(mWriteCount.load(std::memory_order_relaxed) - mReadCount.load(std::memory_order_acquire)); }
+
+    // producer: copies in up to numItems items, returns how many actually fit
+    int write(const T* items, int numItems) {
+        unsigned int writeCount = mWriteCount.load(std::memory_order_relaxed);
+        int n = std::min(numItems, getWriteSpace());
+        for (int i = 0; i < n; i++) {
+            mItems[(writeCount + i) & (Capacity - 1)] = items[i];
+        }
+        mWriteCount.store(writeCount + n, std::memory_order_release);
+        return n;
+    }
+    inline bool push(const T& item) { return write(&item, 1) == 1; }
+
+    // consumer: copies out up to numItems items, returns how many there were
+    int read(T* items, int numItems) {
+        unsigned int readCount = mReadCount.load(std::memory_order_relaxed);
+        int n = std::min(numItems, getReadSpace());
+        for (int i = 0; i < n; i++) {
+            items[i] = mItems[(readCount + i) & (Capacity - 1)];
+        }
+        mReadCount.store(readCount + n, std::memory_order_release);
+        return n;
+    }
+    inline bool pop(T& item) { return read(&item, 1) == 1; }
+
+    // consumer: the oldest item, left in place (NULL if empty) - follow with discard(1) once done with it
+    inline T* peek() { return getReadSpace() > 0 ? &mItems[mReadCount.load(std::memory_order_relaxed) & (Capacity - 1)] : NULL; }
+
+    // consumer: drops up to numItems items, returns how many were dropped
+    int discard(int numItems) {
+        int n = std::min(numItems, getReadSpace());
+        mReadCount.store(mReadCount.load(std::memory_order_relaxed) + n, std::memory_order_release);
+        return n;
+    }
+
+    // only while neither side is running
+    inline void clear() { mWriteCount.store(0); mReadCount.store(0); }
+
+private:
+    T mItems[Capacity];
+    std::atomic<unsigned int> mWriteCount; // total items ever written/read - they wrap around together, so the difference is always the fill level
+    std::atomic<unsigned int> mReadCount;
+};
+
+/// the same for planar audio: Channels rows of samples that fill and empty together. the producer renders straight into the rows - from
+/// getWritePointer() there's always room for MaxWrite frames in one piece, the part past the end going into a spill area that commitWrite()
+/// moves round to the start - and the consumer copies straight out of them
+template <typename T, int Channels, int Capacity, int MaxWrite>
+class PlanarRingBuffer {
+
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "PlanarRingBuffer capacity must be a power of two");
+    static_assert(MaxWrite <= Capacity, "PlanarRingBuffer spill area can't be bigger than the ring");
+
+public:
+    PlanarRingBuffer() :
+    mWriteCount(0),
+    mReadCount(0) {};
+
+    // number of frames waiting to be read (consumer side)
+    inline int getReadSpace() const { return (int)(mWriteCount.load(std::memory_order_acquire) - mReadCount.load(std::memory_order_relaxed)); }
+    // number of free frames (producer side)
+    inline int getWriteSpace() const { return Capacity - (int)(mWriteCount.load(std::memory_order_relaxed) - mReadCount.load(std::memory_order_acquire)); }
+
+    // producer: where the next frame of a channel goes
+    inline T* getWritePointer(int channel) { return &mSamples[channel][mWriteCount.load(std::memory_order_relaxed) & (Capacity - 1)]; }
+
+    // producer: the numFrames frames (at most MaxWrite, and no more than getWriteSpace()) written at getWritePointer() go in
+    void commitWrite(int numFrames) {
+        unsigned int writeCount = mWriteCount.load(std::memory_order_relaxed);
+        int spill = (int)(writeCount & (Capacity - 1)) + numFrames - Capacity;
+        if (spill > 0) {
+            for (int channel = 0; channel < Channels; channel++) {
+                std::copy(&mSamples[channel][Capacity], &mSamples[channel][Capacity + spill], mSamples[channel]);
+            }
+        }
+        mWriteCount.store(writeCount + numFrames, std::memory_order_release);
+    }
+
+    // producer: puts in up to numFrames frames of silence, returns how many actually fit
+    int writeSilence(int numFrames) {
+        int n = std::min(numFrames, getWriteSpace());
+        for (int done = 0; done < n; ) {
+            int frames = std::min(n - done, MaxWrite);
+            for (int channel = 0; channel < Channels; channel++) {
+                std::fill(getWritePointer(channel), getWritePointer(channel) + frames, T());
+            }
+            commitWrite(frames);
+            done += frames;
+        }
+        return n;
+    }
+
+    // consumer: copies out up to numFrames frames into outputs[channel][offset...], returns how many there were
+    int read(T** outputs, int offset, int numFrames) {
+        unsigned int readCount = mReadCount.load(std::memory_order_relaxed);
+        int n = std::min(numFrames, getReadSpace());
+        int start = (int)(readCount & (Capacity - 1));
+        int firstPart = std::min(n, Capacity - start);
+        for (int channel = 0; channel < Channels; channel++) {
+            std::copy(&mSamples[channel][start], &mSamples[channel][start + firstPart], &outputs[channel][offset]);
+            std::copy(&mSamples[channel][0], &mSamples[channel][n - firstPart], &outputs[channel][offset + firstPart]);
+        }
+        mReadCount.store(readCount + n, std::memory_order_release);
+        return n;
+    }
+
+    // consumer: drops up to numFrames frames, returns how many were dropped
+    int discard(int numFrames) {
+        int n = std::min(numFrames, getReadSpace());
+        mReadCount.store(mReadCount.load(std::memory_order_relaxed) + n, std::memory_order_release);
+        return n;
+    }
+
+    // only while neither side is running
+    inline void clear() { mWriteCount.store(0); mReadCount.store(0); }
+
+private:
+    T mSamples[Channels][Capacity + MaxWrite];
+    std::atomic<unsigned int> mWriteCount; // total frames ever written/read, as in RingBuffer
+    std::atomic<unsigned int> mReadCount;
+};
+
+#endif /* defined(__Synthesis__RingBuffer__) */
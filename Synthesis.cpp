@@ -25,6 +25,11 @@ enum EParams
   mBrightnessB,
   mPitchBendCoarse,
   mPitchBendFine,
+  mVoicesPerKey,
+  mDamperDamping,
+  mAudibilityFloor,
+  mMaxBlockSize,
+  mRenderAhead,
   //mNoisyTransient,
   kNumParams
 };
@@ -172,6 +177,49 @@ const parameterProperties_struct parameterProperties[kNumParams] =
     .minVal = 0.001,
     .maxVal = 1.0,
     .step = 0.001
+  },
+  {
+    .name="Voices Per Key",
+    .x1 = 250,
+    .y1 = 350,
+    .x2 = 250+60,
+    .y2 = 350+90
+  },
+  {
+    .name="Damper",
+    .x1 = 350,
+    .y1 = 350,
+    .x2 = 350+60,
+    .y2 = 350+90,
+    .defaultVal = 100.0,
+    .minVal = 1.0,
+    .maxVal = 500.0,
+    .step = 0.1
+  },
+  {
+    .name="Audibility Floor",
+    .x1 = 450,
+    .y1 = 350,
+    .x2 = 450+60,
+    .y2 = 350+90,
+    .defaultVal = -60.0,
+    .minVal = -120.0,
+    .maxVal = -20.0,
+    .step = 0.1
+  },
+  {
+    .name="Max Block Size",
+    .x1 = 550,
+    .y1 = 50,
+    .x2 = 550+60,
+    .y2 = 50+90
+  },
+  {
+    .name="Render Ahead",
+    .x1 = 550,
+    .y1 = 200,
+    .x2 = 550+60,
+    .y2 = 200+90
   }
 //  {
 //    .name="Noisy Transient",
@@ -196,7 +244,19 @@ enum ELayout
 
 Synthesis::Synthesis(IPlugInstanceInfo instanceInfo)
   :	IPLUG_CTOR(kNumParams, kNumPrograms, instanceInfo),
-  lastVirtualKeyboardNoteNumber(virtualKeyboardMinimumNoteNumber - 1)
+  lastVirtualKeyboardNoteNumber(virtualKeyboardMinimumNoteNumber - 1),
+  mBlockFifo(mVoiceManager, mMIDIReceiver),
+  mRequestedRenderAheadBlocks(0),
+  mRenderAheadBlocks(0),
+  mRenderAheadActive(false),
+  mRenderThreadRunning(false),
+  mHostSampleTime(0),
+  mInputHorizon(0),
+  mHostFrames(0),
+  mRenderSampleTime(0),
+  mOwedFrames(0),
+  mUnderrunCount(0),
+  mMidiOverflowCount(0)
 {
   TRACE;
   
@@ -204,9 +264,14 @@ Synthesis::Synthesis(IPlugInstanceInfo instanceInfo)
   CreateGraphics();
   CreatePresets();
   
-  VoiceManager& voiceManager = VoiceManager::getInstance();
+  VoiceManager& voiceManager = mVoiceManager;
   voiceManager.initOpenCL();
   
+  if (voiceManager.usesGPU()) {
+    GetParam(mRenderAhead)->SetDisplayText(0, "1 (GPU minimum)"); // the knob's 0 plays as 1 here - see setRenderAheadBlocks
+  }
+  setRenderAheadBlocks(GetParam(mRenderAhead)->Int()); // the max block size is already set, by the knob's OnParamChange
+  
   //openCLStarted = false;
   
   // connet the noteOn's and noteOff's from mMIDIReceiver to VoiceManager using signals and slots
@@ -218,7 +283,9 @@ Synthesis::Synthesis(IPlugInstanceInfo instanceInfo)
   //mMIDIReceiver.noteOn.Connect(mOscilloscope, &Oscilloscope::updatePixelColors);
 }
 
-Synthesis::~Synthesis() {}
+Synthesis::~Synthesis() {
+  stopRenderThread();
+}
 
 void Synthesis::CreateParams() {
   for (int i = 0; i < kNumParams; i++) {
@@ -230,8 +297,38 @@ void Synthesis::CreateParams() {
         param->InitInt(properties.name,
                         10, // default
                         1, // min
-                        200); // max
+                        MAX_PARTIALS); // max
+        break;
+      case mVoicesPerKey:
+        param->InitInt(properties.name,
+                        1, // default
+                        1, // min
+                        VOICES_PER_DEVICE); // max
         break;
+      case mRenderAhead:
+        param->InitInt(properties.name,
+                        DEFAULT_RENDER_AHEAD_BLOCKS, // default
+                        0, // min
+                        MAX_RENDER_AHEAD_BLOCKS); // max
+        break;
+      // Enum parameters:
+      case mMaxBlockSize: {
+        // the powers of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+        int numSizes = 0;
+        int defaultSize = 0;
+        for (int blockSize = MIN_BLOCK_SIZE; blockSize <= MAX_BLOCK_SIZE; blockSize *= 2, numSizes++) {
+          if (blockSize == DEFAULT_MAX_BLOCK_SIZE) {
+            defaultSize = numSizes;
+          }
+        }
+        param->InitEnum(properties.name, defaultSize, numSizes);
+        for (int i = 0; i < numSizes; i++) {
+          char label[16];
+          sprintf(label, "%d", MIN_BLOCK_SIZE << i);
+          param->SetDisplayText(i, label);
+        }
+        break;
+      }
       // Bool parameters:
 //      case mNoisyTransient:
 //        param->InitBool(properties.name, true);
@@ -250,6 +347,9 @@ void Synthesis::CreateParams() {
   /// set shape for knobs
   GetParam(mB)->SetShape(5);
   GetParam(mNumPartials)->SetShape(1);
+  GetParam(mVoicesPerKey)->SetShape(1);
+  GetParam(mMaxBlockSize)->SetShape(1);
+  GetParam(mRenderAhead)->SetShape(1);
   
   /// initialize correct default parameter values on load
   for (int i = 0; i < kNumParams; i++) {
@@ -328,7 +428,15 @@ void Synthesis::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
   
   double *leftOutput = outputs[0];
   double *rightOutput = outputs[1];
-  VoiceManager& voiceManager = VoiceManager::getInstance();
+  if (mRenderAheadActive.load()) {
+    // pass the MIDI received since the last buffer on to the render thread (see queueMidiMsg)
+    int numMessages = mMIDIReceiver.readInput(mIncomingMidi, MIDI_INPUT_RING_SIZE);
+    for (int i = 0; i < numMessages; i++) {
+      queueMidiMsg(&mIncomingMidi[i]);
+    }
+  } else {
+    mMIDIReceiver.processInput();
+  }
   processVirtualKeyboard();
   
   
@@ -352,31 +460,29 @@ void Synthesis::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
   //std::thread voiceEnergyUpdater(&Synthesis::voiceEnergyUpdaterManager, this);
   
   
-  /// this allows for BLOCK_SIZE to be different (smaller) than actual VST host blockSize, to reduce latency
-  int numBlocks = nFrames/BLOCK_SIZE;
-  
-  
-  for (int j = 0; j < numBlocks; j++) {
+  if (mRenderAheadActive.load()) {
+    // render-ahead mode: all the MIDI for this buffer is queued by now, so let the render thread take in input up to the end of it, then copy out whatever it has ready
+    mHostFrames.store(nFrames);
+    mInputHorizon.store(mHostSampleTime + nFrames, std::memory_order_release);
+    mRenderWake.notify_one();
     
-    blockOfSamples = voiceManager.getBlockOfSamples();
-    for (int i = 0; i < BLOCK_SIZE; i++) {
-      
-      leftOutput[i + j*BLOCK_SIZE] = clip(blockOfSamples[i*NUM_CHANNELS]);
-      rightOutput[i + j*BLOCK_SIZE] = clip(blockOfSamples[i*NUM_CHANNELS + 1]);
-      
-      // add in bandlimited noise
-//      leftOutput[i + j*BLOCK_SIZE] += 0.003f * (static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/2.0f)) - 1.0f) * blockOfSamples[i*NUM_CHANNELS];
-//      rightOutput[i + j*BLOCK_SIZE] += 0.003f * (static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/2.0f)) - 1.0f) * blockOfSamples[i*NUM_CHANNELS + 1];
-      
-      
-//      mOscilloscope->updateLastSample(leftOutput[i], rightOutput[i]);
-      mMIDIReceiver.advance();
-      voiceManager.updateVoiceDampingAndEnergy(i);
+    OutputRing& outputRing = mBlockFifo.getOutputRing();
+    mOwedFrames -= outputRing.discard(mOwedFrames);
+    int pos = outputRing.read(outputs, 0, nFrames);
+    if (pos < nFrames) {
+      // underrun - the render thread fell behind, play silence rather than wait for it
+      for (int i = pos; i < nFrames; i++) {
+        leftOutput[i] = 0.0;
+        rightOutput[i] = 0.0;
+      }
+      mOwedFrames += nFrames - pos;
+      mUnderrunCount++;
     }
-    mMIDIReceiver.Flush(nFrames/numBlocks);
-    voiceManager.setFreeInaudibleVoices();
+    mHostSampleTime += nFrames;
+    return;
   }
   
+  mBlockFifo.process(outputs, nFrames); // see BlockFifo
   
   
   
@@ -393,8 +499,94 @@ void Synthesis::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
   //mMIDIReceiver.Flush(nFrames);
 }
 
-double Synthesis::clip(double n) {
-  return std::max(-0.99, std::min(n, 0.99));
+// the upper bound for the adaptive block size - and so the latency: the FIFO's, or each block of headroom in render-ahead mode. takes the lock,
+// since the engine has to be between buffers (and the render thread stopped) to change it
+void Synthesis::setMaxBlockSize(int maxBlockSize) {
+  IMutexLock lock(this);
+  int previousMaxBlockSize = mVoiceManager.getMaxBlockSize();
+  mVoiceManager.setMaxBlockSize(maxBlockSize);
+  if (mVoiceManager.getMaxBlockSize() != previousMaxBlockSize) {
+    setRenderAheadBlocks(mRequestedRenderAheadBlocks); // restarts rendering with the latency that goes with it
+  }
+}
+
+// 0 blocks renders in the audio callback (latency = one max-size block). anything more moves rendering onto a worker thread - see startRenderThread.
+// an instance on the GPU always renders at least one block ahead: its batches go out in rounds with the other instances' (see GPUService),
+// and the audio callback mustn't wait on those. takes the lock, like setMaxBlockSize
+void Synthesis::setRenderAheadBlocks(int blocks) {
+  IMutexLock lock(this);
+  stopRenderThread();
+  mRequestedRenderAheadBlocks = blocks;
+  mRenderAheadBlocks = std::max(mVoiceManager.usesGPU() ? 1 : 0, blocks);
+  if (mRenderAheadBlocks > 0) {
+    startRenderThread();
+  } else {
+    resetOutputFifo();
+  }
+}
+
+// render-ahead mode: the render thread takes in input as far as the host has delivered MIDI for (mInputHorizon), and the audio thread plays its
+// output a fixed latency later: one host buffer (the input for a buffer only exists once the host has called us with it) plus mRenderAheadBlocks max-size
+// blocks - the first covers the partly built engine block, every extra one is time the GPU can run late without the audio thread ever noticing.
+void Synthesis::startRenderThread() {
+  VoiceManager& voiceManager = mVoiceManager;
+  int hostBlockSize = std::max(GetBlockSize(), voiceManager.getMaxBlockSize());
+  int latency = std::min(hostBlockSize + mRenderAheadBlocks * voiceManager.getMaxBlockSize(), OUTPUT_RING_SIZE - MAX_BLOCK_SIZE);
+  
+  mBlockFifo.reset(latency);
+  mMidiEventRing.clear();
+  mHostSampleTime = 0;
+  mInputHorizon.store(0);
+  mHostFrames.store(hostBlockSize);
+  mRenderSampleTime = 0;
+  mOwedFrames = 0;
+  SetLatency(latency);
+  
+  mRenderAheadActive.store(true);
+  mRenderThreadRunning.store(true);
+  mRenderThread = std::thread(&Synthesis::renderAheadLoop, this);
+}
+
+void Synthesis::stopRenderThread() {
+  if (!mRenderAheadActive.load()) return;
+  mRenderThreadRunning.store(false);
+  mRenderWake.notify_one();
+  mRenderThread.join();
+  mRenderAheadActive.store(false);
+}
+
+void Synthesis::renderAheadLoop() {
+  while (mRenderThreadRunning.load()) {
+    int available = (int)(mInputHorizon.load(std::memory_order_acquire) - mRenderSampleTime);
+    if (available <= 0 || mBlockFifo.getOutputRing().getWriteSpace() < MAX_BLOCK_SIZE) {
+      // nothing to do until the host calls again - the timeout covers a wake-up that came in before we started waiting
+      std::unique_lock<std::mutex> wakeLock(mRenderWakeMutex);
+      mRenderWake.wait_for(wakeLock, std::chrono::milliseconds(1));
+      continue;
+    }
+    
+    // hand over the MIDI that falls within the input we're taking in, timed relative to the next frame
+    int chunk = std::min(available, MAX_BLOCK_SIZE - mBlockFifo.getBlockPosition()); // counting the part of a block carried over from last time, at most MAX_BLOCK_SIZE frames go out
+    TimedMidiMsg* event;
+    while ((event = mMidiEventRing.peek()) && event->mTime < mRenderSampleTime + chunk) {
+      IMidiMsg midiMessage = event->mMsg;
+      midiMessage.mOffset = (int)std::max(0LL, event->mTime - mRenderSampleTime);
+      mMIDIReceiver.addEvent(&midiMessage);
+      mMidiEventRing.discard(1);
+    }
+    // one batch at a time, so there's a chance to check for room in the output ring in between
+    mBlockFifo.takeIn(0, chunk, mHostFrames.load());
+    mMIDIReceiver.Flush(chunk);
+    mRenderSampleTime += chunk;
+  }
+}
+
+// primes the output FIFO with one max-size block of silence - output is played exactly that far behind the MIDI that produced it
+void Synthesis::resetOutputFifo() {
+  VoiceManager& voiceManager = mVoiceManager;
+  int latency = voiceManager.getMaxBlockSize();
+  mBlockFifo.reset(latency);
+  SetLatency(latency);
 }
 
 
@@ -408,14 +600,19 @@ void Synthesis::Reset()
 {
   TRACE;
   IMutexLock lock(this);
+  stopRenderThread(); // the render thread owns the engine while it's running - and the host buffer size (so the latency) may have changed
   double sampleRate = GetSampleRate();
-  VoiceManager::getInstance().setSampleRate(sampleRate);
+  mVoiceManager.setSampleRate(sampleRate);
+  if (mRenderAheadBlocks > 0) {
+    startRenderThread();
+  }
 }
 
 void Synthesis::OnParamChange(int paramIdx)
 {
-  IMutexLock lock(this);
-  VoiceManager& voiceManager = VoiceManager::getInstance();
+  // no lock - the setters only publish the new value, and the engine picks it up at the start of its next block (VoiceManager::applyParameterChanges).
+  // except for the max block size and render-ahead, which take the lock themselves
+  VoiceManager& voiceManager = mVoiceManager;
   IParam* param = GetParam(paramIdx);
 //  std::cout << paramIdx << "\n";
 //  printf("\nparam: %s", paramIdx);
@@ -457,6 +654,23 @@ void Synthesis::OnParamChange(int paramIdx)
     case mPitchBendFine:
       voiceManager.updatePitchBendFine(param->Value());
       break;
+    case mVoicesPerKey:
+      voiceManager.updateMaxVoicesPerKey(param->Int());
+      break;
+    case mDamperDamping:
+      voiceManager.updateDamperDamping(param->Value());
+      break;
+    case mAudibilityFloor:
+      voiceManager.updateAudibilityFloor(param->Value());
+      break;
+    case mMaxBlockSize:
+      setMaxBlockSize(MIN_BLOCK_SIZE << param->Int());
+      break;
+    case mRenderAhead:
+      if (param->Int() != mRequestedRenderAheadBlocks) { // the knob's value, not the clamped one - or a GPU instance would restart on every call
+        setRenderAheadBlocks(param->Int()); // the constructor starts it off, once the engine's there to run
+      }
+      break;
     default:
       break;
   }
@@ -468,6 +682,20 @@ void Synthesis::ProcessMidiMsg(IMidiMsg* pMsg) {
   mVirtualKeyboard->SetDirty();
 }
 
+// audio thread: queues a message for the engine. in render-ahead mode the MIDI queue belongs to the render thread, so messages go over to it stamped with the host sample time they're due at
+void Synthesis::queueMidiMsg(IMidiMsg* pMsg) {
+  if (mRenderAheadActive.load()) {
+    TimedMidiMsg event;
+    event.mTime = mHostSampleTime + pMsg->mOffset;
+    event.mMsg = *pMsg;
+    if (!mMidiEventRing.push(event)) {
+      mMidiOverflowCount++;
+    }
+  } else {
+    mMIDIReceiver.addEvent(pMsg);
+  }
+}
+
 void Synthesis::processVirtualKeyboard() {
   IKeyboardControl* virtualKeyboard = (IKeyboardControl*) mVirtualKeyboard;
   int virtualKeyboardNoteNumber = virtualKeyboard->GetKey() + virtualKeyboardMinimumNoteNumber;
@@ -476,14 +704,14 @@ void Synthesis::processVirtualKeyboard() {
     // The note number has changed from a valid key to something else (valid key or nothing). Release the valid key:
     IMidiMsg midiMessage;
     midiMessage.MakeNoteOffMsg(lastVirtualKeyboardNoteNumber, 0);
-    mMIDIReceiver.onMessageReceived(&midiMessage);
+    queueMidiMsg(&midiMessage);
   }
   
   if (virtualKeyboardNoteNumber >= virtualKeyboardMinimumNoteNumber && virtualKeyboardNoteNumber != lastVirtualKeyboardNoteNumber) {
     // A valid key is pressed that wasn't pressed the previous call. Send a "note on" message to the MIDI receiver:
     IMidiMsg midiMessage;
     midiMessage.MakeNoteOnMsg(virtualKeyboardNoteNumber, virtualKeyboard->GetVelocity(), 0);
-    mMIDIReceiver.onMessageReceived(&midiMessage);
+    queueMidiMsg(&midiMessage);
   }
   
   lastVirtualKeyboardNoteNumber = virtualKeyboardNoteNumber;
@@ -9,8 +9,23 @@
 #include "Oscilloscope.h"
 #include "VoiceManager.h"
 #include "Filter.h"
+#include "RingBuffer.h"
+#include "BlockFifo.h"
 #include <iostream>
 #include <boost/array.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstring>
+
+#define DEFAULT_RENDER_AHEAD_BLOCKS 0 // 0 renders inside the audio callback (on the CPU only - with a GPU it's 1); > 0 renders on a worker thread, that many max-size blocks ahead of the host
+#define MAX_RENDER_AHEAD_BLOCKS 8 // top of the Render Ahead knob
+#define MIDI_EVENT_RING_SIZE 1024 // MIDI events on their way from the audio thread to the render thread
+
+struct TimedMidiMsg {
+  long long mTime; // host sample time the event is due at
+  IMidiMsg mMsg;
+};
 
 class Synthesis : public IPlug
 {
@@ -29,22 +44,50 @@ public:
   static const int virtualKeyboardMinimumNoteNumber = 24;
   int lastVirtualKeyboardNoteNumber;
   boost::array<double, 2> nextSample;
+  
+  void setMaxBlockSize(int maxBlockSize);
+  inline int getMaxBlockSize() { return mVoiceManager.getMaxBlockSize(); }
+  void setRenderAheadBlocks(int blocks);
+  inline int getRenderAheadBlocks() const { return mRenderAheadBlocks; } // the blocks in use - at least 1 on the GPU, whatever the knob says
+  inline int getUnderrunCount() const { return mUnderrunCount.load(); } // host buffers the render thread didn't deliver in full in time (events, not frames)
+  inline int getMidiOverflowCount() const { return mMIDIReceiver.getOverflowCount() + mMidiOverflowCount.load(); } // MIDI messages dropped because a ring was full
 
 private:
   
   void CreateParams();
   void CreateGraphics();
   void CreatePresets();
-  void InitOpenCL();
   MIDIReceiver mMIDIReceiver;
+  VoiceManager mVoiceManager; // this instance's voices - the device they render on is shared with every other instance (GPUService)
   IControl* mVirtualKeyboard;
   void processVirtualKeyboard();
-  double clip(double sample);
 //  Oscilloscope* mOscilloscope;
-  OpenCL mOpenCL;
   Filter mFilterL;
   Filter mFilterR;
-  boost::array<double, BLOCK_SIZE*NUM_CHANNELS> blockOfSamples;
+  BlockFifo<MIDIReceiver> mBlockFifo; // takes in the input and renders it, block by block, into its output ring
+  void resetOutputFifo();
+  void queueMidiMsg(IMidiMsg* pMsg);
+  
+  // render-ahead mode: the engine runs on mRenderThread, and the audio thread only passes MIDI in and copies finished frames out
+  void startRenderThread();
+  void stopRenderThread();
+  void renderAheadLoop();
+  int mRequestedRenderAheadBlocks; // what the knob asked for
+  int mRenderAheadBlocks; // what's in use: mRequestedRenderAheadBlocks, but at least 1 on the GPU
+  std::atomic<bool> mRenderAheadActive; // read by the render thread as well
+  std::thread mRenderThread;
+  std::atomic<bool> mRenderThreadRunning;
+  std::mutex mRenderWakeMutex;
+  std::condition_variable mRenderWake;
+  RingBuffer<TimedMidiMsg, MIDI_EVENT_RING_SIZE> mMidiEventRing;
+  long long mHostSampleTime; // audio thread: host sample time at the start of the current buffer
+  std::atomic<long long> mInputHorizon; // host sample time up to which all MIDI has been queued - the render thread can take in input up to here
+  std::atomic<int> mHostFrames; // latest host buffer size, for the block size model
+  long long mRenderSampleTime; // render thread: host sample time of the next frame of input it takes in
+  int mOwedFrames; // frames skipped by underruns - dropped as they turn up, so the output stays exactly the reported latency behind
+  std::atomic<int> mUnderrunCount;
+  std::atomic<int> mMidiOverflowCount; // messages dropped because mMidiEventRing was full
+  IMidiMsg mIncomingMidi[MIDI_INPUT_RING_SIZE];
   
   void voiceEnergyUpdaterManager();
 
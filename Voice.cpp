@@ -17,5 +17,11 @@ void Voice::reset() {
     mNoteNumber = -1;
     mVelocity = 0.0f;
     mTime = 0.0f;
+    mDamperDamping = 0.0f;
+    mPeak = 0.0f;
+    mInaudibleTime = 0.0f;
+    mSampleOffset = 0;
+    isKeyDown = false;
+    isHeldBySustain = false;
     //mOscillator.reset();
 }
\ No newline at end of file
@@ -20,16 +20,22 @@ public:
     // constructor:
     Voice()
     : mNoteNumber(-1),
-    mVelocity(0.0f),
     mEnergyVert(0.0f),
     mEnergyHoriz(0.0f),
     mHorizToVertRatio(0.3f),
     mDamping(0.0f),
     mBrownianThreshold(0.00001),
+    mVelocity(0.0f),
     lastExcitationTimeAgo(0.0f),
     lastExcitationDuration(0.0f),
     lastExcitationStrength(0.0f),
-    isActive(false) {}
+    mDamperDamping(0.0f),
+    mPeak(0.0f),
+    mInaudibleTime(0.0f),
+    mSampleOffset(0),
+    isActive(false),
+    isKeyDown(false),
+    isHeldBySustain(false) {}
     // public member functions:
     inline void setNoteNumber(int noteNumber) {
         mNoteNumber = noteNumber;
@@ -55,7 +61,13 @@ private:
     float lastExcitationTimeAgo; // how many samples ago the last excitation occurred for this voice
     float lastExcitationDuration; // in samples /// WARNING: this may cause an error on sample rate switch... or just audible artifacts... maybe ok
     float lastExcitationStrength;
+    float mDamperDamping; // damping value this voice ramps up to once its damper is down (0 while the damper is off the string)
+    float mPeak; // peak output level of this voice in the last rendered block (taken by the add_voices kernel, or by renderCPUVoices)
+    float mInaudibleTime; // seconds this voice has stayed below the audibility floor
+    int mSampleOffset; // sample index within the next rendered block where this note starts (0 once it has been rendered once)
     bool isActive;
+    bool isKeyDown; // key for this voice is still held down
+    bool isHeldBySustain; // key was released while the sustain pedal was down, so the damper stays off until pedal-up
 };
 
 #endif /* defined(__Synthesis__Voice__) */
@@ -18,12 +18,24 @@ int VoiceManager::getNumberOfActiveVoices() {
     return count;
 }
 
+int VoiceManager::getNumberOfVoicesPlayingNote(int noteNumber) {
+    int count = 0;
+    for (int i = 0; i < MAX_VOICES; i++) {
+        if (voices[i].isActive && voices[i].mNoteNumber == noteNumber) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// returns the oldest active voice on this key, so repeated strikes rotate through the allowed voices per key
 Voice* VoiceManager::findVoicePlayingSameNote(int noteNumber) {
     Voice* sameNoteVoice = NULL;
     for (int i = 0; i < MAX_VOICES; i++) {
-        if (voices[i].mNoteNumber == noteNumber) {
-            sameNoteVoice = &(voices[i]);
-            break;
+        if (voices[i].isActive && voices[i].mNoteNumber == noteNumber) {
+            if (!sameNoteVoice || voices[i].mTime > sameNoteVoice->mTime) {
+                sameNoteVoice = &(voices[i]);
+            }
         }
     }
     return sameNoteVoice;
@@ -31,7 +43,7 @@ Voice* VoiceManager::findVoicePlayingSameNote(int noteNumber) {
 
 Voice* VoiceManager::findFreeVoice() {
     Voice* freeVoice = NULL;
-    for (int i = 0; i < MAX_VOICES; i++) {
+    for (int i = 0; i < mOpenCL.getMaxVoices(); i++) {
         if (!voices[i].isActive) {
             freeVoice = &(voices[i]);
             break;
@@ -43,7 +55,7 @@ Voice* VoiceManager::findFreeVoice() {
 Voice* VoiceManager::findOldestVoice() {
     double age = 0.0;
     int indexOfOldest = 0;
-    for (int i = 0; i < MAX_VOICES; i++) {
+    for (int i = 0; i < mOpenCL.getMaxVoices(); i++) {
         if (voices[i].mTime > age) {
             age = voices[i].mTime;
             indexOfOldest = i;
@@ -55,14 +67,16 @@ Voice* VoiceManager::findOldestVoice() {
 void VoiceManager::onNoteOn(int noteNumber, int velocity) {
     // print number of active voices
     //std::cout << "\nActive voices = " << getNumberOfActiveVoices();
-    // first look for a voice that's playing the same note
-//    Voice* voice = findVoicePlayingSameNote(noteNumber);
-//    // if no voice playing same note, look for a free voice
-//    if (!voice) {
-//        voice = findFreeVoice();
-//    }
-    
-    Voice* voice = findFreeVoice();
+    // first look for a voice that's playing the same note - once this key already has mMaxVoicesPerKey strings ringing, re-excite one of them instead of allocating a new one (a real piano string is one resonator)
+    Voice* voice = NULL;
+    if (getNumberOfVoicesPlayingNote(noteNumber) >= mMaxVoicesPerKey) {
+        voice = findVoicePlayingSameNote(noteNumber);
+    }
+    bool isRestrike = (voice != NULL);
+    // if no voice playing same note, look for a free voice
+    if (!voice) {
+        voice = findFreeVoice();
+    }
     // then do voice stealing
     if (!voice) {
         voice = findOldestVoice();
@@ -74,16 +88,29 @@ void VoiceManager::onNoteOn(int noteNumber, int velocity) {
     
     float scaledVelocity = velocity / 127.0f;
     
-    voice->reset();
-    voice->setNoteNumber(noteNumber);
+    if (!isRestrike) {
+        voice->reset();
+        voice->setNoteNumber(noteNumber);
+        voice->mSampleOffset = mOpenCL.getBatchFrames() + currentEnergySampleIndex; // start the note at the exact sample within the block (counted from the start of the batch)
+    } // a re-struck voice keeps its time, string detune and random seed, so its phase carries on smoothly and only its energy gets re-excited
     //voice->mDamping = ((float)noteNumber/100.0f)*2.5f; /// set this to be a param amount set by a knob (and modified by expression pedal) to control decay time
     voice->mDamping = ((float)noteNumber/100.0f)*mOpenCL.mDamping;
     voice->lastExcitationTimeAgo = 0.0f;
     voice->lastExcitationStrength = scaledVelocity;
     voice->lastExcitationDuration = 0.005f; // 5ms
+    voice->mDamperDamping = 0.0f; // lift the damper again if this voice was being released
     voice->isActive = true;
+    voice->isKeyDown = true;
+    voice->isHeldBySustain = false;
+    voice->mPeak = 1.0f; // this strike hasn't been rendered yet, so count it as audible until the next block reports its real level
+    voice->mInaudibleTime = 0.0f;
     voice->mVelocity = scaledVelocity;
     
+    int slot = (int)(voice - voices);
+    // what the hammer's gaussian adds to the energy over the strike (see updateVoiceDampingAndEnergy), give or take the damping - for the modal engine
+    float strikeEnergy = scaledVelocity * 500.0f * voice->lastExcitationDuration * sqrtf(0.03f * (float)M_PI) * erff(0.5f / sqrtf(0.03f));
+    mOpenCL.strikeModes(slot, mOpenCL.getBatchFrames() + currentEnergySampleIndex, voice->mEnergyHoriz + voice->mEnergyVert, 1-scaledVelocity, strikeEnergy, !isRestrike);
+    
     voice->mEnergyHoriz *= (1-scaledVelocity); // louder hits will "reset" the velocity more - a full loudness hit will totally reset the string back to zero energy
     voice->mEnergyVert *= (1-scaledVelocity);
     
@@ -91,21 +118,55 @@ void VoiceManager::onNoteOn(int noteNumber, int velocity) {
     //voice->mEnergyVert = scaledVelocity;
     //printf("---NOTE ON---\n");
     //voice->mEnergy = scaledVelocity; /// actually this should also be a RAMP function so we get a smooth ramping up to the target mEnergy value
-    voice->mStringDetuneAmount = (1.0f-mOpenCL.mStringDetuneRange) + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(2.0f*mOpenCL.mStringDetuneRange)));
-    voice->randomSeed = rand() % 10000+1000; // set random seed on each note hit for randomizing partial frequencies and amplitudes
+    if (!isRestrike) {
+        voice->mStringDetuneAmount = (1.0f-mOpenCL.mStringDetuneRange) + static_cast <float> (rand()) /( static_cast <float> (RAND_MAX/(2.0f*mOpenCL.mStringDetuneRange)));
+        voice->randomSeed = rand() % 10000+1000; // set random seed on each note hit for randomizing partial frequencies and amplitudes
+    }
+    
+    // the voice's slot on the device is its index in voices[] - write its record, and (for a new note) its onset, and get it uploaded with the next block
+    float* record = &mOpenCL.voiceRecords[slot*NUM_VOICE_PARAMS];
+    record[0] = voice->mFrequency;
+    record[1] = voice->mVelocity;
+    record[2] = voice->mStringDetuneAmount;
+    record[3] = voice->randomSeed;
+    if (!isRestrike) {
+        mOpenCL.voiceOnsets[slot] = mOpenCL.mSampleClock + voice->mSampleOffset;
+    }
+    mOpenCL.markSlotDirty(slot, !isRestrike); // a re-struck voice keeps its seed, so its partial table stays as it is
+}
+
+// drops the damper onto the string - the actual damping ramp happens per sample in updateVoiceDampingAndEnergy()
+void VoiceManager::releaseVoice(Voice& voice) {
+    voice.isHeldBySustain = false;
+    voice.mDamperDamping = mDamperDamping;
 }
 
 void VoiceManager::onNoteOff(int noteNumber, int velocity) {
     for (int i = 0; i < MAX_VOICES; i++) {
         Voice& voice = voices[i];
-        if (voice.isActive && voice.mNoteNumber == noteNumber) {
-            //voice.mDamping = 50.0f; /// actually, this should be a RAMP function, which takes target mDamping value and # of samples it'll take to get there (or SPEED), and then the function increases damping gradually (iterates over several samples of the damping array, perhaps? how to handle this?)
+        if (voice.isActive && voice.isKeyDown && voice.mNoteNumber == noteNumber) {
+            voice.isKeyDown = false;
+            if (isSustainHeld()) {
+                voice.isHeldBySustain = true;
+            } else {
+                releaseVoice(voice);
+            }
         }
     }
 }
 
 void VoiceManager::onSustainChange(double sustain) {
+    bool wasHeld = isSustainHeld();
     mOpenCL.MIDIParams[0] = (float)sustain;
+    // pedal-up releases every voice whose key was let go while the pedal was down
+    if (wasHeld && !isSustainHeld()) {
+        for (int i = 0; i < MAX_VOICES; i++) {
+            Voice& voice = voices[i];
+            if (voice.isActive && voice.isHeldBySustain) {
+                releaseVoice(voice);
+            }
+        }
+    }
 }
 
 void VoiceManager::onExpressionChange(double expression) {
@@ -118,29 +179,46 @@ void VoiceManager::onModChange(double mod) {
 }
 
 void VoiceManager::setSampleRate(double sampleRate) {
+    mOpenCL.setSampleRate(sampleRate);
 }
 
+// the voice records themselves stay on the device (see onNoteOn) - all that changes from block to block is which slots are playing.
+// lists the active slots for the batch, lowest note first - a note's partial count only goes down as its frequency goes up (it's capped at
+// ceiling / frequency), so that's heaviest first, with voices that loop the same number of times next to each other. the GPU gets the front of
+// the list and the CPU the light tail, apart from the very heaviest, which routeVoices moves behind it for the IFFT engine - and any that can play
+// from wavetables, which it moves to the very front (see OpenCL::routeVoices)
 void VoiceManager::updateVoiceData() {
     int j = 0;
     for (int i = 0; i < MAX_VOICES; i++) {
         Voice& voice = voices[i];
         if (voice.isActive) {
-            mOpenCL.voicesData[j*NUM_VOICE_PARAMS]   = voice.mTime;
-            mOpenCL.voicesData[j*NUM_VOICE_PARAMS+1] = voice.mFrequency;
-            mOpenCL.voicesData[j*NUM_VOICE_PARAMS+2] = voice.mVelocity;
-            mOpenCL.voicesData[j*NUM_VOICE_PARAMS+3] = voice.mStringDetuneAmount;
-            mOpenCL.voicesData[j*NUM_VOICE_PARAMS+4] = voice.randomSeed;
-            j++;
-            voice.mTime += mOpenCL.mTimeStep * BLOCK_SIZE;
+            // insertion sort - there's a handful of voices, and equal notes stay in slot order
+            int k = j++;
+            while (k > 0 && voices[mOpenCL.activeSlots[k - 1]].mFrequency > voice.mFrequency) {
+                mOpenCL.activeSlots[k] = mOpenCL.activeSlots[k - 1];
+                k--;
+            }
+            mOpenCL.activeSlots[k] = i;
+            voice.mTime += mOpenCL.mTimeStep * (mOpenCL.mBatchFrames - voice.mSampleOffset); // host-side age, for voice stealing
+            voice.mSampleOffset = 0;
         }
     }
 }
 
 void VoiceManager::setFreeInaudibleVoices() {
+    // a voice is inaudible when its last block peaked below the audibility floor (relative to the whole mix), or below the absolute floor
+    float mixPeakDb = 20.0f * log10f(fmaxf(mOpenCL.mMixPeak, 1e-10f));
+    float floorDb = fmaxf(mixPeakDb + mAudibilityFloor, mAbsoluteAudibilityFloor);
+    float blockTime = mOpenCL.mTimeStep * mOpenCL.mBatchFrames; // runs once per batch, right before it's rendered
     for (int i = 0; i < MAX_VOICES; i++) {
         Voice& voice = voices[i];
         if (voice.isActive) {
-            if ((voice.mEnergyHoriz + voice.mEnergyVert) <= voice.mBrownianThreshold) {
+            if (20.0f * log10f(fmaxf(voice.mPeak, 1e-10f)) < floorDb) {
+                voice.mInaudibleTime += blockTime;
+            } else {
+                voice.mInaudibleTime = 0.0f;
+            }
+            if ((voice.mEnergyHoriz + voice.mEnergyVert) <= voice.mBrownianThreshold || voice.mInaudibleTime >= mAudibilityHoldTime) {
                 voice.setFree();
 //                printf("voice %d set free!\n", i);
             }
@@ -148,41 +226,122 @@ void VoiceManager::setFreeInaudibleVoices() {
     }
 }
 
-void VoiceManager::updateVoiceDampingAndEnergy(int currentSampleIndex) {
-    int j = 0;
+// advances every voice's envelope over one segment of the block (the samples between two MIDI events), writing one energy value per sample
+void VoiceManager::updateVoiceDampingAndEnergy(int startSampleIndex, int numSamples) {
+    float timeStep = mOpenCL.mTimeStep;
     for (int i = 0; i < MAX_VOICES; i++) {
         Voice& voice = voices[i];
         if (voice.isActive) {
+            float* energy = &mOpenCL.voicesEnergy[i*MAX_BLOCK_SIZE + mOpenCL.mBatchFrames + startSampleIndex]; // the block being gathered goes in behind the batch
+            float* force = &mOpenCL.voicesForce[i*MAX_BLOCK_SIZE + mOpenCL.mBatchFrames + startSampleIndex];
             float duration = voice.lastExcitationDuration;
-            float timeAgo = voice.lastExcitationTimeAgo;
-            float timeStep = mOpenCL.mTimeStep;
-            if (timeAgo < duration) {
-                float deltaEnergy = timeStep * static_cast<float>( exp( - ( pow(timeAgo - duration/2.0f, 2) / (duration*duration*0.03f) ) ) ) * voice.lastExcitationStrength * 500.0f; // smooth ramp for energy // gaussian distribution force function that starts increasing immediately after strike and goes back down to zero after exactly duration seconds. the 0.03f is so that the gaussian curve just touches zero at the beginning and end of the transient
-                voice.mEnergyVert += deltaEnergy * (1.0f-voice.mHorizToVertRatio); // this was just 1.0, with 250.0f final multiplier in above line
-                voice.mEnergyHoriz += deltaEnergy * voice.mHorizToVertRatio;
-                //printf("timeAgo = %f, duration = %f, voice[%d] energyVert = %f, energyHoriz = %f\n", timeAgo, duration, i, voice.mEnergyVert, voice.mEnergyHoriz);
+            float vertRatio = 1.0f-voice.mHorizToVertRatio;
+            float horizRatio = voice.mHorizToVertRatio;
+            int n = 0;
+            // while the hammer is still pushing or the damper is still ramping, the envelope has to be stepped one sample at a time
+            while (n < numSamples && (voice.lastExcitationTimeAgo < duration || voice.mDamping < voice.mDamperDamping)) {
+                float timeAgo = voice.lastExcitationTimeAgo;
+                force[n] = 0.0f;
+                if (timeAgo < duration) {
+                    float deltaEnergy = timeStep * static_cast<float>( exp( - ( pow(timeAgo - duration/2.0f, 2) / (duration*duration*0.03f) ) ) ) * voice.lastExcitationStrength * 500.0f; // smooth ramp for energy // gaussian distribution force function that starts increasing immediately after strike and goes back down to zero after exactly duration seconds. the 0.03f is so that the gaussian curve just touches zero at the beginning and end of the transient
+                    voice.mEnergyVert += deltaEnergy * vertRatio; // this was just 1.0, with 250.0f final multiplier in above line
+                    voice.mEnergyHoriz += deltaEnergy * horizRatio;
+                    force[n] = deltaEnergy;
+                    //printf("timeAgo = %f, duration = %f, voice[%d] energyVert = %f, energyHoriz = %f\n", timeAgo, duration, i, voice.mEnergyVert, voice.mEnergyHoriz);
+                }
+                if (voice.mDamping < voice.mDamperDamping) { // damper is down - ramp damping up towards the damper value
+                    voice.mDamping += voice.mDamperDamping * timeStep / mDamperRampTime;
+                    if (voice.mDamping > voice.mDamperDamping) {
+                        voice.mDamping = voice.mDamperDamping;
+                    }
+                }
+                voice.mEnergyVert -= voice.mEnergyVert * timeStep * voice.mDamping * vertRatio;
+                voice.mEnergyHoriz -= voice.mEnergyHoriz * timeStep * voice.mDamping * horizRatio;
+                energy[n] = voice.mEnergyVert + voice.mEnergyHoriz; // set voice energy with sum of horizontal and vertical modes of string vibration
+                voice.lastExcitationTimeAgo += timeStep;
+                n++;
             }
-            if (currentSampleIndex == 0) {
-                //printf("timeAgo = %f, duration = %f, voice[%d] energyVert = %f, energyHoriz = %f\n", timeAgo, duration, i, voice.mEnergyVert, voice.mEnergyHoriz);
+            // the rest of the segment is a plain exponential decay, so the per-sample decay factors only need working out once
+            if (n < numSamples) {
+                float vertDecay = 1.0f - timeStep * voice.mDamping * vertRatio;
+                float horizDecay = 1.0f - timeStep * voice.mDamping * horizRatio;
+                voice.lastExcitationTimeAgo += timeStep * (numSamples - n);
+                std::fill(force + n, force + numSamples, 0.0f);
+                for (; n < numSamples; n++) {
+                    voice.mEnergyVert *= vertDecay;
+                    voice.mEnergyHoriz *= horizDecay;
+                    energy[n] = voice.mEnergyVert + voice.mEnergyHoriz;
+                }
             }
-            voice.mEnergyVert -= voice.mEnergyVert * timeStep * voice.mDamping * (1.0f-voice.mHorizToVertRatio);
-            voice.mEnergyHoriz -= voice.mEnergyHoriz * timeStep * voice.mDamping * (voice.mHorizToVertRatio);
-            mOpenCL.voicesEnergy[j*BLOCK_SIZE + currentSampleIndex] = voice.mEnergyVert + voice.mEnergyHoriz; // set voice energy with sum of horizontal and vertical modes of string vibration
-            voice.lastExcitationTimeAgo += mOpenCL.mTimeStep;
-            j++;
         }
     }
+    currentEnergySampleIndex = startSampleIndex + numSamples; // MIDI at the end of this segment gets dispatched before the next one, so note-ons know where in the block they start
 }
 
-boost::array<double, BLOCK_SIZE * NUM_CHANNELS> VoiceManager::getBlockOfSamples() {
+// the only place the knob values reach the engine - it runs on the render path between blocks, so nothing the engine reads changes halfway through one.
+// each knob is its own parameter, so there's nothing to tear: the worst a change landing mid-read can do is wait until the next block.
+unsigned int VoiceManager::applyParameterChanges() {
+    unsigned int dirty = mDirtyParameters.exchange(0, std::memory_order_acquire);
+    if (!dirty) return 0;
+    for (int i = 0; i < kNumEngineParameters; i++) {
+        if (!(dirty & ENGINE_PARAMETER_BIT(i))) continue;
+        float value = mPublishedParameters[i].load(std::memory_order_relaxed);
+        switch (i) {
+            case kInharmonicity:
+                mOpenCL.mB = value;
+                break;
+            case kNumPartials:
+                mOpenCL.NUM_PARTIALS = (short)value;
+                break;
+            case kStringDetuneRange:
+                mOpenCL.mStringDetuneRange = value;
+                break;
+            case kPartialDetuneRange:
+                mOpenCL.mPartialDetuneRange = value;
+                break;
+            case kDamping:
+                mOpenCL.mDamping = value;
+                break;
+            case kDamperDamping:
+                mDamperDamping = value;
+                break;
+            case kAudibilityFloor:
+                mAudibilityFloor = value;
+                break;
+            case kMaxVoicesPerKey:
+                mMaxVoicesPerKey = value < 1 ? 1 : (int)value;
+                break;
+            default: // kLinearTerm..kPitchBendFine
+                mOpenCL.instrumentData[i - kLinearTerm] = value;
+                break;
+        }
+    }
+    if (dirty & PARTIAL_PARAMETERS) {
+        mOpenCL.mStaleTableSlots = ~0u >> (32 - MAX_VOICES); // rebuild every slot's partial table with the new values
+    }
+    if (dirty & WAVETABLE_PARAMETERS) {
+        mOpenCL.mWavetableGeneration++;
+    }
+    return dirty;
+}
+
+void VoiceManager::renderBatch(double** outputs, int carryFrames) {
     
     numActiveVoices = getNumberOfActiveVoices();
     mOpenCL.NUM_ACTIVE_VOICES = numActiveVoices;
+    mOpenCL.holdCarriedEnergy(carryFrames);
     //std::cout << "\nactive voices: " << numActiveVoices;
     if (numActiveVoices == 0) {
-        return zeroes;
+        for (int channel = 0; channel < NUM_CHANNELS; channel++) {
+            std::fill(outputs[channel], outputs[channel] + mOpenCL.getBatchFrames(), 0.0);
+        }
+        mOpenCL.skipBatch();
     } else {
-        updateVoiceData(); // writes new voice data to mOpenCL
-        return mOpenCL.getBlockOfSamples();
+        updateVoiceData(); // updates the active slot list in mOpenCL
+        mOpenCL.renderBatch(outputs);
+        for (int j = 0; j < numActiveVoices; j++) {
+            voices[mOpenCL.activeSlots[j]].mPeak = mOpenCL.voicesPeak[j];
+        }
     }
+    mOpenCL.restoreCarriedEnergy(carryFrames);
 }
@@ -10,15 +10,51 @@
 #define __Synthesis__VoiceManager__
 
 #include <iostream>
+#include <atomic>
 #include "Voice.h"
-#include <boost/array.hpp>
 #include "OpenCL.h"
 
+// everything the knobs set on the engine. OnParamChange (UI thread or host automation) publishes values, and the render path picks them up once per block -
+// see applyParameterChanges
+enum EEngineParameter {
+    kInharmonicity = 0,
+    kNumPartials,
+    kStringDetuneRange,
+    kPartialDetuneRange,
+    kDamping,
+    kLinearTerm, // kLinearTerm..kPitchBendFine map to instrumentData[0..6], in order
+    kSquaredTerm,
+    kCubicTerm,
+    kBrightnessA,
+    kBrightnessB,
+    kPitchBendCoarse,
+    kPitchBendFine,
+    kDamperDamping,
+    kAudibilityFloor,
+    kMaxVoicesPerKey,
+    kNumEngineParameters
+};
+
+#define ENGINE_PARAMETER_BIT(param) (1u << (param))
+// parameters baked into the per-slot partial tables on the device - every table gets rebuilt when one of these is dirty
+#define PARTIAL_PARAMETERS (ENGINE_PARAMETER_BIT(kPartialDetuneRange))
+// ...and the ones baked into the wavetables (the detune range too, but that goes with the partial tables) - they all get baked again
+#define WAVETABLE_PARAMETERS (ENGINE_PARAMETER_BIT(kNumPartials) | ENGINE_PARAMETER_BIT(kBrightnessA) | ENGINE_PARAMETER_BIT(kBrightnessB) | ENGINE_PARAMETER_BIT(kPitchBendCoarse) | ENGINE_PARAMETER_BIT(kPitchBendFine))
+
+/// one per plugin instance (Synthesis owns it) - the GPU it renders on is shared with all the other instances, see GPUService
 class VoiceManager {
 public:
-    static VoiceManager& getInstance() {
-        static VoiceManager theInstance;
-        return theInstance;
+    VoiceManager() :
+    mMaxVoicesPerKey(1),
+    mDamperDamping(100.0f),
+    mDamperRampTime(0.05f),
+    mAudibilityFloor(-60.0f),
+    mAbsoluteAudibilityFloor(-96.0f),
+    mAudibilityHoldTime(0.1f),
+    mDirtyParameters(0) {
+        for (int i = 0; i < kNumEngineParameters; i++) {
+            mPublishedParameters[i].store(0.0f);
+        }
     };
     void onNoteOn(int noteNumber, int velocity);
     void onNoteOff(int noteNumber, int velocity);
@@ -27,54 +63,73 @@ public:
     void onModChange(double mod);
     void setSampleRate(double sampleRate);
     void updateInharmonicityCoeff(float mB) {
-        mOpenCL.mB = mB;
+        publishParameter(kInharmonicity, mB);
     }
     void updateNumPartials(int partials) {
-        mOpenCL.NUM_PARTIALS = partials;
+        publishParameter(kNumPartials, partials);
     }
     void updateStringDetuneRange(float val) {
-        mOpenCL.mStringDetuneRange = val;
+        publishParameter(kStringDetuneRange, val);
     }
     void updatePartialDetuneRange(float val) {
-        mOpenCL.mPartialDetuneRange = val;
+        publishParameter(kPartialDetuneRange, val);
     }
     void updateDamping(float val) {
-        mOpenCL.mDamping = val;
+        publishParameter(kDamping, val);
     }
     void updateLinearTerm(float val) {
-        mOpenCL.instrumentData[0] = val;
+        publishParameter(kLinearTerm, val);
     }
     void updateSquaredTerm(float val) {
-        mOpenCL.instrumentData[1] = val;
+        publishParameter(kSquaredTerm, val);
     }
     void updateCubicTerm(float val) {
-        mOpenCL.instrumentData[2] = val;
+        publishParameter(kCubicTerm, val);
     }
     void updateBrightnessA(float val) {
-        mOpenCL.instrumentData[3] = val;
+        publishParameter(kBrightnessA, val);
     }
     void updateBrightnessB(float val) {
-        mOpenCL.instrumentData[4] = val;
+        publishParameter(kBrightnessB, val);
     }
     void updatePitchBendCoarse(float val) {
-        mOpenCL.instrumentData[5] = val;
+        publishParameter(kPitchBendCoarse, val);
     }
     void updatePitchBendFine(float val) {
-        mOpenCL.instrumentData[6] = val;
+        publishParameter(kPitchBendFine, val);
+    }
+    void updateDamperDamping(float val) {
+        publishParameter(kDamperDamping, val);
+    }
+    void updateAudibilityFloor(float val) {
+        publishParameter(kAudibilityFloor, val);
     }
-    boost::array<double, BLOCK_SIZE*NUM_CHANNELS> getBlockOfSamples();
+    void updateMaxVoicesPerKey(int val) {
+        publishParameter(kMaxVoicesPerKey, val);
+    }
+    unsigned int applyParameterChanges(); // render path, once per block: takes in the published values, returns the mask of the ones that changed
+    inline bool hasParameterChanges() { return mDirtyParameters.load(std::memory_order_relaxed) != 0; }
+    // the block being gathered is complete - it waits in the batch until renderBatch
+    inline void queueBlock() {
+        currentEnergySampleIndex = 0;
+        mOpenCL.queueBlock();
+    }
+    void renderBatch(double** outputs, int carryFrames); // renders getBatchFrames() frames into outputs[channel][frame] - carryFrames of the next block have already been gathered
+    inline int getBatchFrames() { return mOpenCL.getBatchFrames(); }
+    inline int getBlockSize() { return mOpenCL.getBlockSize(); }
+    inline int getMaxBlockSize() { return mOpenCL.getMaxBlockSize(); }
+    inline void setMaxBlockSize(int maxBlockSize) { mOpenCL.setMaxBlockSize(maxBlockSize); }
+    inline void updateBlockSize(int hostFrames) { mOpenCL.updateBlockSize(hostFrames); }
+    inline bool usesGPU() { return mOpenCL.usesGPU(); }
     inline void initOpenCL() {
-        zeroes.assign(0.0);
         currentEnergySampleIndex = 0;
         mOpenCL.initOpenCL();
     }
-    void updateVoiceDampingAndEnergy(int i);
+    void updateVoiceDampingAndEnergy(int startSampleIndex, int numSamples);
     void setFreeInaudibleVoices();
     OpenCL mOpenCL;
 
 private:
-    /* No instantiation from outside (i.e. singleton) */
-    VoiceManager() {};
     /* Explicitly disallow copying: */
     VoiceManager(const VoiceManager&);
     VoiceManager& operator= (const VoiceManager&);
@@ -82,11 +137,26 @@ private:
     int getNumberOfActiveVoices();
     int numActiveVoices;
     int currentEnergySampleIndex;
+    int mMaxVoicesPerKey; // max number of voices a single key can have ringing at once; further strikes re-excite an existing voice
+    float mDamperDamping; // damping a voice ramps up to after key-up (or pedal-up)
+    float mDamperRampTime; // seconds it takes the damper to reach mDamperDamping, so key-up doesn't click
+    float mAudibilityFloor; // dB relative to the peak of the whole mix, below which a voice counts as inaudible
+    float mAbsoluteAudibilityFloor; // dBFS, below which a voice counts as inaudible no matter how quiet the mix is
+    float mAudibilityHoldTime; // seconds a voice has to stay inaudible before it gets set free
+    std::atomic<float> mPublishedParameters[kNumEngineParameters]; // written by any thread calling the update* setters, read by applyParameterChanges
+    std::atomic<unsigned int> mDirtyParameters; // bit per EEngineParameter published since the last applyParameterChanges
+    // never blocks - the value goes in first, then the dirty bit (release) that makes the render path (acquire) read it
+    inline void publishParameter(EEngineParameter param, float value) {
+        mPublishedParameters[param].store(value, std::memory_order_relaxed);
+        mDirtyParameters.fetch_or(ENGINE_PARAMETER_BIT(param), std::memory_order_release);
+    }
+    inline bool isSustainHeld() { return mOpenCL.MIDIParams[0] >= 0.5f; }
+    void releaseVoice(Voice& voice);
     void updateVoiceData(); // this is called on every sample to update damping and energy values
+    int getNumberOfVoicesPlayingNote(int noteNumber);
     Voice* findVoicePlayingSameNote(int noteNumber);
     Voice* findFreeVoice();
     Voice* findOldestVoice();
-    boost::array<double, BLOCK_SIZE*NUM_CHANNELS> zeroes; // zero-samples for returning if no active voices
 };
 
 #endif /* defined(__Synthesis__VoiceManager__) */
@@ -237,28 +237,25 @@ void MIDICallback( double deltatime, std::vector< unsigned char > *message, void
 {
   if ( message->size() )
   {
-    IMidiMsg *myMsg;
+    // built on the stack - this runs on RtMidi's thread for every message, so no allocation here
+    IMidiMsg msg;
 
     switch (message->size())
     {
       case 1:
-        myMsg = new IMidiMsg(0, message->at(0), 0, 0);
+        msg = IMidiMsg(0, message->at(0), 0, 0);
         break;
       case 2:
-        myMsg = new IMidiMsg(0, message->at(0), message->at(1), 0);
+        msg = IMidiMsg(0, message->at(0), message->at(1), 0);
         break;
       case 3:
-        myMsg = new IMidiMsg(0, message->at(0), message->at(1), message->at(2));
+        msg = IMidiMsg(0, message->at(0), message->at(1), message->at(2));
         break;
       default:
         DBGMSG("NOT EXPECTING %d midi callback msg len\n", (int) message->size());
-        break;
+        return;
     }
 
-    IMidiMsg msg(*myMsg);
-
-    delete myMsg;
-
     // filter midi messages based on channel, if gStatus.mMidiInChan != all (0)
     if (gState->mMidiInChan)
     {
@@ -1,27 +1,115 @@
-__kernel void oscillator(__global const float *voicesDataBuffer,
-                         __global const float *voicesEnergyBuffer,
-                         __global const float *instrumentDataBuffer,
-                         float mModPrevious,
-                         float mModCurrent,
-                         float mB,
-                         float partialDetuneRange,
-                         float mTimeStep,
-                         short NUM_PARTIALS,
-                         short BLOCK_SIZE,
-                         short NUM_CHANNELS,
-                         __global float *voicesSampleBuffer
-                         ) {
+// everything that's per plugin instance in a dispatch - several instances' batches can go to the device together (see GPUService),
+// each one a group of consecutive voices in the active voice list with an output slice of its own. keep in sync with RenderGroup in OpenCL.h
+typedef struct {
+    float modPrevious;
+    float modCurrent;
+    float mB; // inharmonicity coefficient
+    float partialDetuneRange;
+    float timeStep;
+    float partialCeiling; // highest partial frequency worth rendering (AUDIBLE_CEILING, or Nyquist if that's lower)
+    uint blockStartSample; // the instance's sample clock at the start of its batch
+    int numPartials;
+    int frames; // length of the instance's batch
+    int firstVoice; // its voices are firstVoice..firstVoice+numVoices-1 in the active voice list
+    int numVoices;
+    int outputOffset; // where its planar output slice starts in outputSampleBuffer
+    float instrumentData[NUM_INSTRUMENT_PARAMS];
+} RenderGroup;
+
+// where one voice's wavetable layers are, and how long - keep in sync with WavetableInfo in OpenCL.h
+typedef struct {
+    float topLogEnergy;
+    float firstStep;
+    float ratio;
+    float bottomExponent;
+    float transientMono;
+    float transientPan;
+    int lengths[WAVETABLE_LAYERS];
+    int partials[WAVETABLE_LAYERS];
+} WavetableInfo;
+
+// what the modal engine needs for one voice's batch - keep in sync with ModalVoice in OpenCL.h
+typedef struct {
+    float logDecay;
+    float strikeLogEnergy;
+    float strikeScale;
+    float resetLogEnergy;
+    int resetSample;
+    int clearModes;
+} ModalVoice;
+
+
+/// the voice math every renderer shares - the same expressions, in the same order, as the helpers in OpenCL.h, so a voice sounds the same
+/// whichever side renders it. the partial ones are macros, since voice_partials takes its partials in float4s and the others one at a time
+
+__constant int string2Pans[4] = {2, 0, 3, 1}; // string 2 takes the pans of the partials in each 4 in this order (string 1's, shuffled)
+
+// the voice's inharmonicity coefficient mTime into the note: the knob's, made to sound about as strong across the octaves (it gets much bigger
+// up high), and stronger while the string is still deformed from a hard strike - the harder you hit, the more non-linear the partials become,
+// but only for a brief moment. mTime's multiplicand is how fast that wears off (1 is slow, 10 much faster), the final divisor how strong it is
+float voice_inharmonicity(float mB, float mFrequency, float mVelocity, float mTime) {
+    mB *= 0.1f + mFrequency/10000.0f;
+    mB *= 0.1f + mFrequency*mFrequency/50000000.0f;
+    mB *= 1.01f / (1.01f - (mVelocity/(1.0f+mTime*10.0f)) / 5.0f);
+    return mB;
+}
+
+// partial eye's frequency (eye = 1 for the fundamental), before its random detune
+#define PARTIAL_FREQUENCY(eye, mFrequency, mB, mPitchBendCoarse, mPitchBendFine) \
+    (((mPitchBendCoarse) + (mPitchBendFine) * pow((eye), 0.3f)) * (eye) * (mFrequency) * sqrt(1.0f + (mB) * (eye) * (eye)))
+
+// a partial's random amplitude and pan position (0..1), from its partial table entry rand - both undo the detune range the table was built
+// with (partialDetuneRange is the knob's / 7000000, the way the table has it)
+#define PARTIAL_AMP(rand, partialDetuneRange) ((1.0f-(rand))*(75.0f/(partialDetuneRange)/7000000.0f)+0.7f)
+#define PARTIAL_PAN(rand, partialDetuneRange) (fabs((rand) - 1.0f) * 214.0f / (partialDetuneRange) / 7000000.0f)
+
+// the pans start out in the middle and wash out to each partial's own, panSpeed times closer to it mTime into the note (5 is a good medium
+// speed - subtle, realistic)
+float pan_speed(float mTime) {
+    return 5.0f * mTime + 1.0f;
+}
+float pan_left(float pan, float panSpeed) {
+    return (1.0f-pan) - (0.5f - pan)/panSpeed;
+}
+float pan_right(float pan, float panSpeed) {
+    return (pan) - (pan - 0.5f)/panSpeed;
+}
+
+// pan_left and pan_right multiplied out, for sums that are already pan-weighted: (fixed left, fixed right, slope) - left = fixed left - pan * slope,
+// right = fixed right + pan * slope
+float3 pan_terms(float panSpeed) {
+    return (float3)(1.0f - 0.5f / panSpeed, 0.5f / panSpeed, 1.0f - 1.0f / panSpeed);
+}
+
+
+// partials firstPartial..lastPartial-1 of one voice at one moment, age samples into the note (sampleIndex is where that is in the batch, for
+// the energy row) - both strings, panned, unscaled. the full-rate oscillator and the decimated bands each take their own range of partials.
+// a sin per partial - the host's near-harmonic recurrence (OpenCL::renderHarmonicPartials) isn't worth it against the device's native sin
+float2 voice_partials(int voiceSlot,
+                      int age,
+                      int sampleIndex,
+                      int firstPartial,
+                      int lastPartial,
+                      __global const RenderGroup *group,
+                      __global const float *voiceRecordBuffer,
+                      __global const float *partialTableBuffer,
+                      __global const float *voicesEnergyBuffer) {
     
-    int globalID = get_global_id(0);
-    short voiceID = globalID / BLOCK_SIZE; // find which voice # this work-item is calculating a sample for
-    float mTime = voicesDataBuffer[voiceID*5];
-    int sampleIndex = globalID - (BLOCK_SIZE*voiceID);// sample index/offset within this voice (never higher than BLOCK_SIZE-1)
-    mTime += mTimeStep * (float)sampleIndex; // find actual time value for this sample
-    float mFrequency = voicesDataBuffer[voiceID*5+1];
-    float mVelocity = (float)voicesDataBuffer[voiceID*5+2];
-    float randStringMult = voicesDataBuffer[voiceID*5+3];
-    short x = (short)voicesDataBuffer[voiceID*5+4]; // random seed
-    float mEnergy = voicesEnergyBuffer[voiceID*BLOCK_SIZE + sampleIndex];
+    float mModPrevious = group->modPrevious;
+    float mModCurrent = group->modCurrent;
+    float mB = group->mB;
+    float partialDetuneRange = group->partialDetuneRange;
+    float mTimeStep = group->timeStep;
+    short NUM_PARTIALS = (short)group->numPartials;
+    short BLOCK_SIZE = (short)group->frames;
+    __global const float *instrumentDataBuffer = group->instrumentData;
+    
+    float mTime = mTimeStep * (float)age; // actual time value for this sample (phase starts at zero right at the onset)
+    float mFrequency = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS];
+    float mVelocity = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+1];
+    float randStringMult = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+2];
+    __global const float *partialRands = &partialTableBuffer[voiceSlot*MAX_PARTIALS]; // per-partial frequency multipliers, built by init_partials when the note started
+    float mEnergy = voicesEnergyBuffer[voiceSlot*MAX_BLOCK_SIZE + sampleIndex]; // energy rows are MAX_BLOCK_SIZE long, whatever size of block (or batch) is being rendered
     
     // re-center mod wheel values around 0
 //    mModPrevious = mModPrevious - 0.5f;
@@ -67,12 +155,13 @@ __kernel void oscillator(__global const float *voicesDataBuffer,
 //    }
 //    printf("%f\n", mMod);
     
-    if ((int)(22050.0f / mFrequency) < NUM_PARTIALS) { // was 22050
-        NUM_PARTIALS = (int)(22050.0f / mFrequency); // was 22050
+    if ((int)(group->partialCeiling / mFrequency) < NUM_PARTIALS) { // was 22050
+        NUM_PARTIALS = (int)(group->partialCeiling / mFrequency); // was 22050
     }; // scale down num_partials to only the MAX number actually needed for this note, but don't go over the MAX partials (e.g. 128), since a 50Hz note, for example, would need 441 partials!
-    mB *= 0.1f + mFrequency/10000.0f; // make the apparent effect of mB more linear across the octaves, so it's smaller for low notes and higher for high notes
-    mB *= 0.1f + mFrequency*mFrequency/50000000.0f; // make the apparent effect of mB more linear across the octaves, so it's smaller for low notes and higher for high notes... in an exponential fashion, so gets much larger faster with higher frequencies
-    mB *= 1.01f / (1.01f - (mVelocity/(1.0f+mTime*10.0f)) / 5.0f); // scales mB with velocity -- the harder you hit, the more non-linear the partials become! but this effect only lasts a brief moment (while the string is majorly deformed from the impact). // mTime's multiplicand governs how fast mB changes in response to velocity -- 1.0f is slow drop, 10.0f is much faster drop. // the final divisor governs how STRONGLY mB changes in response to velocity. 1.0 is fairly strong, while 2.0 is not nearly as strong, and 10.0 is hardly any change at all.
+    if (lastPartial < NUM_PARTIALS) {
+        NUM_PARTIALS = (short)lastPartial;
+    }
+    mB = voice_inharmonicity(mB, mFrequency, mVelocity, mTime);
     
     // VECTOR VERSION (FLOAT4)
     
@@ -91,27 +180,10 @@ __kernel void oscillator(__global const float *voicesDataBuffer,
     
     partialDetuneRange /= 7000000.0f;
     
-    for (int i = 0; i < NUM_PARTIALS; i+=4) {
+    for (int i = firstPartial; i < NUM_PARTIALS; i+=4) {
         
-        // xorshift deterministic RNG
-        // generate 4 random numbers (to use as partial frequency multipliers and random pan values)
-        
-        x = x ^ (x << 21);
-        x = x ^ (x >> 35);
-        x = x ^ (x << 4);
-        rands.s0 = (float)x * partialDetuneRange + 1.0f; // 10,000,000 is very subtle
-        x = x ^ (x << 21);
-        x = x ^ (x >> 35);
-        x = x ^ (x << 4);
-        rands.s1 = (float)x * partialDetuneRange + 1.0f;
-        x = x ^ (x << 21);
-        x = x ^ (x >> 35);
-        x = x ^ (x << 4);
-        rands.s2 = (float)x * partialDetuneRange + 1.0f;
-        x = x ^ (x << 21);
-        x = x ^ (x >> 35);
-        x = x ^ (x << 4);
-        rands.s3 = (float)x * partialDetuneRange + 1.0f;
+        // 4 random numbers (used as partial frequency multipliers and random pan values) - precomputed per voice slot
+        rands = vload4(0, partialRands + i);
     
         eyes.s0 = (float)i + 1.0f;
         eyes.s1 = (float)i + 2.0f;
@@ -123,7 +195,7 @@ __kernel void oscillator(__global const float *voicesDataBuffer,
 //        mFrequency += mMod; // this makes the frequency change with the mod wheel ALSO (mod wheel already changes timbre/brightness a bit)
         
         // mod wheel changes brightness/timbre subtly here
-        freqs = (mPitchBendCoarse + mPitchBendFine * pow(eyes, 0.3f)) * eyes * mFrequency * sqrt((1.0f + mB * eyes * eyes)); // includes inharmonicity coefficient
+        freqs = PARTIAL_FREQUENCY(eyes, mFrequency, mB, mPitchBendCoarse, mPitchBendFine); // includes inharmonicity coefficient
         
 //        printf("%f, %f\n", mFrequency, freqs.s3);
         
@@ -135,8 +207,8 @@ __kernel void oscillator(__global const float *voicesDataBuffer,
         
         // calculate string 1 and 2
         // 2pi used to be: 6.283185307179586f (but too many digits for float!)
-        valuesOne = sin(6.2831853f * mTime * freqs * rands) * amps * ((1.0f-rands)*(75.0f/partialDetuneRange/7000000.0f)+0.7f); // the last multiplier, using rands, is for random partial amplitudes, using same rands as for partial frequency multipliers
-        valuesTwo = sin(6.2831853f * mTime * freqs * rands * randStringMult) * amps * ((1.0f-rands)*(75.0f/partialDetuneRange/7000000.0f)+0.7f);
+        valuesOne = sin(6.2831853f * mTime * freqs * rands) * amps * PARTIAL_AMP(rands, partialDetuneRange); // the last multiplier, using rands, is for random partial amplitudes, using same rands as for partial frequency multipliers
+        valuesTwo = sin(6.2831853f * mTime * freqs * rands * randStringMult) * amps * PARTIAL_AMP(rands, partialDetuneRange);
         
         // random white noise transient test
         
@@ -144,61 +216,742 @@ __kernel void oscillator(__global const float *voicesDataBuffer,
         valuesOne.s0 += fabs(rands.s0 - 1.0f) * pow(0.5f, mTime*50.0f) * 20.0f * mEnergy * mEnergy * (1.0f + mEnergy);
         //}
 
-            //rands = fabs(rands-1.0f) * 214.0f; // subtract 1 to center around 0, take abs so it's positive, and make it bigger - want it be (0,1) -->
-        rands = fabs(rands-1.0f) * 214.0f / partialDetuneRange / 7000000.0f; // subtract 1 to center around 0, take abs so it's positive, and make it bigger - want it be (0,1) --> this undoes the multiplication above at partialDetuneRange and scales the rands appropriately so they're (0,1) for L/R pan values
-
-
-            
         /// reverb wash (sound starts in mono and washes out to the sides, to random pan positions, as if traveling along the soundboard)
+        float one[4], two[4], pans[4];
+        vstore4(valuesOne, 0, one);
+        vstore4(valuesTwo, 0, two);
+        vstore4(PARTIAL_PAN(rands, partialDetuneRange), 0, pans);
+        float panSpeed = pan_speed(mTime);
         
-
+        // strings 1 and 2 to the left channel, then to the right
+        for (int k = 0; k < 4; k++) {
+            sampleL += one[k] * pan_left(pans[k], panSpeed);
+        }
+        for (int k = 0; k < 4; k++) {
+            sampleL += two[k] * pan_left(pans[string2Pans[k]], panSpeed);
+        }
+        for (int k = 0; k < 4; k++) {
+            sampleR += one[k] * pan_right(pans[k], panSpeed);
+        }
+        for (int k = 0; k < 4; k++) {
+            sampleR += two[k] * pan_right(pans[string2Pans[k]], panSpeed);
+        }
         
-        // pan speed multiplier
-        eyes.s0 = 5.0f * mTime + 1.0f; // I'm just re-using a float variable here to save memory -- nothing relevant about eyes in these following calculations // Also, 5.0f is the pan speed multiplier -- the higher that number, the faster the pans will wash out to the sides. 5.0f is a good medium value, not too fast, not too slow. Subtle, complex, realistic.
 
-        // add string 1 to left channel
-        sampleL += valuesOne.s0 * ((1.0f-rands.s0) - (0.5f - rands.s0)/eyes.s0);
-        sampleL += valuesOne.s1 * ((1.0f-rands.s1) - (0.5f - rands.s1)/eyes.s0);
-        sampleL += valuesOne.s2 * ((1.0f-rands.s2) - (0.5f - rands.s2)/eyes.s0);
-        sampleL += valuesOne.s3 * ((1.0f-rands.s3) - (0.5f - rands.s3)/eyes.s0);
-        // add string 2 to left channel
-        sampleL += valuesTwo.s0 * ((1.0f-rands.s2) - (0.5f - rands.s2)/eyes.s0);
-        sampleL += valuesTwo.s1 * ((1.0f-rands.s0) - (0.5f - rands.s0)/eyes.s0);
-        sampleL += valuesTwo.s2 * ((1.0f-rands.s3) - (0.5f - rands.s3)/eyes.s0);
-        sampleL += valuesTwo.s3 * ((1.0f-rands.s1) - (0.5f - rands.s1)/eyes.s0);
-        
-        // add string 1 to right channel
-        sampleR += valuesOne.s0 * ((rands.s0) - (rands.s0 - 0.5f)/eyes.s0);
-        sampleR += valuesOne.s1 * ((rands.s1) - (rands.s1 - 0.5f)/eyes.s0);
-        sampleR += valuesOne.s2 * ((rands.s2) - (rands.s2 - 0.5f)/eyes.s0);
-        sampleR += valuesOne.s3 * ((rands.s3) - (rands.s3 - 0.5f)/eyes.s0);
-        // add string 2 to right channel
-        sampleR += valuesTwo.s0 * ((rands.s2) - (rands.s2 - 0.5f)/eyes.s0);
-        sampleR += valuesTwo.s1 * ((rands.s0) - (rands.s0 - 0.5f)/eyes.s0);
-        sampleR += valuesTwo.s2 * ((rands.s3) - (rands.s3 - 0.5f)/eyes.s0);
-        sampleR += valuesTwo.s3 * ((rands.s1) - (rands.s1 - 0.5f)/eyes.s0);
-        
 
+    }
+    
+    return (float2)(sampleL, sampleR);
+}
 
+// one sample of one voice: the partials from firstPartial up, plus lowBands - the ones under firstPartial, already rendered at lower rates and
+// upsampled
+void oscillator_sample(int voiceID,
+                       int sampleIndex,
+                       int firstPartial,
+                       float2 lowBands,
+                       __global const RenderGroup *group,
+                       __global const float *voiceRecordBuffer,
+                       __global const uint *voiceOnsetBuffer,
+                       __global const int *activeSlotsBuffer,
+                       __global const float *partialTableBuffer,
+                       __global const float *voicesEnergyBuffer,
+                       __global float *voicesSampleBuffer) {
+    
+    __global float *voiceSamples = &voicesSampleBuffer[voiceID * MAX_BLOCK_SIZE * NUM_CHANNELS]; // each voice gets a max-size row, whatever its group's batch length
+    
+    int voiceSlot = activeSlotsBuffer[voiceID]; // the voice's stable slot - its record, partial table and energy row all live there for as long as it plays
+    int age = (int)(group->blockStartSample + (uint)sampleIndex - voiceOnsetBuffer[voiceSlot]); // samples since the note started (unsigned difference, so the sample clock can wrap)
+    
+    // the note hasn't started yet at this sample - stay silent rather than snapping the onset to the block boundary
+    if (age < 0) {
+        voiceSamples[NUM_CHANNELS * sampleIndex] = 0.0f;
+        voiceSamples[NUM_CHANNELS * sampleIndex + 1] = 0.0f;
+        return;
     }
     
+    float2 sample = voice_partials(voiceSlot, age, sampleIndex, firstPartial, MAX_PARTIALS, group, voiceRecordBuffer, partialTableBuffer, voicesEnergyBuffer) + lowBands;
+    
     // write this work-item's sample to global memory
     // only works in stereo (include an if statement to switch between stereo and mono)
-    voicesSampleBuffer[NUM_CHANNELS * (BLOCK_SIZE * voiceID + sampleIndex)] = sampleL * 0.15f; // was * 0.03f when using amps w/o mEnergy
-    voicesSampleBuffer[NUM_CHANNELS * (BLOCK_SIZE * voiceID + sampleIndex) + 1] = sampleR * 0.15f; // was * 0.03f when using amps w/o mEnergy
+    voiceSamples[NUM_CHANNELS * sampleIndex] = sample.x * 0.15f; // was * 0.03f when using amps w/o mEnergy
+    voiceSamples[NUM_CHANNELS * sampleIndex + 1] = sample.y * 0.15f; // was * 0.03f when using amps w/o mEnergy
+}
+
+
+/// multirate: band b holds a voice's partials that are low enough to render at 1/(2 << b) of the full rate (OpenCL::updateBands decides which,
+/// per batch) - voiceBandsBuffer[voiceID * MULTIRATE_BANDS + b] is where the band ends, and it starts where band b+1 ends (band 0 ends where
+/// the full-rate partials start). oscillator_bands renders them into bandSampleBuffer, and the oscillator kernel upsamples them and adds them in
+
+// floor(a / d), for ages before the onset too
+int floor_div(int a, int d) {
+    return (a >= 0 ? a : a - d + 1) / d;
+}
+
+// first low-rate sample (in the band's own count from the onset) a band renders for a batch starting blockAge samples into the note.
+// INTERPOLATOR_TAPS/2 of them lead in before the batch and as many run on after it, so the upsampler has every tap it needs without keeping
+// any history between batches - the partials are a function of time, so the band can just render a little past both ends
+int band_first_sample(int blockAge, int decimation) {
+    return floor_div(blockAge, decimation) - INTERPOLATOR_TAPS/2 + 1;
+}
+
+int band_first_partial(__global const int *voiceBands, int band) {
+    return band + 1 < MULTIRATE_BANDS ? voiceBands[band + 1] : 0;
 }
 
+// one low-rate sample of one band of one voice, BAND_STRIDE of them per band - the oscillator_bands kernel's work-items, or the persistent
+// renderer's steps through them
+void band_sample(int globalID,
+                 short BAND_STRIDE,
+                 __global const float *voiceRecordBuffer,
+                 __global const uint *voiceOnsetBuffer,
+                 __global const int *activeSlotsBuffer,
+                 __global const int *voiceGroupBuffer,
+                 __global const RenderGroup *groupBuffer,
+                 __global const float *partialTableBuffer,
+                 __global const float *voicesEnergyBuffer,
+                 __global const int *voiceBandsBuffer,
+                 __global float *bandSampleBuffer) {
+    
+    int row = globalID / BAND_STRIDE; // voiceID * MULTIRATE_BANDS + band
+    int index = globalID - BAND_STRIDE*row;
+    int voiceID = row / MULTIRATE_BANDS;
+    int band = row - MULTIRATE_BANDS*voiceID;
+    int decimation = 2 << band;
+    __global const int *voiceBands = &voiceBandsBuffer[voiceID * MULTIRATE_BANDS];
+    __global const RenderGroup *group = &groupBuffer[voiceGroupBuffer[voiceID]];
+    
+    int voiceSlot = activeSlotsBuffer[voiceID];
+    int blockAge = (int)(group->blockStartSample - voiceOnsetBuffer[voiceSlot]);
+    int firstSample = band_first_sample(blockAge, decimation);
+    int numSamples = floor_div(blockAge + group->frames - 1, decimation) + INTERPOLATOR_TAPS/2 + 1 - firstSample;
+    int firstPartial = band_first_partial(voiceBands, band);
+    
+    if (firstPartial >= voiceBands[band] || index >= numSamples) { // nothing in the band, or past its end
+        return;
+    }
+    int age = (firstSample + index) * decimation;
+    float2 sample = (float2)(0.0f, 0.0f);
+    if (age >= 0) { // the energy of the lead-in and run-on samples is the batch's first and last
+        sample = voice_partials(voiceSlot, age, clamp(age - blockAge, 0, group->frames - 1), firstPartial, voiceBands[band], group, voiceRecordBuffer, partialTableBuffer, voicesEnergyBuffer);
+    }
+    vstore2(sample, row * BAND_ROW_LENGTH + index, bandSampleBuffer);
+}
 
-__kernel void add_voices(__global float *voicesSampleBuffer, short NUM_ACTIVE_VOICES, short BLOCK_SIZE, short NUM_CHANNELS, __global float *outputSampleBuffer) {
+// one work-item per low-rate sample of each band of each voice, BAND_STRIDE of them per band (padded to whole work-groups, like the oscillator)
+__kernel void oscillator_bands(__global const float *voiceRecordBuffer,
+                               __global const uint *voiceOnsetBuffer,
+                               __global const int *activeSlotsBuffer,
+                               __global const int *voiceGroupBuffer,
+                               __global const RenderGroup *groupBuffer,
+                               __global const float *partialTableBuffer,
+                               __global const float *voicesEnergyBuffer,
+                               __global const int *voiceBandsBuffer,
+                               short BAND_STRIDE,
+                               __global float *bandSampleBuffer
+                               ) {
+    
+    band_sample(get_global_id(0), BAND_STRIDE, voiceRecordBuffer, voiceOnsetBuffer, activeSlotsBuffer, voiceGroupBuffer, groupBuffer, partialTableBuffer, voicesEnergyBuffer, voiceBandsBuffer, bandSampleBuffer);
+}
+
+// a voice's bands brought back up to the full rate at one sample - polyphase: where the sample falls between two low-rate samples picks one
+// phase of the interpolator, INTERPOLATOR_TAPS coefficients (see OpenCL::buildInterpolator)
+float2 upsample_bands(int voiceID,
+                      int age,
+                      int blockAge,
+                      __global const int *voiceBandsBuffer,
+                      __global const float *bandSampleBuffer,
+                      __global const float *interpolatorBuffer) {
+    
+    float2 sample = (float2)(0.0f, 0.0f);
+    __global const int *voiceBands = &voiceBandsBuffer[voiceID * MULTIRATE_BANDS];
+    
+    for (int band = 0; band < MULTIRATE_BANDS; band++) {
+        if (band_first_partial(voiceBands, band) >= voiceBands[band]) {
+            continue;
+        }
+        int decimation = 2 << band;
+        int center = age / decimation;
+        int phase = age - center * decimation;
+        int firstTap = center - INTERPOLATOR_TAPS/2 + 1 - band_first_sample(blockAge, decimation);
+        int row = voiceID * MULTIRATE_BANDS + band;
+        __global const float *coefficients = &interpolatorBuffer[(band * MAX_DECIMATION + phase) * INTERPOLATOR_TAPS];
+        for (int tap = 0; tap < INTERPOLATOR_TAPS; tap++) {
+            sample += coefficients[tap] * vload2(row * BAND_ROW_LENGTH + firstTap + tap, bandSampleBuffer);
+        }
+    }
+    return sample;
+}
+
+
+/// wavetables: a voice whose partials all sit at n times its fundamental (OpenCL::isWavetableVoice) repeats itself every period but for the
+/// energy, so it gets baked into one-period tables, WAVETABLE_LAYERS levels of the energy curve of them, and played back from those. each table
+/// sample is a float4: the partials added up as they are, weighted by string 1's pans, and weighted by string 2's (.w is padding)
+
+// one sample of one layer of one wavetable being baked, WAVETABLE_LENGTH of them per layer (the shorter layers' tails just return). the spectrum
+// comes from OpenCL::buildWavetable - n times the sample's phase goes by the angle-addition recurrence, partial to partial
+void bake_sample(int globalID,
+                 __global const int *bakeEntryBuffer,
+                 __global const WavetableInfo *wavetableInfoBuffer,
+                 __global const float *spectrumBuffer,
+                 __global float4 *wavetableBuffer) {
+    
+    int row = globalID / WAVETABLE_LENGTH; // bake * WAVETABLE_LAYERS + layer
+    int index = globalID - WAVETABLE_LENGTH*row;
+    int bake = row / WAVETABLE_LAYERS;
+    int layer = row - WAVETABLE_LAYERS*bake;
+    int entry = bakeEntryBuffer[bake];
+    __global const WavetableInfo *info = &wavetableInfoBuffer[entry];
+    int length = info->lengths[layer];
+    
+    if (index >= length) {
+        return;
+    }
+    __global const float *spectrum = &spectrumBuffer[row * WAVETABLE_MAX_PARTIALS * 3];
+    float stepCos;
+    float stepSin = sincos(6.2831853f * (float)index / (float)length, &stepCos);
+    float partialCos = stepCos;
+    float partialSin = stepSin;
+    float3 sum = (float3)(0.0f, 0.0f, 0.0f);
+    for (int i = 0; i < info->partials[layer]; i++) {
+        sum += vload3(i, spectrum) * partialSin;
+        float nextCos = partialCos * stepCos - partialSin * stepSin;
+        partialSin = partialSin * stepCos + partialCos * stepSin;
+        partialCos = nextCos;
+    }
+    wavetableBuffer[(entry * WAVETABLE_LAYERS + layer) * WAVETABLE_LENGTH + index] = (float4)(sum, 0.0f);
+}
+
+// one work-item per sample of each layer of each wavetable being baked
+__kernel void bake_wavetables(__global const int *bakeEntryBuffer,
+                              __global const WavetableInfo *wavetableInfoBuffer,
+                              __global const float *spectrumBuffer,
+                              __global float4 *wavetableBuffer
+                              ) {
+    
+    bake_sample(get_global_id(0), bakeEntryBuffer, wavetableInfoBuffer, spectrumBuffer, wavetableBuffer);
+}
+
+// a layer at a phase (in cycles, 0..1) - linearly interpolated between its samples, and wrapped round
+float4 wavetable_lookup(__global const float4 *layer, int length, float phase) {
+    float position = phase * (float)length;
+    int index = (int)position;
+    return mix(layer[index & (length - 1)], layer[(index + 1) & (length - 1)], position - (float)index);
+}
+
+// one sample of one wavetable voice - what voice_partials would add up, with every partial at n times the fundamental: the energy curve picks the
+// two layers either side of it, crossfaded, and each string's phase its place in them. string 2 reads the same tables, randStringMult times as
+// fast, with its own pans in .z. the pans wash out and the transient goes on top the same way as there
+void wavetable_sample(int voiceID,
+                      int sampleIndex,
+                      __global const WavetableInfo *info,
+                      __global const float4 *wavetable,
+                      __global const RenderGroup *group,
+                      __global const float *voiceRecordBuffer,
+                      __global const uint *voiceOnsetBuffer,
+                      __global const int *activeSlotsBuffer,
+                      __global const float *voicesEnergyBuffer,
+                      __global float *voicesSampleBuffer) {
+    
+    __global float *voiceSamples = &voicesSampleBuffer[voiceID * MAX_BLOCK_SIZE * NUM_CHANNELS];
+    
+    int voiceSlot = activeSlotsBuffer[voiceID];
+    int age = (int)(group->blockStartSample + (uint)sampleIndex - voiceOnsetBuffer[voiceSlot]);
+    float2 sample = (float2)(0.0f, 0.0f);
+    
+    if (age >= 0) {
+        __global const float *instrumentDataBuffer = group->instrumentData;
+        float mTime = group->timeStep * (float)age;
+        float mFrequency = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS];
+        float mVelocity = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+1];
+        float randStringMult = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+2];
+        float mEnergy = voicesEnergyBuffer[voiceSlot*MAX_BLOCK_SIZE + sampleIndex];
+        
+        float mB = voice_inharmonicity(group->mB, mFrequency, mVelocity, mTime);
+        float fundamental = (2.0f * instrumentDataBuffer[5] + 0.02f * instrumentDataBuffer[6]) * mFrequency * sqrt(1.0f + mB); // partial 1, without its detune
+        float energyCurve = mEnergy*(instrumentDataBuffer[0] + mEnergy*(instrumentDataBuffer[1] + mEnergy*(instrumentDataBuffer[2])));
+        
+        // the pans multiplied out - so the pan-weighted sums in the tables can go in as they are
+        float3 panTerms = pan_terms(pan_speed(mTime));
+        float panFixedL = panTerms.x;
+        float panFixedR = panTerms.y;
+        float panSlope = panTerms.z;
+        
+        float transient = pow(0.5f, mTime*50.0f) * 20.0f * mEnergy * mEnergy * (1.0f + mEnergy);
+        sample.x = transient * (info->transientMono * panFixedL - info->transientPan * panSlope);
+        sample.y = transient * (info->transientMono * panFixedR + info->transientPan * panSlope);
+        
+        if (energyCurve > 0.0f) {
+            // layer k is firstStep * (ratio^k - 1) / (ratio - 1) under the top one, in log energy curve. under the bottom one, it's just turned down
+            float ratio = info->ratio;
+            float depth = fmax(info->topLogEnergy - log(energyCurve), 0.0f);
+            int layer = min((int)(log(1.0f + depth * (ratio - 1.0f) / info->firstStep) / log(ratio)), WAVETABLE_LAYERS - 1);
+            float layerDepth = info->firstStep * (pown(ratio, layer) - 1.0f) / (ratio - 1.0f);
+            float blend = 0.0f;
+            float gain = 1.0f;
+            if (layer == WAVETABLE_LAYERS - 1) {
+                gain = exp((layerDepth - depth) * info->bottomExponent);
+            } else {
+                blend = clamp((depth - layerDepth) / (info->firstStep * pown(ratio, layer)), 0.0f, 1.0f);
+            }
+            
+            float cycles = mTime * fundamental;
+            float phaseOne = cycles - floor(cycles);
+            float phaseTwo = cycles * randStringMult - floor(cycles * randStringMult);
+            __global const float4 *upper = &wavetable[layer * WAVETABLE_LENGTH];
+            float4 one = wavetable_lookup(upper, info->lengths[layer], phaseOne);
+            float4 two = wavetable_lookup(upper, info->lengths[layer], phaseTwo);
+            if (blend > 0.0f) {
+                __global const float4 *lower = upper + WAVETABLE_LENGTH;
+                one = mix(one, wavetable_lookup(lower, info->lengths[layer + 1], phaseOne), blend);
+                two = mix(two, wavetable_lookup(lower, info->lengths[layer + 1], phaseTwo), blend);
+            }
+            float mono = (one.x + two.x) * gain;
+            float panned = (one.y + two.z) * gain;
+            sample.x += mono * panFixedL - panned * panSlope;
+            sample.y += mono * panFixedR + panned * panSlope;
+        }
+    }
+    
+    voiceSamples[NUM_CHANNELS * sampleIndex] = sample.x * 0.15f;
+    voiceSamples[NUM_CHANNELS * sampleIndex + 1] = sample.y * 0.15f;
+}
+
+
+// one sample of one voice in the dispatch, VOICE_STRIDE of them per voice - from its wavetables, or its partials plus its upsampled bands
+void voice_sample(int globalID,
+                  short VOICE_STRIDE,
+                  __global const float *voiceRecordBuffer,
+                  __global const uint *voiceOnsetBuffer,
+                  __global const int *activeSlotsBuffer,
+                  __global const int *voiceGroupBuffer,
+                  __global const RenderGroup *groupBuffer,
+                  __global const float *partialTableBuffer,
+                  __global const float *voicesEnergyBuffer,
+                  __global const int *voiceBandsBuffer,
+                  __global const float *bandSampleBuffer,
+                  __global const float *interpolatorBuffer,
+                  __global float *voicesSampleBuffer,
+                  __global const int *voiceWavetableBuffer,
+                  __global const WavetableInfo *wavetableInfoBuffer,
+                  __global const float4 *wavetableBuffer) {
+    
+    int voiceID = globalID / VOICE_STRIDE; // find which voice # this work-item is calculating a sample for (dense, among this dispatch's active voices)
+    int sampleIndex = globalID - (VOICE_STRIDE*voiceID);// sample index/offset within this voice (VOICE_STRIDE is the longest batch in the dispatch, padded to whole work-groups so none of them spans two voices)
+    __global const RenderGroup *group = &groupBuffer[voiceGroupBuffer[voiceID]];
+    
+    if (sampleIndex >= group->frames) { // past the end of a shorter batch, or in the padding
+        return;
+    }
+    int wavetable = voiceWavetableBuffer[voiceID]; // the same for the whole work-group, like everything else per voice
+    if (wavetable >= 0) {
+        wavetable_sample(voiceID, sampleIndex, &wavetableInfoBuffer[wavetable], &wavetableBuffer[wavetable * WAVETABLE_LAYERS * WAVETABLE_LENGTH], group, voiceRecordBuffer, voiceOnsetBuffer, activeSlotsBuffer, voicesEnergyBuffer, voicesSampleBuffer);
+        return;
+    }
+    int blockAge = (int)(group->blockStartSample - voiceOnsetBuffer[activeSlotsBuffer[voiceID]]);
+    float2 lowBands = (float2)(0.0f, 0.0f);
+    if (blockAge + sampleIndex >= 0) {
+        lowBands = upsample_bands(voiceID, blockAge + sampleIndex, blockAge, voiceBandsBuffer, bandSampleBuffer, interpolatorBuffer);
+    }
+    oscillator_sample(voiceID, sampleIndex, voiceBandsBuffer[voiceID * MULTIRATE_BANDS], lowBands, group, voiceRecordBuffer, voiceOnsetBuffer, activeSlotsBuffer, partialTableBuffer, voicesEnergyBuffer, voicesSampleBuffer);
+}
+
+__kernel void oscillator(__global const float *voiceRecordBuffer,
+                         __global const uint *voiceOnsetBuffer,
+                         __global const int *activeSlotsBuffer,
+                         __global const int *voiceGroupBuffer,
+                         __global const RenderGroup *groupBuffer,
+                         __global const float *partialTableBuffer,
+                         __global const float *voicesEnergyBuffer,
+                         __global const int *voiceBandsBuffer,
+                         __global const float *bandSampleBuffer,
+                         __global const float *interpolatorBuffer,
+                         short VOICE_STRIDE,
+                         __global float *voicesSampleBuffer,
+                         __global const int *voiceWavetableBuffer,
+                         __global const WavetableInfo *wavetableInfoBuffer,
+                         __global const float4 *wavetableBuffer
+                         ) {
+    
+    voice_sample(get_global_id(0), VOICE_STRIDE, voiceRecordBuffer, voiceOnsetBuffer, activeSlotsBuffer, voiceGroupBuffer, groupBuffer, partialTableBuffer, voicesEnergyBuffer, voiceBandsBuffer,
+                 bandSampleBuffer, interpolatorBuffer, voicesSampleBuffer, voiceWavetableBuffer, wavetableInfoBuffer, wavetableBuffer);
+}
+
+
+#if MODAL_RESONATORS // only built in when it's in use (a -D build option, like the sizes)
+
+/// the modal engine (MODAL_RESONATORS): each partial of each string is a two-pole resonator - the pole pair r * e^(+-iw), kept as a (cos, sin)
+/// state that gets turned by w and shrunk by r every sample. that's all of the oscillation and all of the decay, four multiply-adds a sample
+/// with no sin or pow - w and r only get worked out once a batch. the state stays on the device from one batch to the next (modeStateBuffer,
+/// a float4 per partial per slot: string 1's cos and sin, then string 2's), and the only excitation is the hammer, through the force rows
+
+#define MODAL_ITEM_PARTIALS (MAX_PARTIALS / MODAL_GROUP_SIZE)
+
+// the hammer pushes each string along in the phase it's already in (a string at rest starts at phase 0, like sin(wt) at the onset) - what
+// it puts in is amplitude, the way VoiceManager::updateVoiceDampingAndEnergy puts in energy. as a force, a 5ms gaussian would hardly get
+// the upper partials going at all
+float4 modal_push(float4 state, float push) {
+    float one = dot(state.xy, state.xy);
+    float two = dot(state.zw, state.zw);
+    state.xy = one > 0.0f ? state.xy * (1.0f + push * rsqrt(one)) : (float2)(push, 0.0f);
+    state.zw = two > 0.0f ? state.zw * (1.0f + push * rsqrt(two)) : (float2)(push, 0.0f);
+    return state;
+}
+
+// one work-group of MODAL_GROUP_SIZE work-items per voice, each one running every MODAL_GROUP_SIZE-th partial of it through the batch, MODAL_CHUNK
+// samples at a time. each chunk gets added up across the work-group in local memory, and the first MODAL_CHUNK work-items pan it and put the
+// transient on top, the same way wavetable_sample does. partial n's pole is w = its frequency in the middle of the batch (the inharmonicity
+// only moves as the strike wears off, and the pitch bend between batches), and r = the energy curve's decay to its exponent, so it dies away
+// the way its amplitude does in the additive engine - the higher it is, the faster. the hammer's energy comes in to the exponent of the
+// level it takes the string to, so a harder strike is brighter
+__kernel void modal_resonators(__global const float *voiceRecordBuffer,
+                               __global const uint *voiceOnsetBuffer,
+                               __global const int *activeSlotsBuffer,
+                               __global const int *voiceGroupBuffer,
+                               __global const RenderGroup *groupBuffer,
+                               __global const float *partialTableBuffer,
+                               __global const float *voicesEnergyBuffer,
+                               __global const float *voicesForceBuffer,
+                               __global const ModalVoice *voiceModesBuffer,
+                               __global float4 *modeStateBuffer,
+                               __global float *voicesSampleBuffer
+                               ) {
+    
+    __local float2 sums[MODAL_GROUP_SIZE * MODAL_CHUNK]; // each work-item's (unpanned, pan-weighted) sum of its partials, for each sample of the chunk
+    __local float2 transientWeights;
+    
+    int voiceID = get_group_id(0);
+    int item = get_local_id(0);
+    __global const RenderGroup *group = &groupBuffer[voiceGroupBuffer[voiceID]];
+    __global const ModalVoice *modes = &voiceModesBuffer[voiceID];
+    __global const float *instrumentDataBuffer = group->instrumentData;
+    __global float *voiceSamples = &voicesSampleBuffer[voiceID * MAX_BLOCK_SIZE * NUM_CHANNELS];
+    
+    int voiceSlot = activeSlotsBuffer[voiceID];
+    int blockAge = (int)(group->blockStartSample - voiceOnsetBuffer[voiceSlot]);
+    int frames = group->frames;
+    float mTimeStep = group->timeStep;
+    float mFrequency = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS];
+    float mVelocity = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+1];
+    float randStringMult = voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+2];
+    __global const float *partialRands = &partialTableBuffer[voiceSlot*MAX_PARTIALS];
+    __global const float *energy = &voicesEnergyBuffer[voiceSlot*MAX_BLOCK_SIZE];
+    __global const float *force = &voicesForceBuffer[voiceSlot*MAX_BLOCK_SIZE];
+    __global float4 *modeStates = &modeStateBuffer[voiceSlot*MAX_PARTIALS];
+    
+    // as many partials as the additive engine renders, in 4s the same way
+    int numPartials = min(group->numPartials, (int)(group->partialCeiling / mFrequency));
+    numPartials = min((numPartials + 3) / 4 * 4, MAX_PARTIALS);
+    
+    float mTime = mTimeStep * (float)max(blockAge + frames / 2, 0);
+    float mB = voice_inharmonicity(group->mB, mFrequency, mVelocity, mTime);
+    float mBrightnessA = 1.0f - instrumentDataBuffer[3];
+    float mBrightnessB = 10000.0f * instrumentDataBuffer[4];
+    float mPitchBendCoarse = 2.0f * instrumentDataBuffer[5];
+    float mPitchBendFine = 0.02f * instrumentDataBuffer[6];
+    float partialDetuneRange = group->partialDetuneRange / 7000000.0f;
+    
+    float4 rotations[MODAL_ITEM_PARTIALS]; // r cos w, r sin w for each string
+    float3 weights[MODAL_ITEM_PARTIALS]; // the random partial amplitude, and that times each string's pan
+    float drives[MODAL_ITEM_PARTIALS]; // amplitude per unit of the hammer's energy
+    float resets[MODAL_ITEM_PARTIALS]; // what's left of the amplitude at a strike this batch
+    float4 states[MODAL_ITEM_PARTIALS];
+    float2 transientWeight = (float2)(0.0f, 0.0f);
+    
+    for (int m = 0; m < MODAL_ITEM_PARTIALS; m++) {
+        int i = item + m * MODAL_GROUP_SIZE;
+        if (i < numPartials) {
+            float rand = partialRands[i];
+            float eye = (float)i + 1.0f;
+            float freq = PARTIAL_FREQUENCY(eye, mFrequency, mB, mPitchBendCoarse, mPitchBendFine);
+            float exponent = pow(eye, mBrightnessA) + freq/mBrightnessB;
+            float cosOne, cosTwo;
+            float sinOne = sincos(6.2831853f * mTimeStep * freq * rand, &cosOne);
+            float sinTwo = sincos(6.2831853f * mTimeStep * freq * rand * randStringMult, &cosTwo);
+            rotations[m] = exp(exponent * modes->logDecay) * (float4)(cosOne, sinOne, cosTwo, sinTwo);
+            float pan = PARTIAL_PAN(rand, partialDetuneRange);
+            float panTwo = PARTIAL_PAN(partialRands[i / 4 * 4 + string2Pans[i % 4]], partialDetuneRange);
+            weights[m] = PARTIAL_AMP(rand, partialDetuneRange) * (float3)(1.0f, pan, panTwo);
+            drives[m] = exp(exponent * modes->strikeLogEnergy) * modes->strikeScale;
+            resets[m] = exp(exponent * modes->resetLogEnergy);
+            states[m] = modeStates[i];
+            if (i % 4 == 0) {
+                transientWeight += fabs(rand - 1.0f) * (float2)(1.0f, pan);
+            }
+        }
+    }
+    
+    // the transient's weights (|rand - 1| of every 4th partial, and that pan-weighted) get added up once
+    sums[item] = transientWeight;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (item == 0) {
+        transientWeight = (float2)(0.0f, 0.0f);
+        for (int l = 0; l < MODAL_GROUP_SIZE; l++) {
+            transientWeight += sums[l];
+        }
+        transientWeights = transientWeight;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    for (int chunk = 0; chunk < frames; chunk += MODAL_CHUNK) {
+        float pushes[MODAL_CHUNK];
+        float2 chunkSums[MODAL_CHUNK];
+        for (int k = 0; k < MODAL_CHUNK; k++) {
+            pushes[k] = force[chunk + k];
+            chunkSums[k] = (float2)(0.0f, 0.0f);
+        }
+        for (int m = 0; m < MODAL_ITEM_PARTIALS; m++) {
+            if (item + m * MODAL_GROUP_SIZE < numPartials) {
+                float4 rotation = rotations[m];
+                float4 state = states[m];
+                for (int k = 0; k < MODAL_CHUNK; k++) {
+                    if (chunk + k == modes->resetSample) {
+                        state = modes->clearModes ? (float4)(0.0f, 0.0f, 0.0f, 0.0f) : state * resets[m];
+                    }
+                    state = (float4)(rotation.x * state.x - rotation.y * state.y,
+                                     rotation.y * state.x + rotation.x * state.y,
+                                     rotation.z * state.z - rotation.w * state.w,
+                                     rotation.w * state.z + rotation.z * state.w);
+                    if (pushes[k] > 0.0f) { // only while the hammer's on the string - the same for the whole work-group
+                        state = modal_push(state, pushes[k] * drives[m]);
+                    }
+                    chunkSums[k] += (float2)(weights[m].x * (state.y + state.w), weights[m].y * state.y + weights[m].z * state.w);
+                }
+                states[m] = state;
+            }
+        }
+        for (int k = 0; k < MODAL_CHUNK; k++) {
+            sums[item * MODAL_CHUNK + k] = chunkSums[k];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        
+        if (item < MODAL_CHUNK) {
+            float2 sum = (float2)(0.0f, 0.0f);
+            for (int l = 0; l < MODAL_GROUP_SIZE; l++) {
+                sum += sums[l * MODAL_CHUNK + item];
+            }
+            int sampleIndex = chunk + item;
+            int age = blockAge + sampleIndex;
+            float2 sample = (float2)(0.0f, 0.0f);
+            if (age >= 0) { // the note hasn't started yet otherwise - whatever the slot's last note left gets cleared at the onset
+                float sampleTime = mTimeStep * (float)age;
+                float mEnergy = energy[sampleIndex];
+                float3 panTerms = pan_terms(pan_speed(sampleTime));
+                float transient = pow(0.5f, sampleTime*50.0f) * 20.0f * mEnergy * mEnergy * (1.0f + mEnergy);
+                float mono = sum.x + transient * transientWeights.x;
+                float panned = sum.y + transient * transientWeights.y;
+                sample = (float2)(mono * panTerms.x - panned * panTerms.z, mono * panTerms.y + panned * panTerms.z);
+            }
+            voiceSamples[NUM_CHANNELS * sampleIndex] = sample.x * 0.15f;
+            voiceSamples[NUM_CHANNELS * sampleIndex + 1] = sample.y * 0.15f;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    
+    // the partials the voice doesn't have (now) are left at rest, so they start from nothing if it gets them back
+    for (int m = 0; m < MODAL_ITEM_PARTIALS; m++) {
+        int i = item + m * MODAL_GROUP_SIZE;
+        modeStates[i] = i < numPartials ? states[m] : (float4)(0.0f, 0.0f, 0.0f, 0.0f);
+    }
+}
+
+#endif // MODAL_RESONATORS
+
+
+// builds the partial table of each listed voice slot - the xorshift sequence the oscillator kernel used to regenerate for every sample, seeded
+// by the voice's random seed. runs when a note starts (or gets stolen) and when the partial detune range changes, not every block
+void build_partial_table(int voiceSlot, __global const float *voiceRecordBuffer, float partialDetuneRange, __global float *partialTableBuffer) {
+    
+    short x = (short)voiceRecordBuffer[voiceSlot*NUM_VOICE_PARAMS+3]; // random seed
+    
+    partialDetuneRange /= 7000000.0f;
+    
+    for (int i = 0; i < MAX_PARTIALS; i++) {
+        // xorshift deterministic RNG
+        x = x ^ (x << 21);
+        x = x ^ (x >> 35);
+        x = x ^ (x << 4);
+        partialTableBuffer[voiceSlot*MAX_PARTIALS + i] = (float)x * partialDetuneRange + 1.0f; // 10,000,000 is very subtle
+    }
+}
+
+__kernel void init_partials(__global const float *voiceRecordBuffer, __global const int *initSlotsBuffer, float partialDetuneRange, __global float *partialTableBuffer) {
+    
+    build_partial_table(initSlotsBuffer[get_global_id(0)], voiceRecordBuffer, partialDetuneRange, partialTableBuffer);
+}
+
+
+// one output sample (one channel of one frame) of one group - adds up that sample of each of the group's voices
+// the voices' sum for one output sample, and each voice's peak level (for the host to retire voices nobody can hear) on the way: the largest
+// |sample| goes into peaks as a uint - floats >= 0 order the same way as their bits. reading peaks before the atomic is a race, but a stale
+// value can only be lower, so all it costs is an atomic that didn't need doing
+void mix_voices(int frame, int channel, __global const RenderGroup *group, __global const float *voicesSampleBuffer, __global float *outputSlice, __local uint *peaks) {
     
-    int globalID = get_global_id(0);
     float sample = 0.0f;
     
-    // this adder kernel - first work-item adds up first sample of left channel of voice 1, voice 2, etc., second work-item adds up first sample of right channel of voice 1, voice 2, etc.,...
+    for (int i = 0; i < group->numVoices; i++) {
+        float voiceSample = voicesSampleBuffer[(group->firstVoice + i) * MAX_BLOCK_SIZE * NUM_CHANNELS + frame * NUM_CHANNELS + channel];
+        uint level = as_uint(fabs(voiceSample));
+        if (level > peaks[i]) {
+            atomic_max(&peaks[i], level);
+        }
+        sample += voiceSample;
+    }
+    // write back to global memory - planar (all of the left channel, then all of the right) so the host can convert it straight into its output buffers.
+    // not clipped: other devices and the CPU may have some of the instance's voices too, so the host clips once it's summed them all
+    outputSlice[channel * group->frames + frame] = sample;
+}
+
+// one work-item per output sample of each group, MAX_FRAMES * NUM_CHANNELS per group. the host picks a work-group size that divides
+// MAX_FRAMES * NUM_CHANNELS, so a work-group never straddles two groups: it takes its voices' peaks in local memory, and merges them into
+// voicesPeakBuffer (zeroed by the host, same uint trick) with one global atomic per voice
+__kernel void add_voices(__global const float *voicesSampleBuffer, __global const RenderGroup *groupBuffer, short MAX_FRAMES, __global float *outputSampleBuffer, __global uint *voicesPeakBuffer) {
+    
+    __local uint peaks[MAX_VOICES];
+    
+    int globalID = get_global_id(0);
+    int groupID = globalID / (MAX_FRAMES * NUM_CHANNELS);
+    int index = globalID - groupID * MAX_FRAMES * NUM_CHANNELS;
+    int frame = index / NUM_CHANNELS;
+    __global const RenderGroup *group = &groupBuffer[groupID];
+    
+    for (int i = get_local_id(0); i < group->numVoices; i += get_local_size(0)) {
+        peaks[i] = 0;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    // no early return for the frames past the group's batch - every work-item has to get to the barriers
+    if (frame < group->frames) {
+        mix_voices(frame, index % NUM_CHANNELS, group, voicesSampleBuffer, &outputSampleBuffer[group->outputOffset], peaks);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    
+    for (int i = get_local_id(0); i < group->numVoices; i += get_local_size(0)) {
+        if (peaks[i] > 0) {
+            atomic_max(&voicesPeakBuffer[group->firstVoice + i], peaks[i]);
+        }
+    }
+}
+
+
+#if PERSISTENT_KERNEL // only built in when it's opted into (a -D build option, like the modal engine)
+
+/// the persistent renderer (PERSISTENT_KERNEL): one work-group gets launched once per device and stays resident, polling a mailbox in host-mapped
+/// memory. when the host rings the doorbell for a round, it renders the whole dispatch the way the kernels above do - partial tables, bakes,
+/// bands, voices, then each group's mix - and posts the round back as completed. barriers only sync within a work-group, which is why there's
+/// just the one. OpenCL 1.2 doesn't promise a running kernel sees the host's writes to a mapped buffer, so GPUService only uses this on devices
+/// that work out of host memory, and only once a probe round has come back right
+
+// everything a dispatch sends the device and gets back - keep in sync with RenderMailbox in GPUService.h
+typedef struct {
+    int requestedRound; // doorbell - the host bumps it once everything below is in for the round
+    int completedRound; // set to the round just finished, once the results are in
+    int quit;
+    int probe; // copied to probeEcho every round, so the host can tell its writes are getting through
+    int probeEcho;
+    int numGroups;
+    int numActiveVoices;
+    int maxFrames;
+    int hasBands;
+    int numInitSlots;
+    int numBakes;
+    RenderGroup groups[MAX_INSTANCES];
+    int activeSlots[MAX_SLOTS];
+    int voiceGroups[MAX_SLOTS];
+    int voiceBands[MAX_SLOTS*MULTIRATE_BANDS];
+    int voiceWavetables[MAX_SLOTS];
+    int initSlots[MAX_SLOTS];
+    float initDetuneRanges[MAX_SLOTS]; // the detune range of the instance each of them belongs to
+    int bakeEntries[WAVETABLE_BAKES];
+    float voiceRecords[MAX_SLOTS*NUM_VOICE_PARAMS];
+    uint voiceOnsets[MAX_SLOTS];
+    float voicesEnergy[MAX_SLOTS*MAX_BLOCK_SIZE];
+    WavetableInfo wavetableInfos[WAVETABLE_CACHE_ENTRIES];
+    float wavetableSpectra[WAVETABLE_BAKES*WAVETABLE_SPECTRUM_SIZE];
+    float outputSamples[MAX_INSTANCES*MAX_BLOCK_SIZE*NUM_CHANNELS];
+    uint voicesPeak[MAX_SLOTS]; // float bits, like voicesPeakBuffer
+} RenderMailbox;
+
+__kernel void persistent_renderer(__global RenderMailbox *mailbox,
+                                  __global float *partialTableBuffer,
+                                  __global float *voicesSampleBuffer,
+                                  __global float *bandSampleBuffer,
+                                  __global const float *interpolatorBuffer,
+                                  __global float4 *wavetableBuffer
+                                  ) {
+    
+    __local int round;
+    __local uint peaks[MAX_VOICES];
+    
+    int item = get_local_id(0);
+    int items = get_local_size(0);
+    int lastRound = mailbox->completedRound;
     
-    for (short i = 0; i < NUM_ACTIVE_VOICES; i++) {
-        sample += voicesSampleBuffer[i * BLOCK_SIZE * NUM_CHANNELS + globalID];
+    for (;;) {
+        // one work-item polls the doorbell (atomics, so it goes out to memory every time), the rest wait at the barrier. quit only counts once
+        // there's nothing left to render
+        if (item == 0) {
+            int requested;
+            do {
+                requested = atomic_add(&mailbox->requestedRound, 0);
+            } while (requested == lastRound && atomic_add(&mailbox->quit, 0) == 0);
+            round = requested == lastRound ? -1 : requested;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+        if (round < 0) {
+            return;
+        }
+        lastRound = round;
+        int numActiveVoices = mailbox->numActiveVoices;
+        short maxFrames = (short)mailbox->maxFrames;
+        short bandStride = (short)(maxFrames / 2 + INTERPOLATOR_TAPS + 1);
+        
+        // new notes' partial tables and new wavetables first - each step only reads what the ones before it wrote, so a barrier between them does
+        for (int i = item; i < mailbox->numInitSlots; i += items) {
+            build_partial_table(mailbox->initSlots[i], mailbox->voiceRecords, mailbox->initDetuneRanges[i], partialTableBuffer);
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        for (int i = item; i < mailbox->numBakes * WAVETABLE_LAYERS * WAVETABLE_LENGTH; i += items) {
+            bake_sample(i, mailbox->bakeEntries, mailbox->wavetableInfos, mailbox->wavetableSpectra, wavetableBuffer);
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        if (mailbox->hasBands) {
+            for (int i = item; i < bandStride * MULTIRATE_BANDS * numActiveVoices; i += items) {
+                band_sample(i, bandStride, mailbox->voiceRecords, mailbox->voiceOnsets, mailbox->activeSlots, mailbox->voiceGroups, mailbox->groups, partialTableBuffer, mailbox->voicesEnergy,
+                            mailbox->voiceBands, bandSampleBuffer);
+            }
+            barrier(CLK_GLOBAL_MEM_FENCE);
+        }
+        for (int i = item; i < maxFrames * numActiveVoices; i += items) {
+            voice_sample(i, maxFrames, mailbox->voiceRecords, mailbox->voiceOnsets, mailbox->activeSlots, mailbox->voiceGroups, mailbox->groups, partialTableBuffer, mailbox->voicesEnergy,
+                         mailbox->voiceBands, bandSampleBuffer, interpolatorBuffer, voicesSampleBuffer, mailbox->voiceWavetables, mailbox->wavetableInfos, wavetableBuffer);
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        
+        // a group at a time, so the voices' peaks can be taken in local memory the way add_voices does - and since it's all one work-group, they
+        // go straight out
+        for (int g = 0; g < mailbox->numGroups; g++) {
+            __global const RenderGroup *group = &mailbox->groups[g];
+            for (int i = item; i < group->numVoices; i += items) {
+                peaks[i] = 0;
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+            for (int i = item; i < group->frames * NUM_CHANNELS; i += items) {
+                mix_voices(i / NUM_CHANNELS, i % NUM_CHANNELS, group, voicesSampleBuffer, &mailbox->outputSamples[group->outputOffset], peaks);
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+            for (int i = item; i < group->numVoices; i += items) {
+                mailbox->voicesPeak[group->firstVoice + i] = peaks[i];
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+        barrier(CLK_GLOBAL_MEM_FENCE);
+        
+        if (item == 0) {
+            mailbox->probeEcho = mailbox->probe;
+            atomic_xchg(&mailbox->completedRound, round);
+        }
     }
-    // write back to global memory
-    outputSampleBuffer[globalID] = sample;
-}
\ No newline at end of file
+}
+
+#endif // PERSISTENT_KERNEL
@@ -52,7 +52,7 @@ instrument determined by PLUG _IS _INST
 #define PLUG_CHANNEL_IO "0-1 0-2"
 #endif
 
-#define PLUG_LATENCY 0
+#define PLUG_LATENCY 256 // one max-size engine block (DEFAULT_MAX_BLOCK_SIZE) - the constructor also calls SetLatency() with the real value
 #define PLUG_IS_INST 1 // is this is an instrument plugin?
 
 // if this is 0 RTAS can't get tempo info
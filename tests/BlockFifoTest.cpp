@@ -0,0 +1,164 @@
+//
+//  BlockFifoTest.cpp
+//  Synthesis
+//
+//  Drives the block FIFO adapter (BlockFifo) and a real VoiceManager with odd and varying host buffer sizes, the way hosts do, and checks
+//  that the output doesn't depend on them: every schedule has to come out the same as the reference (host buffers of one MIN_BLOCK_SIZE
+//  block) - a dropped or doubled frame, or a carried-over block losing its energy rows (VoiceManager::renderBatch's hold / restore), shows
+//  up as a difference. after every host buffer, the frames waiting in the output ring plus the frames of the block being built have to
+//  make up exactly the latency.
+//
+//  voices go to the CPU (CPU_VOICES=1), so the result doesn't depend on the cost model or on there being a GPU. `make` in tests/ builds it
+//  and runs it from the project directory (see tests/Makefile for WDL, BOOST and OPENCL); it prints each schedule's
+//  largest difference and returns non-zero if any check fails.
+//
+
+#include "../BlockFifo.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+#define TEST_FRAMES 30000
+#define TEST_TOLERANCE 2e-3 // largest difference to the reference: the multirate bands hold the energy at the edges of a batch, so how blocks
+                            // get batched moves things by ~7e-4 at most - a dropped or repeated frame is hundreds of times that
+
+struct TestEvent {
+    int frame;
+    int noteNumber;
+    int velocity; // 0 = note off
+};
+
+// frames where notes start and stop - a repeated note (re-excited in place) and a release in there too
+static const TestEvent testEvents[] = {
+    { 100, 72, 100 },
+    { 1000, 76, 90 },
+    { 1000, 79, 70 },
+    { 5000, 84, 110 },
+    { 9001, 72, 80 },
+    { 14000, 76, 0 },
+    { 20000, 84, 0 },
+};
+static const int numTestEvents = sizeof(testEvents) / sizeof(testEvents[0]);
+
+/// stands in for MIDIReceiver: the events above, with offsets relative to the host buffer being processed
+class TestEventQueue {
+public:
+    TestEventQueue(VoiceManager& voiceManager) :
+    mVoiceManager(voiceManager),
+    mBufferStart(0),
+    mNextEvent(0) {};
+
+    int getNextEventOffset(int nFrames) {
+        if (mNextEvent == numTestEvents || testEvents[mNextEvent].frame - mBufferStart >= nFrames) {
+            return nFrames;
+        }
+        return testEvents[mNextEvent].frame - mBufferStart;
+    }
+    void advance(int offset) {
+        while (mNextEvent < numTestEvents && testEvents[mNextEvent].frame - mBufferStart <= offset) {
+            const TestEvent& event = testEvents[mNextEvent++];
+            if (event.velocity > 0) {
+                mVoiceManager.onNoteOn(event.noteNumber, event.velocity);
+            } else {
+                mVoiceManager.onNoteOff(event.noteNumber, 0);
+            }
+        }
+    }
+    inline void coalesceControlChanges(int) {} // notes only - nothing supersedes anything
+    inline void Flush(int nFrames) { mBufferStart += nFrames; }
+
+private:
+    VoiceManager& mVoiceManager;
+    int mBufferStart;
+    int mNextEvent;
+};
+
+// renders TEST_FRAMES frames in host buffers of the sizes in schedule, round and round, into output (left channel, then right). returns
+// false if the latency invariant broke
+static bool renderSchedule(const std::vector<int>& schedule, std::vector<double>& output) {
+    VoiceManager *voiceManager = new VoiceManager(); // big
+    srand(1); // the voices' random detune and pan - after the Oscillators, which seed from the clock
+    voiceManager->initOpenCL();
+    voiceManager->setSampleRate(44100.0);
+    // the knobs' defaults (Synthesis.cpp)
+    voiceManager->updateInharmonicityCoeff(0.003f);
+    voiceManager->updateNumPartials(10);
+    voiceManager->updateStringDetuneRange(0.001f);
+    voiceManager->updatePartialDetuneRange(1.0f);
+    voiceManager->updateDamping(2.5f);
+    voiceManager->updateLinearTerm(0.3f);
+    voiceManager->updateSquaredTerm(1.0f);
+    voiceManager->updateCubicTerm(0.3f);
+    voiceManager->updateBrightnessA(0.4f);
+    voiceManager->updateBrightnessB(0.2f);
+    voiceManager->updatePitchBendCoarse(0.5f);
+    voiceManager->updatePitchBendFine(0.5f);
+    voiceManager->updateMaxVoicesPerKey(1);
+    voiceManager->updateDamperDamping(100.0f);
+    voiceManager->updateAudibilityFloor(-60.0f);
+
+    TestEventQueue events(*voiceManager);
+    BlockFifo<TestEventQueue> *blockFifo = new BlockFifo<TestEventQueue>(*voiceManager, events);
+    int latency = voiceManager->getMaxBlockSize();
+    blockFifo->reset(latency);
+
+    output.assign(TEST_FRAMES * NUM_CHANNELS, 0.0);
+    bool ok = true;
+    int frame = 0;
+    for (int i = 0; frame < TEST_FRAMES; i++) {
+        int nFrames = std::min(schedule[i % schedule.size()], TEST_FRAMES - frame);
+        double* outputs[NUM_CHANNELS] = { &output[frame], &output[TEST_FRAMES + frame] };
+        blockFifo->process(outputs, nFrames);
+        frame += nFrames;
+        int level = blockFifo->getOutputRing().getReadSpace() + blockFifo->getBlockPosition();
+        if (level != latency && ok) {
+            printf("  FIFO holds %d frames + %d of a block after frame %d, should be %d\n", blockFifo->getOutputRing().getReadSpace(), blockFifo->getBlockPosition(), frame, latency);
+            ok = false;
+        }
+    }
+
+    delete blockFifo;
+    delete voiceManager;
+    return ok;
+}
+
+int main() {
+    std::vector<double> reference;
+    renderSchedule(std::vector<int>(1, MIN_BLOCK_SIZE), reference);
+    double peak = 0.0;
+    for (size_t i = 0; i < reference.size(); i++) {
+        peak = std::max(peak, std::fabs(reference[i]));
+    }
+    if (peak < 0.01) {
+        printf("reference is silent (peak %g)\n", peak);
+        return 1;
+    }
+
+    static const int varying[] = { 1, 37, 511, 1023, 64, 3, 200, 4096, 2 };
+    std::vector<std::vector<int> > schedules;
+    schedules.push_back(std::vector<int>(1, 1));
+    schedules.push_back(std::vector<int>(1, 37));
+    schedules.push_back(std::vector<int>(1, 511));
+    schedules.push_back(std::vector<int>(1, 1023));
+    schedules.push_back(std::vector<int>(1, 4097)); // more than a batch can hold
+    schedules.push_back(std::vector<int>(varying, varying + sizeof(varying) / sizeof(varying[0])));
+
+    int failures = 0;
+    for (size_t s = 0; s < schedules.size(); s++) {
+        std::vector<double> output;
+        bool ok = renderSchedule(schedules[s], output);
+        double difference = 0.0;
+        int worstFrame = 0;
+        for (size_t i = 0; i < output.size(); i++) {
+            if (std::fabs(output[i] - reference[i]) > difference) {
+                difference = std::fabs(output[i] - reference[i]);
+                worstFrame = (int)(i % TEST_FRAMES);
+            }
+        }
+        ok = ok && difference <= TEST_TOLERANCE;
+        printf("%s host buffers of %d%s: largest difference %g (frame %d)\n", ok ? "ok  " : "FAIL", schedules[s][0], schedules[s].size() > 1 ? ", ..." : "", difference, worstFrame);
+        failures += ok ? 0 : 1;
+    }
+    return failures > 0 ? 1 : 0;
+}